@@ -1,31 +1,69 @@
 // Include Dependencies
 #include "lib/nlohmann/json.hpp"
+#include <algorithm>
 #include <arpa/inet.h>
+#include <bit>
+#include <cctype>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <csignal>
+#include <cstring>
+#include <exception>
+#include <deque>
 #include <curl/curl.h>
+#include <endian.h>
 #include <fcntl.h>
+#include <filesystem>
 #include <fstream>
+#include <functional>
+#include <future>
 #include <iomanip>
 #include <iostream>
+#include <limits>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <netdb.h>
 #include <netinet/in.h>
+#include <netinet/udp.h>
+#include <numeric>
 #include <openssl/sha.h>
+#include <optional>
 #include <random>
+#include <set>
 #include <sstream>
 #include <string>
-#include <sys/select.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/timerfd.h>
+#include <sys/un.h>
+#include <thread>
 #include <unistd.h>
+#include <unordered_map>
 #include <vector>
 
 using json = nlohmann::json;
 
 // Decoding Functions
 
+// lists and dictionaries nested deeper than this are rejected, so a peer
+// cannot exhaust the stack
+constexpr int max_bencode_depth = 64;
+
 // function to decode bencoded value
-json decode_bencoded_value(const std::string &encoded_value, size_t &pos) {
+json decode_bencoded_value(const std::string &encoded_value, size_t &pos,
+                           int depth = 0) {
   // throw an error when the size doesn't match
   if (pos >= encoded_value.size()) {
     throw std::runtime_error("Unexpected end of encoded value");
   }
+  if (depth > max_bencode_depth) {
+    throw std::runtime_error("Bencoded value nested too deeply");
+  }
   // store current char
   char c = encoded_value[pos];
 
@@ -40,7 +78,7 @@ json decode_bencoded_value(const std::string &encoded_value, size_t &pos) {
     // store the length of the encoded string
     int64_t len = std::stoll(encoded_value.substr(pos, colon - pos));
     // check if the length matches the user input
-    if (colon + 1 + len > encoded_value.size()) {
+    if (len < 0 || colon + 1 + len > encoded_value.size()) {
       throw std::runtime_error("String length exceeds data");
     }
     // store the decoded value
@@ -70,7 +108,7 @@ json decode_bencoded_value(const std::string &encoded_value, size_t &pos) {
     json list = json::array();
     // make a loop to decode the value inside the main function
     while (pos < encoded_value.size() && encoded_value[pos] != 'e') {
-      list.push_back(decode_bencoded_value(encoded_value, pos));
+      list.push_back(decode_bencoded_value(encoded_value, pos, depth + 1));
     }
     // check for erros
     if (pos >= encoded_value.size() || encoded_value[pos] != 'e') {
@@ -87,11 +125,11 @@ json decode_bencoded_value(const std::string &encoded_value, size_t &pos) {
     // make the functioon to decode the dictionary
     while (pos < encoded_value.size() && encoded_value[pos] != 'e') {
       // store each key for the whole dictionary in the end
-      json key = decode_bencoded_value(encoded_value, pos);
+      json key = decode_bencoded_value(encoded_value, pos, depth + 1);
       if (!key.is_string()) {
         throw std::runtime_error("Dictionary key must be string");
       }
-      json value = decode_bencoded_value(encoded_value, pos);
+      json value = decode_bencoded_value(encoded_value, pos, depth + 1);
       dict[key.get<std::string>()] = value;
     }
     // check for errors and return the values
@@ -171,575 +209,9009 @@ size_t write_callback(void *contents, size_t size, size_t nmemb, void *userp) {
   return total_size;
 }
 
-// fliter the HTTP  & HTTPS from the annouce list
-std::string select_tracker_url(const json &torrent) {
+// Peer Addressing
+
+// peer address returned by a tracker, either IPv4 or IPv6
+struct peer_endpoint {
+  std::string ip;
+  uint16_t port = 0;
+  int family = AF_INET;
+
+  bool operator==(const peer_endpoint &other) const {
+    return family == other.family && port == other.port && ip == other.ip;
+  }
+};
+
+// print a peer as ip:port, or [ip]:port for IPv6
+std::string format_endpoint(const peer_endpoint &peer) {
+  if (peer.family == AF_INET6) {
+    return "[" + peer.ip + "]:" + std::to_string(peer.port);
+  }
+  return peer.ip + ":" + std::to_string(peer.port);
+}
+
+// fill a socket address for the peer, returns the address length
+socklen_t make_sockaddr(const peer_endpoint &peer, sockaddr_storage &addr) {
+  std::memset(&addr, 0, sizeof(addr));
+  if (peer.family == AF_INET6) {
+    auto *addr6 = reinterpret_cast<sockaddr_in6 *>(&addr);
+    addr6->sin6_family = AF_INET6;
+    addr6->sin6_port = htons(peer.port);
+    if (inet_pton(AF_INET6, peer.ip.c_str(), &addr6->sin6_addr) <= 0) {
+      throw std::runtime_error("Invalid peer IP");
+    }
+    return sizeof(sockaddr_in6);
+  }
+  auto *addr4 = reinterpret_cast<sockaddr_in *>(&addr);
+  addr4->sin_family = AF_INET;
+  addr4->sin_port = htons(peer.port);
+  if (inet_pton(AF_INET, peer.ip.c_str(), &addr4->sin_addr) <= 0) {
+    throw std::runtime_error("Invalid peer IP");
+  }
+  return sizeof(sockaddr_in);
+}
+
+// build an endpoint from the address of an accepted socket
+peer_endpoint endpoint_from_sockaddr(const sockaddr_storage &addr) {
+  peer_endpoint peer;
+  char buf[INET6_ADDRSTRLEN] = {0};
+  if (addr.ss_family == AF_INET6) {
+    auto *addr6 = reinterpret_cast<const sockaddr_in6 *>(&addr);
+    // dual-stack sockets report IPv4 peers as v4-mapped addresses
+    if (IN6_IS_ADDR_V4MAPPED(&addr6->sin6_addr)) {
+      inet_ntop(AF_INET, addr6->sin6_addr.s6_addr + 12, buf, sizeof(buf));
+      peer.family = AF_INET;
+    } else {
+      inet_ntop(AF_INET6, &addr6->sin6_addr, buf, sizeof(buf));
+      peer.family = AF_INET6;
+    }
+    peer.port = ntohs(addr6->sin6_port);
+  } else {
+    auto *addr4 = reinterpret_cast<const sockaddr_in *>(&addr);
+    inet_ntop(AF_INET, &addr4->sin_addr, buf, sizeof(buf));
+    peer.port = ntohs(addr4->sin_port);
+  }
+  peer.ip = buf;
+  return peer;
+}
+
+// parse compact peers: 6 bytes per IPv4 peer (BEP 23) or 18 per IPv6 (BEP 7)
+std::vector<peer_endpoint> parse_compact_peers(const std::string &peers,
+                                               int family) {
+  size_t addr_size = family == AF_INET6 ? 16 : 4;
+  size_t entry_size = addr_size + 2;
+  if (peers.size() % entry_size != 0) {
+    throw std::runtime_error("Invalid peers string length");
+  }
+  std::vector<peer_endpoint> result;
+  for (size_t i = 0; i < peers.size(); i += entry_size) {
+    char buf[INET6_ADDRSTRLEN] = {0};
+    inet_ntop(family, peers.data() + i, buf, sizeof(buf));
+    peer_endpoint peer;
+    peer.ip = buf;
+    peer.port = (static_cast<unsigned char>(peers[i + addr_size]) << 8) |
+                static_cast<unsigned char>(peers[i + addr_size + 1]);
+    peer.family = family;
+    result.push_back(peer);
+  }
+  return result;
+}
+
+// the compact form of one peer, as parse_compact_peers reads it
+std::string encode_compact_peer(const peer_endpoint &peer) {
+  size_t addr_size = peer.family == AF_INET6 ? 16 : 4;
+  std::string entry(addr_size + 2, '\0');
+  if (inet_pton(peer.family, peer.ip.c_str(), entry.data()) <= 0)
+    throw std::runtime_error("Invalid peer IP");
+  entry[addr_size] = static_cast<char>(peer.port >> 8);
+  entry[addr_size + 1] = static_cast<char>(peer.port & 0xFF);
+  return entry;
+}
+
+// collect every peer from a decoded tracker response
+std::vector<peer_endpoint> parse_tracker_peers(const json &tracker_response) {
+  if (tracker_response.contains("failure reason") &&
+      tracker_response["failure reason"].is_string()) {
+    throw std::runtime_error(
+        "Tracker error: " +
+        tracker_response["failure reason"].get<std::string>());
+  }
+  std::vector<peer_endpoint> peers_list;
+  if (tracker_response.contains("peers")) {
+    const json &peers = tracker_response["peers"];
+    if (peers.is_string()) {
+      peers_list = parse_compact_peers(peers.get<std::string>(), AF_INET);
+    }
+    // some trackers ignore compact=1 and send a list of dictionaries
+    else if (peers.is_array()) {
+      for (const auto &entry : peers) {
+        if (!entry.is_object() || !entry.contains("ip") ||
+            !entry["ip"].is_string() || !entry.contains("port") ||
+            !entry["port"].is_number_integer()) {
+          continue;
+        }
+        peer_endpoint peer;
+        peer.ip = entry["ip"].get<std::string>();
+        peer.port = static_cast<uint16_t>(entry["port"].get<int64_t>());
+        peer.family =
+            peer.ip.find(':') != std::string::npos ? AF_INET6 : AF_INET;
+        peers_list.push_back(peer);
+      }
+    } else {
+      throw std::runtime_error("Invalid 'peers' field: expected string");
+    }
+  }
+  if (tracker_response.contains("peers6") &&
+      tracker_response["peers6"].is_string()) {
+    auto peers6 =
+        parse_compact_peers(tracker_response["peers6"].get<std::string>(),
+                            AF_INET6);
+    peers_list.insert(peers_list.end(), peers6.begin(), peers6.end());
+  }
+  if (!tracker_response.contains("peers") &&
+      !tracker_response.contains("peers6")) {
+    throw std::runtime_error("Invalid 'peers' field: expected string");
+  }
+  return peers_list;
+}
+
+// Tracker Protocol
+
+const std::string client_peer_id = "-CC0001-123456789012";
+// first port we try to listen on; 6881-6889 is the traditional range
+const uint16_t default_listen_port = 6881;
+
+// swarm size as reported by a tracker announce or scrape
+struct swarm_info {
+  int64_t seeders = -1;
+  int64_t leechers = -1;
+  int64_t completed = -1;
+
+  bool known() const { return seeders >= 0 || leechers >= 0; }
+};
+
+// what a single announce gives back
+struct announce_response {
+  std::vector<peer_endpoint> peers;
+  int64_t interval = 0;
+  swarm_info swarm;
+};
+
+// every tracker in the torrent: announce-list tiers first, then announce
+std::vector<std::string> tracker_urls(const json &torrent) {
+  std::vector<std::string> urls;
+  auto add = [&urls](const json &tracker) {
+    if (!tracker.is_string())
+      return;
+    std::string url = tracker.get<std::string>();
+    if ((url.substr(0, 7) == "http://" || url.substr(0, 8) == "https://" ||
+         url.substr(0, 6) == "udp://") &&
+        std::find(urls.begin(), urls.end(), url) == urls.end()) {
+      urls.push_back(url);
+    }
+  };
   if (torrent.contains("announce-list") &&
       torrent["announce-list"].is_array()) {
     for (const auto &list : torrent["announce-list"]) {
       if (list.is_array()) {
         for (const auto &tracker : list) {
-          if (tracker.is_string()) {
-            std::string url = tracker.get<std::string>();
-            if (url.substr(0, 7) == "http://" ||
-                url.substr(0, 8) == "https://") {
-              return url;
-            }
-          }
+          add(tracker);
         }
       }
     }
   }
-  if (torrent.contains("announce") && torrent["announce"].is_string()) {
-    std::string url = torrent["announce"].get<std::string>();
-    if (url.substr(0, 7) == "http://" || url.substr(0, 8) == "https://") {
-      return url;
-    }
+  if (torrent.contains("announce")) {
+    add(torrent["announce"]);
+  }
+  if (urls.empty()) {
+    throw std::runtime_error("No valid tracker found");
   }
-  throw std::runtime_error("No valid HTTP/HTTPS tracker found");
+  return urls;
 }
 
-// Peer Comunication Handle
+// one DNS cache, TLS session cache and connection pool for every tracker
+// request in the process, so torrents on the same tracker pay its
+// handshake once. Requests run on several threads, hence the locks
+class http_share {
+public:
+  // never destroyed: announces may still be running as the process exits
+  static CURLSH *get() {
+    static http_share *share = new http_share;
+    return share->share_;
+  }
 
-// handshake to downalod a peice
-void exchange_peer_messages(const std::string &saved_path,
-                            const std::string &info_hash,
-                            const std::pair<std::string, uint16_t> &peer,
-                            int piece_index, int piece_length,
-                            const std::string &pieces) {
-  int sockfd = socket(AF_INET, SOCK_STREAM, 0);
-  if (sockfd < 0)
-    throw std::runtime_error("Failed to create socket");
+private:
+  http_share() {
+    share_ = curl_share_init();
+    if (!share_)
+      return;
+    curl_share_setopt(share_, CURLSHOPT_LOCKFUNC, lock);
+    curl_share_setopt(share_, CURLSHOPT_UNLOCKFUNC, unlock);
+    curl_share_setopt(share_, CURLSHOPT_USERDATA, this);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_DNS);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_SSL_SESSION);
+    curl_share_setopt(share_, CURLSHOPT_SHARE, CURL_LOCK_DATA_CONNECT);
+  }
 
-  struct timeval timeout = {10, 0};
-  setsockopt(sockfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
-  setsockopt(sockfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+  static void lock(CURL *, curl_lock_data data, curl_lock_access, void *user) {
+    static_cast<http_share *>(user)->locks_[data].lock();
+  }
 
-  sockaddr_in peer_addr = {AF_INET, htons(peer.second)};
-  if (inet_pton(AF_INET, peer.first.c_str(), &peer_addr.sin_addr) <= 0) {
-    close(sockfd);
-    throw std::runtime_error("Invalid peer IP");
+  static void unlock(CURL *, curl_lock_data data, void *user) {
+    static_cast<http_share *>(user)->locks_[data].unlock();
   }
 
-  int flags = fcntl(sockfd, F_GETFL, 0);
-  fcntl(sockfd, F_SETFL, flags | O_NONBLOCK);
+  CURLSH *share_ = nullptr;
+  std::mutex locks_[CURL_LOCK_DATA_LAST];
+};
 
-  int connect_result =
-      connect(sockfd, (struct sockaddr *)&peer_addr, sizeof(peer_addr));
-  if (connect_result < 0 && errno != EINPROGRESS) {
-    close(sockfd);
-    throw std::runtime_error("Failed to connect to peer");
+// run an HTTP GET and return the body
+std::string http_get(const std::string &url) {
+  CURL *curl = curl_easy_init();
+  if (!curl)
+    throw std::runtime_error("Failed to initialize CURL");
+  std::string response;
+  if (CURLSH *share = http_share::get())
+    curl_easy_setopt(curl, CURLOPT_SHARE, share);
+  curl_easy_setopt(curl, CURLOPT_URL, url.c_str());
+  curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
+  curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
+  curl_easy_setopt(curl, CURLOPT_TIMEOUT, 15L);
+  curl_easy_setopt(curl, CURLOPT_NOSIGNAL, 1L);
+  CURLcode res = curl_easy_perform(curl);
+  if (res != CURLE_OK) {
+    curl_easy_cleanup(curl);
+    throw std::runtime_error("CURL request failed: " +
+                             std::string(curl_easy_strerror(res)));
   }
+  curl_easy_cleanup(curl);
+  return response;
+}
 
-  if (connect_result < 0) {
-    fd_set write_fds;
-    FD_ZERO(&write_fds);
-    FD_SET(sockfd, &write_fds);
-    struct timeval connect_timeout = {5, 0};
-    if (select(sockfd + 1, nullptr, &write_fds, nullptr, &connect_timeout) <=
-        0) {
-      close(sockfd);
-      throw std::runtime_error("Connection timeout");
-    }
-    int error;
-    socklen_t len = sizeof(error);
-    if (getsockopt(sockfd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 ||
-        error != 0) {
-      close(sockfd);
-      throw std::runtime_error("Connection failed");
-    }
+// read the optional integer field of a tracker dictionary
+int64_t tracker_int(const json &dict, const std::string &key) {
+  if (dict.contains(key) && dict[key].is_number_integer()) {
+    return dict[key].get<int64_t>();
   }
-  fcntl(sockfd, F_SETFL, flags);
+  return -1;
+}
 
-  std::random_device rd;
-  std::mt19937 gen(rd());
-  std::uniform_int_distribution<> dis(0, 255);
-  std::vector<unsigned char> peer_id(20);
-  for (auto &byte : peer_id)
-    byte = static_cast<unsigned char>(dis(gen));
+// announce to an HTTP tracker
+announce_response announce_http(const std::string &tracker_url,
+                                const unsigned char *info_hash, int64_t left,
+                                uint16_t port) {
+  std::string encoded_info_hash =
+      url_encode_info_hash(info_hash, SHA_DIGEST_LENGTH);
+  std::string query = tracker_url +
+                      (tracker_url.find('?') == std::string::npos ? "?" : "&") +
+                      "info_hash=" + encoded_info_hash +
+                      "&peer_id=" + client_peer_id +
+                      "&port=" + std::to_string(port) +
+                      "&uploaded=0&downloaded=0&left=" +
+                      std::to_string(left) + "&compact=1";
 
-  std::vector<char> handshake(68, 0);
-  handshake[0] = 19;
-  std::copy_n("BitTorrent protocol", 19, handshake.begin() + 1);
-  std::copy(info_hash.begin(), info_hash.end(), handshake.begin() + 28);
-  std::copy(peer_id.begin(), peer_id.end(), handshake.begin() + 48);
+  json tracker_response = decode_bencoded_value(http_get(query));
+  announce_response result;
+  result.peers = parse_tracker_peers(tracker_response);
+  result.interval = tracker_int(tracker_response, "interval");
+  result.swarm.seeders = tracker_int(tracker_response, "complete");
+  result.swarm.leechers = tracker_int(tracker_response, "incomplete");
+  result.swarm.completed = tracker_int(tracker_response, "downloaded");
+  return result;
+}
 
-  if (send(sockfd, handshake.data(), handshake.size(), 0) !=
-      static_cast<ssize_t>(handshake.size())) {
-    close(sockfd);
-    throw std::runtime_error("Failed to send handshake");
+// derive the scrape URL from an announce URL (BEP 48 convention)
+std::string scrape_url(const std::string &announce_url) {
+  size_t query = announce_url.find('?');
+  size_t slash = announce_url.rfind('/', query);
+  if (slash == std::string::npos ||
+      announce_url.compare(slash + 1, 8, "announce") != 0) {
+    throw std::runtime_error("Tracker does not support scrape");
   }
+  return announce_url.substr(0, slash + 1) + "scrape" +
+         announce_url.substr(slash + 9);
+}
 
-  std::vector<char> response(68);
-  ssize_t received = 0;
-  while (received < 68) {
-    ssize_t bytes = recv(sockfd, response.data() + received, 68 - received, 0);
-    if (bytes <= 0) {
-      close(sockfd);
-      throw std::runtime_error("Failed to receive handshake");
-    }
-    received += bytes;
-  }
-
-  if (response[0] != 19 ||
-      std::strncmp(response.data() + 1, "BitTorrent protocol", 19) != 0) {
-    close(sockfd);
-    throw std::runtime_error("Invalid handshake response");
-  }
-
-  uint32_t msg_len;
-  received = 0;
-  while (received < 4) {
-    ssize_t bytes = recv(sockfd, reinterpret_cast<char *>(&msg_len) + received,
-                         4 - received, 0);
-    if (bytes <= 0) {
-      close(sockfd);
-      throw std::runtime_error("Failed to receive message length");
-    }
-    received += bytes;
-  }
-  msg_len = ntohl(msg_len);
-  std::vector<char> payload(msg_len);
-  if (msg_len > 0) {
-    received = 0;
-    while (received < static_cast<ssize_t>(msg_len)) {
-      ssize_t bytes =
-          recv(sockfd, payload.data() + received, msg_len - received, 0);
-      if (bytes <= 0) {
-        close(sockfd);
-        throw std::runtime_error("Failed to receive bitfield");
-      }
-      received += bytes;
-    }
-  }
-  if (msg_len < 1 || payload[0] != 5) {
-    close(sockfd);
-    throw std::runtime_error("Expected bitfield message");
-  }
-
-  char interested_msg[5] = {0, 0, 0, 1, 2};
-  if (send(sockfd, interested_msg, 5, 0) != 5) {
-    close(sockfd);
-    throw std::runtime_error("Failed to send interested message");
-  }
-
-  received = 0;
-  while (received < 4) {
-    ssize_t bytes = recv(sockfd, reinterpret_cast<char *>(&msg_len) + received,
-                         4 - received, 0);
-    if (bytes <= 0) {
-      close(sockfd);
-      throw std::runtime_error("Failed to receive unchoke length");
-    }
-    received += bytes;
-  }
-  msg_len = ntohl(msg_len);
-  if (msg_len != 1) {
-    close(sockfd);
-    throw std::runtime_error("Expected unchoke message length 1");
-  }
-  char msg_id;
-  if (recv(sockfd, &msg_id, 1, 0) != 1 || msg_id != 1) {
-    close(sockfd);
-    throw std::runtime_error("Expected unchoke message");
-  }
-
-  const uint32_t block_size = 16384;
-  std::vector<char> piece(piece_length);
-  uint32_t offset = 0;
-  while (offset < static_cast<uint32_t>(piece_length)) {
-    uint32_t request_len =
-        std::min(static_cast<uint32_t>(piece_length) - offset, block_size);
-
-    char request_msg[17] = {0, 0, 0, 13, 6};
-    *reinterpret_cast<uint32_t *>(request_msg + 5) = htonl(piece_index);
-    *reinterpret_cast<uint32_t *>(request_msg + 9) = htonl(offset);
-    *reinterpret_cast<uint32_t *>(request_msg + 13) = htonl(request_len);
-    if (send(sockfd, request_msg, 17, 0) != 17) {
-      close(sockfd);
-      throw std::runtime_error("Failed to send request");
-    }
-
-    received = 0;
-    while (received < 4) {
-      ssize_t bytes =
-          recv(sockfd, reinterpret_cast<char *>(&msg_len) + received,
-               4 - received, 0);
-      if (bytes <= 0) {
-        close(sockfd);
-        throw std::runtime_error("Failed to receive piece length");
-      }
-      received += bytes;
-    }
-    msg_len = ntohl(msg_len);
-    if (msg_len < 9) {
-      close(sockfd);
-      throw std::runtime_error("Invalid piece message length");
-    }
-    std::vector<char> piece_payload(msg_len);
-    received = 0;
-    while (received < static_cast<ssize_t>(msg_len)) {
-      ssize_t bytes =
-          recv(sockfd, piece_payload.data() + received, msg_len - received, 0);
-      if (bytes <= 0) {
-        close(sockfd);
-        throw std::runtime_error("Failed to receive piece");
-      }
-      received += bytes;
-    }
-    if (piece_payload[0] != 7) {
-      close(sockfd);
-      throw std::runtime_error("Expected piece message");
-    }
-    uint32_t received_index =
-        ntohl(*reinterpret_cast<uint32_t *>(piece_payload.data() + 1));
-    uint32_t received_begin =
-        ntohl(*reinterpret_cast<uint32_t *>(piece_payload.data() + 5));
-    if (received_index != static_cast<uint32_t>(piece_index) ||
-        received_begin != offset) {
-      close(sockfd);
-      throw std::runtime_error("Received incorrect block");
-    }
-    std::copy(piece_payload.begin() + 9,
-              piece_payload.begin() + 9 + request_len, piece.begin() + offset);
-    offset += request_len;
-  }
+// scrape an HTTP tracker for one info hash
+swarm_info scrape_http(const std::string &tracker_url,
+                       const unsigned char *info_hash) {
+  std::string url = scrape_url(tracker_url);
+  url += (url.find('?') == std::string::npos ? "?" : "&");
+  url += "info_hash=" + url_encode_info_hash(info_hash, SHA_DIGEST_LENGTH);
+
+  json response = decode_bencoded_value(http_get(url));
+  if (response.contains("failure reason") &&
+      response["failure reason"].is_string()) {
+    throw std::runtime_error("Tracker error: " +
+                             response["failure reason"].get<std::string>());
+  }
+  std::string key(reinterpret_cast<const char *>(info_hash), SHA_DIGEST_LENGTH);
+  if (!response.contains("files") || !response["files"].is_object() ||
+      !response["files"].contains(key)) {
+    throw std::runtime_error("Scrape response has no entry for torrent");
+  }
+  const json &entry = response["files"][key];
+  swarm_info swarm;
+  swarm.seeders = tracker_int(entry, "complete");
+  swarm.leechers = tracker_int(entry, "incomplete");
+  swarm.completed = tracker_int(entry, "downloaded");
+  return swarm;
+}
+
+// UDP tracker protocol (BEP 15)
 
-  close(sockfd);
+const uint64_t udp_tracker_protocol_id = 0x41727101980ULL;
+const int udp_tracker_attempts = 2;
+const int udp_tracker_timeout_sec = 3;
 
-  unsigned char computed_hash[SHA_DIGEST_LENGTH];
-  SHA1(reinterpret_cast<const unsigned char *>(piece.data()), piece.size(),
-       computed_hash);
-  std::string expected_hash = pieces.substr(piece_index * 20, 20);
-  if (std::string(reinterpret_cast<char *>(computed_hash), SHA_DIGEST_LENGTH) !=
-      expected_hash) {
-    throw std::runtime_error("Piece hash mismatch");
-  }
-
-  std::ofstream outfile(saved_path, std::ios::binary);
-  if (!outfile)
-    throw std::runtime_error("Failed to open output file");
-  outfile.write(piece.data(), piece.size());
-  outfile.close();
+void write_be16(unsigned char *out, uint16_t value) {
+  value = htons(value);
+  std::memcpy(out, &value, 2);
 }
 
-// main function logic
+void write_be32(unsigned char *out, uint32_t value) {
+  value = htonl(value);
+  std::memcpy(out, &value, 4);
+}
 
-int main(int argc, char *argv[]) {
-  // flush after every cerr and cout
-  std::cout << std::unitbuf;
-  std::cerr << std::unitbuf;
+void write_be64(unsigned char *out, uint64_t value) {
+  value = htobe64(value);
+  std::memcpy(out, &value, 8);
+}
 
-  // check if there is a command or not and then store it
-  if (argc < 2) {
-    std::cerr << "Usage: " << argv[0] << " <command> [args]" << std::endl;
-    return 1;
-  }
-  std::string command = argv[1];
+uint16_t read_be16(const unsigned char *in) {
+  uint16_t value;
+  std::memcpy(&value, in, 2);
+  return ntohs(value);
+}
 
-  // info command function
-  if (command == "info") {
-    if (argc < 3) {
-      std::cerr << "Usage: " << argv[0] << " info <torrent_file>" << std::endl;
-      return 1;
-    }
+uint32_t read_be32(const unsigned char *in) {
+  uint32_t value;
+  std::memcpy(&value, in, 4);
+  return ntohl(value);
+}
 
-    std::ifstream file(argv[2], std::ios::binary);
-    if (!file) {
-      std::cerr << "Error: Could not open file " << argv[2] << std::endl;
-      return 1;
+uint64_t read_be64(const unsigned char *in) {
+  uint64_t value;
+  std::memcpy(&value, in, 8);
+  return be64toh(value);
+}
+
+// a connected UDP socket to a tracker, closed on scope exit
+class udp_tracker_socket {
+public:
+  explicit udp_tracker_socket(const std::string &tracker_url) {
+    // udp://host:port[/path]
+    std::string rest = tracker_url.substr(6);
+    rest = rest.substr(0, rest.find('/'));
+    std::string host, port;
+    if (!rest.empty() && rest[0] == '[') {
+      size_t close_bracket = rest.find(']');
+      if (close_bracket == std::string::npos)
+        throw std::runtime_error("Invalid UDP tracker URL");
+      host = rest.substr(1, close_bracket - 1);
+      if (close_bracket + 1 < rest.size() && rest[close_bracket + 1] == ':')
+        port = rest.substr(close_bracket + 2);
+    } else {
+      size_t colon = rest.rfind(':');
+      if (colon == std::string::npos)
+        throw std::runtime_error("Invalid UDP tracker URL");
+      host = rest.substr(0, colon);
+      port = rest.substr(colon + 1);
     }
-    std::string encoded_value((std::istreambuf_iterator<char>(file)), {});
 
-    try {
-      json torrent = decode_bencoded_value(encoded_value);
-      std::string tracker_url = select_tracker_url(torrent);
-      if (!torrent.contains("info") || !torrent["info"].is_object()) {
-        throw std::runtime_error("Missing or invalid 'info' field");
-      }
-      json info = torrent["info"];
-      if (!info.contains("length") || !info["length"].is_number()) {
-        throw std::runtime_error("Missing or invalid 'length' field");
-      }
-      if (!info.contains("piece length") || !info["piece length"].is_number()) {
-        throw std::runtime_error("Missing or invalid 'piece length' field");
-      }
-      if (!info.contains("pieces") || !info["pieces"].is_string()) {
-        throw std::runtime_error("Missing or invalid 'pieces' field");
-      }
+    addrinfo hints = {};
+    hints.ai_family = AF_UNSPEC;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo *res = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &res) != 0 || !res) {
+      throw std::runtime_error("Failed to resolve tracker " + host);
+    }
+    fd_ = socket(res->ai_family, SOCK_DGRAM, 0);
+    family_ = res->ai_family;
+    if (fd_ < 0 || ::connect(fd_, res->ai_addr, res->ai_addrlen) < 0) {
+      freeaddrinfo(res);
+      if (fd_ >= 0)
+        close(fd_);
+      throw std::runtime_error("Failed to reach tracker " + host);
+    }
+    freeaddrinfo(res);
+    struct timeval timeout = {udp_tracker_timeout_sec, 0};
+    setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+  }
+  ~udp_tracker_socket() { close(fd_); }
+  udp_tracker_socket(const udp_tracker_socket &) = delete;
+  udp_tracker_socket &operator=(const udp_tracker_socket &) = delete;
 
-      int64_t length = info["length"].get<int64_t>();
-      int64_t piece_length = info["piece length"].get<int64_t>();
-      std::string pieces = info["pieces"].get<std::string>();
-      std::string bencoded_info = bencode(info);
-      unsigned char hash[SHA_DIGEST_LENGTH];
-      SHA1(reinterpret_cast<const unsigned char *>(bencoded_info.c_str()),
-           bencoded_info.size(), hash);
+  int family() const { return family_; }
 
-      std::stringstream hex_hash;
-      hex_hash << std::hex << std::setfill('0');
-      for (int i = 0; i < SHA_DIGEST_LENGTH; ++i) {
-        hex_hash << std::setw(2) << static_cast<int>(hash[i]);
-      }
+  // send a request and wait for the reply carrying the same transaction id
+  std::vector<unsigned char> transact(std::vector<unsigned char> request,
+                                      uint32_t action) {
+    std::random_device rd;
+    for (int attempt = 0; attempt < udp_tracker_attempts; ++attempt) {
+      uint32_t transaction_id = rd();
+      write_be32(request.data() + 12, transaction_id);
+      if (send(fd_, request.data(), request.size(), 0) < 0)
+        throw std::runtime_error("Failed to send to tracker");
 
-      if (pieces.size() % 20 != 0) {
-        throw std::runtime_error("Invalid pieces string length");
-      }
-      std::vector<std::string> piece_hashes;
-      for (size_t i = 0; i < pieces.size(); i += 20) {
-        std::stringstream hex_piece;
-        hex_piece << std::hex << std::setfill('0');
-        for (size_t j = 0; j < 20; ++j) {
-          hex_piece << std::setw(2)
-                    << static_cast<int>(
-                           static_cast<unsigned char>(pieces[i + j]));
+      std::vector<unsigned char> reply(2048);
+      ssize_t bytes;
+      while ((bytes = recv(fd_, reply.data(), reply.size(), 0)) >= 8) {
+        if (read_be32(reply.data() + 4) != transaction_id)
+          continue;
+        reply.resize(bytes);
+        uint32_t reply_action = read_be32(reply.data());
+        if (reply_action == 3) {
+          throw std::runtime_error(
+              "Tracker error: " +
+              std::string(reply.begin() + 8, reply.end()));
         }
-        piece_hashes.push_back(hex_piece.str());
-      }
-
-      std::cout << "Tracker URL: " << tracker_url << std::endl;
-      std::cout << "Length: " << length << std::endl;
-      std::cout << "Info Hash: " << hex_hash.str() << std::endl;
-      std::cout << "Piece Length: " << piece_length << std::endl;
-      std::cout << "Piece Hashes:" << std::endl;
-      for (const auto &hash : piece_hashes) {
-        std::cout << hash << std::endl;
+        if (reply_action != action)
+          throw std::runtime_error("Unexpected UDP tracker action");
+        return reply;
       }
-    } catch (const std::exception &e) {
-      std::cerr << "Error: " << e.what() << std::endl;
-      return 1;
     }
+    throw std::runtime_error("UDP tracker timeout");
   }
-  // peers command handle
-  else if (command == "peers") {
-    if (argc < 3) {
-      std::cerr << "Usage: " << argv[0] << " peers <torrent_file>" << std::endl;
-      return 1;
-    }
 
-    std::ifstream file(argv[2], std::ios::binary);
-    if (!file) {
-      std::cerr << "Error: Could not open file " << argv[2] << std::endl;
-      return 1;
-    }
-    std::string encoded_value((std::istreambuf_iterator<char>(file)), {});
+  // obtain the connection id that every other request must carry
+  uint64_t connect_id() {
+    std::vector<unsigned char> request(16);
+    write_be64(request.data(), udp_tracker_protocol_id);
+    write_be32(request.data() + 8, 0);
+    std::vector<unsigned char> reply = transact(request, 0);
+    if (reply.size() < 16)
+      throw std::runtime_error("Short UDP connect response");
+    return read_be64(reply.data() + 8);
+  }
 
-    try {
-      json torrent = decode_bencoded_value(encoded_value);
-      if (!torrent.contains("info") || !torrent["info"].is_object()) {
-        throw std::runtime_error("Missing or invalid 'info' field");
-      }
-      json info = torrent["info"];
-      if (!info.contains("length") || !info["length"].is_number()) {
-        throw std::runtime_error("Missing or invalid 'length' field");
-      }
+private:
+  int fd_ = -1;
+  int family_ = AF_INET;
+};
 
-      std::string tracker_url = select_tracker_url(torrent);
-      int64_t length = info["length"].get<int64_t>();
-      std::string bencoded_info = bencode(info);
-      unsigned char hash[SHA_DIGEST_LENGTH];
-      SHA1(reinterpret_cast<const unsigned char *>(bencoded_info.c_str()),
-           bencoded_info.size(), hash);
+// announce to a UDP tracker
+announce_response announce_udp(const std::string &tracker_url,
+                               const unsigned char *info_hash, int64_t left,
+                               uint16_t port) {
+  udp_tracker_socket tracker(tracker_url);
+  uint64_t connection_id = tracker.connect_id();
 
-      std::string encoded_info_hash =
-          url_encode_info_hash(hash, SHA_DIGEST_LENGTH);
-      std::string peer_id = "-CC0001-123456789012";
-      std::string query =
-          tracker_url + "?info_hash=" + encoded_info_hash +
-          "&peer_id=" + peer_id +
-          "&port=6881&uploaded=0&downloaded=0&left=" + std::to_string(length) +
-          "&compact=1";
-
-      CURL *curl = curl_easy_init();
-      if (!curl)
-        throw std::runtime_error("Failed to initialize CURL");
-      std::string response;
-      curl_easy_setopt(curl, CURLOPT_URL, query.c_str());
-      curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-      curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-      CURLcode res = curl_easy_perform(curl);
-      if (res != CURLE_OK) {
-        curl_easy_cleanup(curl);
-        throw std::runtime_error("CURL request failed: " +
-                                 std::string(curl_easy_strerror(res)));
-      }
-      curl_easy_cleanup(curl);
-
-      json tracker_response = decode_bencoded_value(response);
-      if (!tracker_response.contains("peers") ||
-          !tracker_response["peers"].is_string()) {
-        throw std::runtime_error("Invalid 'peers' field: expected string");
-      }
-      std::string peers = tracker_response["peers"].get<std::string>();
-      if (peers.size() % 6 != 0) {
-        throw std::runtime_error("Invalid peers string length");
-      }
-
-      for (size_t i = 0; i < peers.size(); i += 6) {
-        std::cout << static_cast<int>(static_cast<unsigned char>(peers[i]))
-                  << "."
-                  << static_cast<int>(static_cast<unsigned char>(peers[i + 1]))
-                  << "."
-                  << static_cast<int>(static_cast<unsigned char>(peers[i + 2]))
-                  << "."
-                  << static_cast<int>(static_cast<unsigned char>(peers[i + 3]))
-                  << ":"
-                  << ((static_cast<unsigned char>(peers[i + 4]) << 8) |
-                      static_cast<unsigned char>(peers[i + 5]))
-                  << std::endl;
-      }
+  std::vector<unsigned char> request(98, 0);
+  write_be64(request.data(), connection_id);
+  write_be32(request.data() + 8, 1);
+  std::copy_n(info_hash, SHA_DIGEST_LENGTH, request.begin() + 16);
+  std::copy(client_peer_id.begin(), client_peer_id.end(), request.begin() + 36);
+  write_be64(request.data() + 64, left);
+  write_be32(request.data() + 92, 0xFFFFFFFF); // num_want: tracker default
+  request[96] = port >> 8;
+  request[97] = port & 0xFF;
+
+  std::vector<unsigned char> reply = tracker.transact(request, 1);
+  if (reply.size() < 20)
+    throw std::runtime_error("Short UDP announce response");
+  announce_response result;
+  result.interval = read_be32(reply.data() + 8);
+  result.swarm.leechers = read_be32(reply.data() + 12);
+  result.swarm.seeders = read_be32(reply.data() + 16);
+  // peers come back in the address family we talked to the tracker over
+  std::string peers(reply.begin() + 20, reply.end());
+  size_t entry_size = tracker.family() == AF_INET6 ? 18 : 6;
+  peers.resize(peers.size() - peers.size() % entry_size);
+  result.peers = parse_compact_peers(peers, tracker.family());
+  return result;
+}
+
+// scrape a UDP tracker for one info hash
+swarm_info scrape_udp(const std::string &tracker_url,
+                      const unsigned char *info_hash) {
+  udp_tracker_socket tracker(tracker_url);
+  uint64_t connection_id = tracker.connect_id();
+
+  std::vector<unsigned char> request(36, 0);
+  write_be64(request.data(), connection_id);
+  write_be32(request.data() + 8, 2);
+  std::copy_n(info_hash, SHA_DIGEST_LENGTH, request.begin() + 16);
+
+  std::vector<unsigned char> reply = tracker.transact(request, 2);
+  if (reply.size() < 20)
+    throw std::runtime_error("Short UDP scrape response");
+  swarm_info swarm;
+  swarm.seeders = read_be32(reply.data() + 8);
+  swarm.completed = read_be32(reply.data() + 12);
+  swarm.leechers = read_be32(reply.data() + 16);
+  return swarm;
+}
+
+bool is_udp_tracker(const std::string &url) {
+  return url.substr(0, 6) == "udp://";
+}
+
+// announce to any supported tracker
+announce_response announce_to_tracker(const std::string &tracker_url,
+                                      const unsigned char *info_hash,
+                                      int64_t left, uint16_t port) {
+  if (is_udp_tracker(tracker_url)) {
+    return announce_udp(tracker_url, info_hash, left, port);
+  }
+  return announce_http(tracker_url, info_hash, left, port);
+}
+
+// scrape any supported tracker
+swarm_info scrape_tracker(const std::string &tracker_url,
+                          const unsigned char *info_hash) {
+  if (is_udp_tracker(tracker_url)) {
+    return scrape_udp(tracker_url, info_hash);
+  }
+  return scrape_http(tracker_url, info_hash);
+}
+
+// Swarm-Aware Scheduling
+
+// scrape result of one tracker
+struct tracker_status {
+  std::string url;
+  swarm_info swarm;
+  std::string error;
+};
+
+// scrape every tracker at once; failures are recorded, not thrown
+std::vector<tracker_status> scrape_all_trackers(const json &torrent,
+                                                const unsigned char *info_hash) {
+  std::vector<std::string> urls = tracker_urls(torrent);
+  std::vector<std::future<swarm_info>> pending;
+  for (const auto &url : urls) {
+    pending.push_back(std::async(std::launch::async, scrape_tracker, url,
+                                 info_hash));
+  }
+  std::vector<tracker_status> statuses;
+  for (size_t i = 0; i < urls.size(); ++i) {
+    tracker_status status;
+    status.url = urls[i];
+    try {
+      status.swarm = pending[i].get();
     } catch (const std::exception &e) {
-      std::cerr << "Error: " << e.what() << std::endl;
-      return 1;
+      status.error = e.what();
     }
+    statuses.push_back(status);
   }
-  // download peice handle
-  else if (command == "download_piece") {
-    if (argc < 6 || std::string(argv[2]) != "-o") {
-      std::cerr << "Usage: " << argv[0]
-                << " download_piece -o <save_path> <torrent_file> <piece_index>"
-                << std::endl;
-      return 1;
-    }
-    std::string saved_path = argv[3];
-    std::string file_name = argv[4];
-    int piece_index = std::atoi(argv[5]);
+  return statuses;
+}
 
-    std::ifstream file(file_name, std::ios::binary);
-    if (!file) {
-      std::cerr << "Error: Could not open file " << file_name << std::endl;
-      return 1;
-    }
-    std::string encoded_value((std::istreambuf_iterator<char>(file)), {});
+// trackers with more seeders (then leechers) come first, unknown ones keep
+// their announce-list order at the back
+bool tracker_ranks_before(const tracker_status &a, const tracker_status &b) {
+  if (a.swarm.known() != b.swarm.known())
+    return a.swarm.known();
+  if (a.swarm.seeders != b.swarm.seeders)
+    return a.swarm.seeders > b.swarm.seeders;
+  return a.swarm.leechers > b.swarm.leechers;
+}
 
-    try {
-      json torrent = decode_bencoded_value(encoded_value);
-      if (!torrent.contains("info") || !torrent["info"].is_object()) {
-        throw std::runtime_error("Missing or invalid 'info' field");
-      }
-      json info = torrent["info"];
-      if (!info.contains("length") || !info["length"].is_number()) {
-        throw std::runtime_error("Missing or invalid 'length' field");
-      }
-      if (!info.contains("piece length") || !info["piece length"].is_number()) {
-        throw std::runtime_error("Missing or invalid 'piece length' field");
-      }
-      if (!info.contains("pieces") || !info["pieces"].is_string()) {
-        throw std::runtime_error("Missing or invalid 'pieces' field");
-      }
+void rank_trackers(std::vector<tracker_status> &statuses) {
+  std::stable_sort(statuses.begin(), statuses.end(), tracker_ranks_before);
+}
 
-      int64_t file_length = info["length"].get<int64_t>();
-      int piece_length = info["piece length"].get<int64_t>();
-      std::string pieces = info["pieces"].get<std::string>();
-      std::string tracker_url = select_tracker_url(torrent);
+// the best numbers any tracker reported
+swarm_info best_swarm(const std::vector<tracker_status> &statuses) {
+  swarm_info best;
+  for (const auto &status : statuses) {
+    best.seeders = std::max(best.seeders, status.swarm.seeders);
+    best.leechers = std::max(best.leechers, status.swarm.leechers);
+    best.completed = std::max(best.completed, status.swarm.completed);
+  }
+  return best;
+}
 
-      if (piece_index < 0 ||
-          piece_index >= static_cast<int>(pieces.size() / 20)) {
-        throw std::runtime_error("Invalid piece index");
-      }
+// how many peers are worth connecting to for a swarm of this size
+size_t connection_limit_for_swarm(const swarm_info &swarm) {
+  const size_t min_connections = 3;
+  const size_t max_connections = 50;
+  if (!swarm.known())
+    return min_connections;
+  // every seeder is useful, leechers only have part of the file
+  int64_t useful =
+      std::max<int64_t>(swarm.seeders, 0) + std::max<int64_t>(swarm.leechers, 0) / 2;
+  return std::clamp<size_t>(useful, min_connections, max_connections);
+}
 
-      std::string bencoded_info = bencode(info);
-      unsigned char info_hash[SHA_DIGEST_LENGTH];
-      SHA1(reinterpret_cast<const unsigned char *>(bencoded_info.c_str()),
-           bencoded_info.size(), info_hash);
-
-      std::string encoded_info_hash =
-          url_encode_info_hash(info_hash, SHA_DIGEST_LENGTH);
-      std::string peer_id = "-CC0001-123456789012";
-      std::string query = tracker_url + "?info_hash=" + encoded_info_hash +
-                          "&peer_id=" + peer_id +
-                          "&port=6881&uploaded=0&downloaded=0&left=" +
-                          std::to_string(file_length) + "&compact=1";
-
-      CURL *curl = curl_easy_init();
-      if (!curl)
-        throw std::runtime_error("Failed to initialize CURL");
-      std::string response;
-      curl_easy_setopt(curl, CURLOPT_URL, query.c_str());
-      curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-      curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-      CURLcode res = curl_easy_perform(curl);
-      if (res != CURLE_OK) {
-        curl_easy_cleanup(curl);
-        throw std::runtime_error("CURL request failed: " +
-                                 std::string(curl_easy_strerror(res)));
-      }
-      curl_easy_cleanup(curl);
-
-      json tracker_response = decode_bencoded_value(response);
-      if (!tracker_response.contains("peers") ||
-          !tracker_response["peers"].is_string()) {
-        throw std::runtime_error("Invalid 'peers' field: expected string");
-      }
-      std::string peers = tracker_response["peers"].get<std::string>();
-      std::vector<std::pair<std::string, uint16_t>> peers_list;
-      if (peers.size() % 6 == 0) {
-        for (size_t i = 0; i < peers.size(); i += 6) {
-          std::string ip =
-              std::to_string(static_cast<unsigned char>(peers[i])) + "." +
-              std::to_string(static_cast<unsigned char>(peers[i + 1])) + "." +
-              std::to_string(static_cast<unsigned char>(peers[i + 2])) + "." +
-              std::to_string(static_cast<unsigned char>(peers[i + 3]));
-          uint16_t port = (static_cast<unsigned char>(peers[i + 4]) << 8) |
-                          static_cast<unsigned char>(peers[i + 5]);
-          peers_list.emplace_back(ip, port);
-        }
-      }
-
-      int num_pieces = (file_length + piece_length - 1) / piece_length;
-      int current_piece_length =
-          piece_index == num_pieces - 1 && file_length % piece_length != 0
-              ? file_length % piece_length
-              : piece_length;
-
-      if (peers_list.empty())
-        throw std::runtime_error("No peers available");
-
-      bool success = false;
-      std::string last_error;
-      for (const auto &peer : peers_list) {
-        try {
-          exchange_peer_messages(
-              saved_path,
-              std::string(reinterpret_cast<char *>(info_hash),
-                          SHA_DIGEST_LENGTH),
-              peer, piece_index, current_piece_length, pieces);
-          success = true;
-          std::cout << "Piece " << piece_index << " downloaded to "
-                    << saved_path << std::endl;
-          break;
-        } catch (const std::exception &e) {
-          last_error = e.what();
-          std::cerr << "Failed with peer " << peer.first << ":" << peer.second
-                    << " - " << e.what() << std::endl;
-        }
-      }
-      if (!success) {
-        throw std::runtime_error("Failed to download piece: " + last_error);
-      }
+// torrents with healthier swarms should be started first
+double swarm_priority(const swarm_info &swarm) {
+  if (!swarm.known())
+    return 0.0;
+  return std::max<int64_t>(swarm.seeders, 0) * 1.0 +
+         std::max<int64_t>(swarm.leechers, 0) * 0.25;
+}
+
+// seeding helps most where leechers outnumber the seeders serving them
+double seed_demand(const swarm_info &swarm) {
+  if (!swarm.known())
+    return 0.0;
+  return static_cast<double>(std::max<int64_t>(swarm.leechers, 0)) /
+         (std::max<int64_t>(swarm.seeders, 0) + 1);
+}
+
+// result of discovering peers across all trackers
+struct peer_discovery {
+  std::vector<peer_endpoint> peers;
+  swarm_info swarm;
+  int64_t interval = 0; // shortest re-announce interval any tracker asked for
+  std::vector<tracker_status> trackers;
+};
+
+// scrape and announce to every tracker at once, so the announce never waits
+// on a scrape, then order the peers so the ones from the best-seeded
+// tracker are tried first
+peer_discovery discover_peers(const json &torrent,
+                              const unsigned char *info_hash, int64_t left,
+                              uint16_t port = default_listen_port) {
+  std::vector<std::string> urls = tracker_urls(torrent);
+  std::vector<std::future<swarm_info>> scrapes;
+  std::vector<std::future<announce_response>> announces;
+  for (const auto &url : urls) {
+    scrapes.push_back(std::async(std::launch::async, scrape_tracker, url,
+                                 info_hash));
+    announces.push_back(std::async(std::launch::async, announce_to_tracker,
+                                   url, info_hash, left, port));
+  }
+
+  peer_discovery result;
+  std::vector<announce_response> responses(urls.size());
+  std::string last_error;
+  for (size_t i = 0; i < urls.size(); ++i) {
+    tracker_status status;
+    status.url = urls[i];
+    try {
+      status.swarm = scrapes[i].get();
     } catch (const std::exception &e) {
-      std::cerr << "Error: " << e.what() << std::endl;
-      return 1;
+      status.error = e.what();
     }
+    try {
+      responses[i] = announces[i].get();
+      // announce counts fill in for trackers that do not support scrape
+      if (!status.swarm.known())
+        status.swarm = responses[i].swarm;
+      if (responses[i].interval > 0 &&
+          (result.interval == 0 || responses[i].interval < result.interval))
+        result.interval = responses[i].interval;
+    } catch (const std::exception &e) {
+      last_error = e.what();
+    }
+    result.trackers.push_back(status);
   }
-  // download handle
-  else if (command == "download") {
-    if (argc < 5 || std::string(argv[2]) != "-o") {
-      std::cerr << "Usage: " << argv[0]
-                << " download -o <output_file> <torrent_file>" << std::endl;
+
+  // rank the trackers and take their peers in that order
+  std::vector<size_t> order(urls.size());
+  std::iota(order.begin(), order.end(), 0);
+  std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+    return tracker_ranks_before(result.trackers[a], result.trackers[b]);
+  });
+  std::vector<tracker_status> ranked;
+  for (size_t i : order) {
+    ranked.push_back(result.trackers[i]);
+    for (const auto &peer : responses[i].peers) {
+      if (std::find(result.peers.begin(), result.peers.end(), peer) ==
+          result.peers.end()) {
+        result.peers.push_back(peer);
+      }
+    }
+  }
+  result.trackers = std::move(ranked);
+  result.swarm = best_swarm(result.trackers);
+  if (result.peers.empty() && !last_error.empty()) {
+    throw std::runtime_error(last_error);
+  }
+  return result;
+}
+
+// Peer Cache
+
+// what we remember about a peer between runs
+struct cached_peer {
+  peer_endpoint endpoint;
+  int64_t last_seen = 0;       // unix time of the last successful handshake
+  double throughput = 0.0;     // smoothed download rate in bytes per second
+  int failures = 0;            // failures since the last success
+};
+
+// directory for files that can be rebuilt, $XDG_CACHE_HOME or ~/.cache
+std::filesystem::path cache_directory() {
+  const char *xdg = std::getenv("XDG_CACHE_HOME");
+  if (xdg && *xdg)
+    return std::filesystem::path(xdg) / "bittorrent";
+  const char *home = std::getenv("HOME");
+  if (home && *home)
+    return std::filesystem::path(home) / ".cache" / "bittorrent";
+  return std::filesystem::temp_directory_path() / "bittorrent";
+}
+
+// hex string of a binary hash
+std::string hex_string(const unsigned char *data, size_t length) {
+  std::stringstream ss;
+  ss << std::hex << std::setfill('0');
+  for (size_t i = 0; i < length; ++i) {
+    ss << std::setw(2) << static_cast<int>(data[i]);
+  }
+  return ss.str();
+}
+
+// binary bytes of a hex string
+std::string decode_hex(const std::string &hex) {
+  if (hex.size() % 2 != 0)
+    throw std::runtime_error("Invalid hex string");
+  std::string bytes;
+  for (size_t i = 0; i < hex.size(); i += 2) {
+    if (!std::isxdigit(static_cast<unsigned char>(hex[i])) ||
+        !std::isxdigit(static_cast<unsigned char>(hex[i + 1])))
+      throw std::runtime_error("Invalid hex string");
+    bytes += static_cast<char>(std::stoi(hex.substr(i, 2), nullptr, 16));
+  }
+  return bytes;
+}
+
+int64_t unix_now() {
+  return std::chrono::duration_cast<std::chrono::seconds>(
+             std::chrono::system_clock::now().time_since_epoch())
+      .count();
+}
+
+// peers that completed a handshake for one torrent, kept on disk so the next
+// run can connect before the tracker answers
+class peer_cache {
+public:
+  explicit peer_cache(const unsigned char *info_hash)
+      : path_(cache_directory() / "peers" /
+              (hex_string(info_hash, SHA_DIGEST_LENGTH) + ".json")) {
+    load();
+  }
+  ~peer_cache() {
+    try {
+      save();
+    } catch (const std::exception &e) {
+      std::cerr << "Failed to save peer cache: " << e.what() << std::endl;
+    }
+  }
+  peer_cache(const peer_cache &) = delete;
+  peer_cache &operator=(const peer_cache &) = delete;
+
+  // the peer answered our handshake
+  void record_handshake(const peer_endpoint &peer) {
+    cached_peer &entry = find_or_add(peer);
+    entry.last_seen = unix_now();
+    entry.failures = 0;
+    dirty_ = true;
+  }
+
+  // the peer delivered data at this rate
+  void record_transfer(const peer_endpoint &peer, double bytes_per_second) {
+    cached_peer &entry = find_or_add(peer);
+    entry.throughput = entry.throughput == 0.0
+                           ? bytes_per_second
+                           : 0.7 * entry.throughput + 0.3 * bytes_per_second;
+    entry.last_seen = unix_now();
+    dirty_ = true;
+  }
+
+  // the peer could not be reached or misbehaved; only known peers are tracked
+  void record_failure(const peer_endpoint &peer) {
+    for (auto &entry : peers_) {
+      if (entry.endpoint == peer) {
+        entry.failures++;
+        dirty_ = true;
+      }
+    }
+  }
+
+  // the best peers first: fast, recently seen and rarely failing
+  std::vector<peer_endpoint> best_peers(size_t count) const {
+    std::vector<std::pair<double, peer_endpoint>> ranked;
+    int64_t now = unix_now();
+    for (const auto &entry : peers_) {
+      if (entry.failures >= max_failures)
+        continue;
+      ranked.emplace_back(score(entry, now), entry.endpoint);
+    }
+    std::stable_sort(ranked.begin(), ranked.end(),
+                     [](const auto &a, const auto &b) { return a.first > b.first; });
+    std::vector<peer_endpoint> result;
+    for (size_t i = 0; i < ranked.size() && i < count; ++i) {
+      result.push_back(ranked[i].second);
+    }
+    return result;
+  }
+
+  // write the cache back if anything changed, dropping dead and old entries
+  void save() {
+    if (!dirty_)
+      return;
+    int64_t now = unix_now();
+    std::erase_if(peers_, [now](const cached_peer &entry) {
+      return entry.failures >= max_failures ||
+             now - entry.last_seen > max_age_seconds;
+    });
+    std::stable_sort(peers_.begin(), peers_.end(),
+                     [now](const cached_peer &a, const cached_peer &b) {
+                       return score(a, now) > score(b, now);
+                     });
+    if (peers_.size() > max_entries)
+      peers_.resize(max_entries);
+
+    json list = json::array();
+    for (const auto &entry : peers_) {
+      list.push_back({{"ip", entry.endpoint.ip},
+                      {"port", entry.endpoint.port},
+                      {"ipv6", entry.endpoint.family == AF_INET6},
+                      {"last_seen", entry.last_seen},
+                      {"throughput", entry.throughput},
+                      {"failures", entry.failures}});
+    }
+    std::filesystem::create_directories(path_.parent_path());
+    // write then rename so a crash never leaves a half written cache
+    std::filesystem::path temp_path = path_;
+    temp_path += ".tmp";
+    {
+      std::ofstream out(temp_path);
+      if (!out)
+        throw std::runtime_error("Failed to open " + temp_path.string());
+      out << list.dump();
+    }
+    std::filesystem::rename(temp_path, path_);
+    dirty_ = false;
+  }
+
+private:
+  static constexpr int max_failures = 5;
+  static constexpr size_t max_entries = 200;
+  static constexpr int64_t max_age_seconds = 30 * 24 * 3600;
+
+  static double score(const cached_peer &entry, int64_t now) {
+    double age_days = std::max<int64_t>(now - entry.last_seen, 0) / 86400.0;
+    return (1.0 + entry.throughput / 1024.0) / (1.0 + age_days) /
+           (1.0 + entry.failures);
+  }
+
+  cached_peer &find_or_add(const peer_endpoint &peer) {
+    for (auto &entry : peers_) {
+      if (entry.endpoint == peer)
+        return entry;
+    }
+    cached_peer entry;
+    entry.endpoint = peer;
+    peers_.push_back(entry);
+    return peers_.back();
+  }
+
+  // a missing or corrupt cache just means starting cold
+  void load() {
+    std::ifstream in(path_);
+    if (!in)
+      return;
+    try {
+      json list = json::parse(in);
+      for (const auto &item : list) {
+        cached_peer entry;
+        entry.endpoint.ip = item.at("ip").get<std::string>();
+        entry.endpoint.port = item.at("port").get<uint16_t>();
+        entry.endpoint.family = item.value("ipv6", false) ? AF_INET6 : AF_INET;
+        entry.last_seen = item.value("last_seen", int64_t{0});
+        entry.throughput = item.value("throughput", 0.0);
+        entry.failures = item.value("failures", 0);
+        peers_.push_back(entry);
+      }
+    } catch (const std::exception &e) {
+      std::cerr << "Ignoring corrupt peer cache " << path_ << ": " << e.what()
+                << std::endl;
+      peers_.clear();
+    }
+  }
+
+  std::filesystem::path path_;
+  std::vector<cached_peer> peers_;
+  bool dirty_ = false;
+};
+
+// Timers
+
+// hierarchical timing wheel: four levels of 64 slots over 100 ms ticks, so
+// scheduling and cancelling are O(1) and each tick only looks at one slot;
+// timers on the outer levels cascade inward as their time comes closer
+class timer_wheel {
+public:
+  using timer_id = uint64_t; // 0 is never a valid timer
+  using callback = std::function<void()>;
+  static constexpr int tick_ms = 100;
+
+  timer_wheel() : start_(std::chrono::steady_clock::now()) {
+    // the first nodes are list heads: one per slot plus the expiring list
+    nodes_.resize(levels * slots + 1);
+    for (uint32_t i = 0; i < nodes_.size(); ++i)
+      nodes_[i].prev = nodes_[i].next = i;
+  }
+
+  // run fn once, no earlier than delay from now and at most a tick later
+  timer_id schedule(std::chrono::milliseconds delay, callback fn) {
+    uint64_t due_ms = elapsed_ms(std::chrono::steady_clock::now()) +
+                      std::max<int64_t>(0, delay.count());
+    uint32_t index = allocate();
+    node &timer = nodes_[index];
+    timer.expires =
+        std::max(current_tick_ + 1, (due_ms + tick_ms - 1) / tick_ms);
+    timer.fn = std::move(fn);
+    place(index);
+    return (static_cast<uint64_t>(timer.generation) << 32) | index;
+  }
+
+  // safe for timers that already ran or were cancelled
+  void cancel(timer_id id) {
+    uint32_t index = static_cast<uint32_t>(id & 0xFFFFFFFF);
+    if (index < first_timer || index >= nodes_.size() ||
+        nodes_[index].generation != (id >> 32) || !nodes_[index].linked)
+      return;
+    unlink(index);
+    release(index);
+  }
+
+  // run every timer that is due, in tick order
+  void advance(std::chrono::steady_clock::time_point now) {
+    uint64_t target = tick_of(now);
+    while (current_tick_ < target) {
+      current_tick_++;
+      cascade(1);
+      // detach the slot first so callbacks can schedule and cancel freely
+      uint32_t slot = head(0, current_tick_ & slot_mask);
+      splice(slot, expiring_head);
+      while (nodes_[expiring_head].next != expiring_head) {
+        uint32_t index = nodes_[expiring_head].next;
+        unlink(index);
+        callback fn = std::move(nodes_[index].fn);
+        release(index);
+        fn();
+      }
+    }
+  }
+
+private:
+  static constexpr int levels = 4;
+  static constexpr uint32_t slot_bits = 6;
+  static constexpr uint32_t slots = 1u << slot_bits;
+  static constexpr uint64_t slot_mask = slots - 1;
+  static constexpr uint32_t expiring_head = levels * slots;
+  static constexpr uint32_t first_timer = expiring_head + 1;
+
+  struct node {
+    uint64_t expires = 0;
+    uint32_t prev = 0, next = 0;
+    uint32_t generation = 0;
+    bool linked = false;
+    callback fn;
+  };
+
+  uint64_t elapsed_ms(std::chrono::steady_clock::time_point now) const {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(now - start_)
+        .count();
+  }
+
+  uint64_t tick_of(std::chrono::steady_clock::time_point now) const {
+    return elapsed_ms(now) / tick_ms;
+  }
+
+  // ticks covered by the levels below this one
+  static uint64_t span(int level) { return uint64_t{1} << (slot_bits * level); }
+
+  static uint32_t head(int level, uint64_t slot) {
+    return static_cast<uint32_t>(level * slots + slot);
+  }
+
+  uint32_t allocate() {
+    uint32_t index;
+    if (!free_.empty()) {
+      index = free_.back();
+      free_.pop_back();
+    } else {
+      index = static_cast<uint32_t>(nodes_.size());
+      nodes_.emplace_back();
+    }
+    nodes_[index].generation = ++generation_;
+    return index;
+  }
+
+  void release(uint32_t index) {
+    nodes_[index].fn = nullptr;
+    free_.push_back(index);
+  }
+
+  // the level is the first whose span covers the time left
+  void place(uint32_t index) {
+    node &timer = nodes_[index];
+    uint64_t remaining =
+        timer.expires > current_tick_ ? timer.expires - current_tick_ : 0;
+    int level = 0;
+    while (level < levels - 1 && remaining >= span(level + 1))
+      level++;
+    uint64_t expires = timer.expires;
+    // timers beyond the outermost level wait in its last slot and cascade
+    // again when it comes round
+    if (remaining >= span(levels))
+      expires = current_tick_ + span(levels) - 1;
+    link(index, head(level, (expires >> (slot_bits * level)) & slot_mask));
+  }
+
+  // when a level wraps, redistribute the next slot of the level above
+  void cascade(int level) {
+    if (level >= levels || (current_tick_ & (span(level) - 1)) != 0)
+      return;
+    cascade(level + 1);
+    uint32_t slot =
+        head(level, (current_tick_ >> (slot_bits * level)) & slot_mask);
+    while (nodes_[slot].next != slot) {
+      uint32_t index = nodes_[slot].next;
+      unlink(index);
+      place(index);
+    }
+  }
+
+  void link(uint32_t index, uint32_t list) {
+    node &timer = nodes_[index];
+    timer.prev = nodes_[list].prev;
+    timer.next = list;
+    nodes_[timer.prev].next = index;
+    nodes_[list].prev = index;
+    timer.linked = true;
+  }
+
+  void unlink(uint32_t index) {
+    node &timer = nodes_[index];
+    nodes_[timer.prev].next = timer.next;
+    nodes_[timer.next].prev = timer.prev;
+    timer.linked = false;
+  }
+
+  // move every timer in one list to the end of another
+  void splice(uint32_t from, uint32_t to) {
+    while (nodes_[from].next != from) {
+      uint32_t index = nodes_[from].next;
+      unlink(index);
+      link(index, to);
+    }
+  }
+
+  std::chrono::steady_clock::time_point start_;
+  uint64_t current_tick_ = 0;
+  uint32_t generation_ = 0;
+  std::vector<node> nodes_;
+  std::vector<uint32_t> free_;
+};
+
+// Event Loop
+
+// thin epoll wrapper: sockets register a handler that gets the ready events
+class event_loop {
+public:
+  using handler = std::function<void(uint32_t)>;
+  using timer_id = timer_wheel::timer_id;
+
+  event_loop() {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    if (epoll_fd_ < 0)
+      throw std::runtime_error("Failed to create epoll instance");
+  }
+  ~event_loop() { close(epoll_fd_); }
+  event_loop(const event_loop &) = delete;
+  event_loop &operator=(const event_loop &) = delete;
+
+  void add(int fd, uint32_t events, handler on_event) {
+    uint64_t generation = ++generation_;
+    epoll_event ev = {};
+    ev.events = events;
+    ev.data.u64 = (generation << 32) | static_cast<uint32_t>(fd);
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &ev) < 0)
+      throw std::runtime_error("Failed to watch socket");
+    handlers_[fd] = {generation, std::move(on_event)};
+  }
+
+  void modify(int fd, uint32_t events) {
+    auto it = handlers_.find(fd);
+    if (it == handlers_.end())
+      return;
+    epoll_event ev = {};
+    ev.events = events;
+    ev.data.u64 = (it->second.generation << 32) | static_cast<uint32_t>(fd);
+    epoll_ctl(epoll_fd_, EPOLL_CTL_MOD, fd, &ev);
+  }
+
+  // stop watching a socket; safe to call from inside a handler
+  void remove(int fd) {
+    if (handlers_.erase(fd))
+      epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+  }
+
+  // run fn after delay from inside run_once; timers cost no syscalls
+  timer_id schedule(std::chrono::milliseconds delay,
+                    timer_wheel::callback fn) {
+    return timers_.schedule(delay, std::move(fn));
+  }
+
+  void cancel(timer_id id) { timers_.cancel(id); }
+
+  // run fn before every wait, for sockets that batch their writes
+  uint64_t add_flusher(std::function<void()> fn) {
+    flushers_[++next_flusher_] = std::move(fn);
+    return next_flusher_;
+  }
+
+  void remove_flusher(uint64_t id) { flushers_.erase(id); }
+
+  // wait up to timeout_ms for events, dispatch them and run due timers
+  void run_once(int timeout_ms) {
+    for (auto &entry : flushers_)
+      entry.second();
+    epoll_event events[64];
+    int count = epoll_wait(epoll_fd_, events, 64, timeout_ms);
+    for (int i = 0; i < count; ++i) {
+      int fd = static_cast<int>(events[i].data.u64 & 0xFFFFFFFF);
+      uint64_t generation = events[i].data.u64 >> 32;
+      auto it = handlers_.find(fd);
+      // the socket may have been removed (or its number reused) by an
+      // earlier handler in this batch
+      if (it == handlers_.end() || it->second.generation != generation)
+        continue;
+      handler on_event = it->second.on_event;
+      on_event(events[i].events);
+    }
+    timers_.advance(std::chrono::steady_clock::now());
+  }
+
+private:
+  struct registration {
+    uint64_t generation;
+    handler on_event;
+  };
+
+  int epoll_fd_ = -1;
+  uint64_t generation_ = 0;
+  std::unordered_map<int, registration> handlers_;
+  timer_wheel timers_;
+  std::map<uint64_t, std::function<void()>> flushers_;
+  uint64_t next_flusher_ = 0;
+};
+
+// Worker Pools
+
+// threads for work the event loop must not wait on, such as hashing pieces
+// and writing them to disk. Jobs start in the order they were submitted;
+// each one's completion runs back on the loop thread, which an eventfd
+// wakes as jobs finish
+class worker_pool {
+public:
+  using work = std::function<void()>;
+  // gets whatever the work threw, or null
+  using completion = std::function<void(std::exception_ptr)>;
+
+  worker_pool(event_loop &loop, size_t threads) : loop_(loop) {
+    wake_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (wake_fd_ < 0)
+      throw std::runtime_error("Failed to create eventfd");
+    loop_.add(wake_fd_, EPOLLIN, [this](uint32_t) { deliver(); });
+    for (size_t i = 0; i < std::max<size_t>(threads, 1); ++i)
+      threads_.emplace_back([this] { run(); });
+  }
+
+  // queued jobs are dropped, running ones finish first
+  ~worker_pool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+      queue_.clear();
+    }
+    work_ready_.notify_all();
+    for (auto &thread : threads_)
+      thread.join();
+    loop_.remove(wake_fd_);
+    close(wake_fd_);
+  }
+  worker_pool(const worker_pool &) = delete;
+  worker_pool &operator=(const worker_pool &) = delete;
+
+  size_t threads() const { return threads_.size(); }
+
+  // run job on a pool thread, then done on the loop thread; owner is who
+  // forget() drops the job for
+  void submit(const void *owner, work job, completion done) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queue_.push_back({owner, std::move(job), std::move(done), nullptr});
+    }
+    work_ready_.notify_one();
+  }
+
+  // drop the owner's queued jobs and wait out its running ones; none of
+  // its completions run once this returns
+  void forget(const void *owner) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    auto owned = [owner](const task &t) { return t.owner == owner; };
+    std::erase_if(queue_, owned);
+    job_finished_.wait(lock, [this, owner] {
+      return std::find(running_.begin(), running_.end(), owner) ==
+             running_.end();
+    });
+    std::erase_if(finished_, owned);
+  }
+
+  // jobs waiting for a thread
+  size_t backlog() const {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return queue_.size();
+  }
+
+private:
+  struct task {
+    const void *owner;
+    work job;
+    completion done;
+    std::exception_ptr error;
+  };
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    while (true) {
+      work_ready_.wait(lock, [this] { return stopping_ || !queue_.empty(); });
+      if (stopping_)
+        return;
+      task next = std::move(queue_.front());
+      queue_.pop_front();
+      running_.push_back(next.owner);
+      lock.unlock();
+      try {
+        next.job();
+      } catch (...) {
+        next.error = std::current_exception();
+      }
+      next.job = nullptr;
+      lock.lock();
+      running_.erase(std::find(running_.begin(), running_.end(), next.owner));
+      // the loop drains every finished job once woken, so only the first
+      // one since the last drain needs to wake it
+      bool wake = finished_.empty();
+      finished_.push_back(std::move(next));
+      job_finished_.notify_all();
+      if (wake) {
+        uint64_t one = 1;
+        if (write(wake_fd_, &one, sizeof(one)) < 0) {
+          // the counter is already set
+        }
+      }
+    }
+  }
+
+  // completions are taken one at a time, so one that makes another owner
+  // forget its jobs keeps theirs from running
+  void deliver() {
+    uint64_t count = 0;
+    if (read(wake_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+      return;
+    while (true) {
+      task next;
+      {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (finished_.empty())
+          return;
+        next = std::move(finished_.front());
+        finished_.pop_front();
+      }
+      if (next.done)
+        next.done(next.error);
+    }
+  }
+
+  event_loop &loop_;
+  int wake_fd_ = -1;
+  mutable std::mutex mutex_;
+  std::condition_variable work_ready_;
+  std::condition_variable job_finished_;
+  std::deque<task> queue_;
+  std::deque<task> finished_;
+  std::vector<const void *> running_;
+  bool stopping_ = false;
+  std::vector<std::thread> threads_;
+};
+
+// run blocking work, such as a tracker request, on a thread of its own and
+// return its future. Unlike std::async's, dropping the future does not
+// wait for the thread: the result is thrown away when it arrives, so the
+// work must own everything it touches
+template <typename Work>
+auto run_detached(Work work) -> std::future<decltype(work())> {
+  std::promise<decltype(work())> promise;
+  auto result = promise.get_future();
+  std::thread([promise = std::move(promise), work = std::move(work)]() mutable {
+    try {
+      promise.set_value(work());
+    } catch (...) {
+      promise.set_exception(std::current_exception());
+    }
+  }).detach();
+  return result;
+}
+
+// Torrent Metadata
+
+// the parts of a single-file torrent the download needs
+struct torrent_meta {
+  std::string info_hash; // raw 20 byte SHA-1 of the info dictionary
+  std::string info;      // the bencoded info dictionary, served to peers
+  std::string name;      // suggested file name, may be empty
+  int64_t length = 0;
+  int64_t piece_length = 0;
+  std::string pieces;
+  int num_pieces = 0;
+
+  int piece_size(int index) const {
+    if (index == num_pieces - 1 && length % piece_length != 0)
+      return static_cast<int>(length % piece_length);
+    return static_cast<int>(piece_length);
+  }
+};
+
+// validate a decoded torrent and pull out what the download needs
+torrent_meta parse_torrent_meta(const json &torrent) {
+  if (!torrent.contains("info") || !torrent["info"].is_object()) {
+    throw std::runtime_error("Missing or invalid 'info' field");
+  }
+  const json &info = torrent["info"];
+  if (!info.contains("length") || !info["length"].is_number()) {
+    throw std::runtime_error("Missing or invalid 'length' field");
+  }
+  if (!info.contains("piece length") || !info["piece length"].is_number()) {
+    throw std::runtime_error("Missing or invalid 'piece length' field");
+  }
+  if (!info.contains("pieces") || !info["pieces"].is_string()) {
+    throw std::runtime_error("Missing or invalid 'pieces' field");
+  }
+
+  torrent_meta meta;
+  meta.length = info["length"].get<int64_t>();
+  meta.piece_length = info["piece length"].get<int64_t>();
+  meta.pieces = info["pieces"].get<std::string>();
+  if (info.contains("name") && info["name"].is_string())
+    meta.name = info["name"].get<std::string>();
+  if (meta.piece_length <= 0 || meta.pieces.size() % 20 != 0) {
+    throw std::runtime_error("Invalid pieces string length");
+  }
+  meta.num_pieces = static_cast<int>(
+      (meta.length + meta.piece_length - 1) / meta.piece_length);
+  if (meta.num_pieces != static_cast<int>(meta.pieces.size() / 20)) {
+    throw std::runtime_error("Piece count does not match file length");
+  }
+
+  meta.info = bencode(info);
+  unsigned char hash[SHA_DIGEST_LENGTH];
+  SHA1(reinterpret_cast<const unsigned char *>(meta.info.c_str()),
+       meta.info.size(), hash);
+  meta.info_hash.assign(reinterpret_cast<char *>(hash), SHA_DIGEST_LENGTH);
+  return meta;
+}
+
+// check which pieces of an existing file match their hashes
+std::vector<bool> verify_pieces(int fd, const torrent_meta &meta) {
+  std::vector<bool> verified(meta.num_pieces, false);
+  std::vector<char> buffer(meta.piece_length);
+  for (int i = 0; i < meta.num_pieces; ++i) {
+    int size = meta.piece_size(i);
+    if (pread(fd, buffer.data(), size, i * meta.piece_length) != size)
+      continue;
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const unsigned char *>(buffer.data()), size, hash);
+    verified[i] = meta.pieces.compare(i * 20, 20,
+                                      reinterpret_cast<char *>(hash),
+                                      SHA_DIGEST_LENGTH) == 0;
+  }
+  return verified;
+}
+
+// Magnet Links
+
+// what a magnet link names: the torrent's info hash plus optional hints
+struct magnet_link {
+  std::string info_hash; // raw 20 bytes
+  std::string name;
+  std::vector<std::string> trackers;
+};
+
+bool is_magnet_link(const std::string &source) {
+  return source.rfind("magnet:?", 0) == 0;
+}
+
+// undo %XX escapes in a query parameter
+std::string url_decode(const std::string &value) {
+  std::string result;
+  for (size_t i = 0; i < value.size(); ++i) {
+    if (value[i] == '%' && i + 2 < value.size() &&
+        std::isxdigit(static_cast<unsigned char>(value[i + 1])) &&
+        std::isxdigit(static_cast<unsigned char>(value[i + 2]))) {
+      result += static_cast<char>(std::stoi(value.substr(i + 1, 2), nullptr, 16));
+      i += 2;
+    } else {
+      result += value[i];
+    }
+  }
+  return result;
+}
+
+// a btih is 40 hex digits or, in older links, 32 base32 characters
+std::string decode_btih(const std::string &btih) {
+  std::string hash;
+  if (btih.size() == 40) {
+    try {
+      return decode_hex(btih);
+    } catch (const std::exception &) {
+      throw std::runtime_error("Invalid info hash in magnet link");
+    }
+  }
+  if (btih.size() == 32) {
+    uint32_t buffer = 0;
+    int bits = 0;
+    for (char c : btih) {
+      c = static_cast<char>(std::toupper(static_cast<unsigned char>(c)));
+      int value;
+      if (c >= 'A' && c <= 'Z')
+        value = c - 'A';
+      else if (c >= '2' && c <= '7')
+        value = c - '2' + 26;
+      else
+        throw std::runtime_error("Invalid info hash in magnet link");
+      buffer = (buffer << 5) | value;
+      bits += 5;
+      if (bits >= 8) {
+        bits -= 8;
+        hash += static_cast<char>((buffer >> bits) & 0xFF);
+      }
+    }
+    return hash;
+  }
+  throw std::runtime_error("Invalid info hash in magnet link");
+}
+
+// pull the info hash, trackers and name out of a magnet URI
+magnet_link parse_magnet_link(const std::string &uri) {
+  magnet_link link;
+  std::stringstream query(uri.substr(8));
+  std::string param;
+  while (std::getline(query, param, '&')) {
+    size_t eq = param.find('=');
+    if (eq == std::string::npos)
+      continue;
+    std::string key = param.substr(0, eq);
+    std::string value = url_decode(param.substr(eq + 1));
+    if (key == "xt" && value.rfind("urn:btih:", 0) == 0) {
+      link.info_hash = decode_btih(value.substr(9));
+    } else if (key == "tr" || key.rfind("tr.", 0) == 0) {
+      if (std::find(link.trackers.begin(), link.trackers.end(), value) ==
+          link.trackers.end())
+        link.trackers.push_back(value);
+    } else if (key == "dn") {
+      link.name = value;
+    }
+  }
+  if (link.info_hash.empty())
+    throw std::runtime_error("Magnet link has no BitTorrent info hash");
+  return link;
+}
+
+// a torrent without its info dictionary: just the link's trackers, one
+// per tier so they are all announced to
+json magnet_torrent(const magnet_link &link) {
+  json torrent = json::object();
+  if (!link.trackers.empty()) {
+    torrent["announce"] = link.trackers.front();
+    json tiers = json::array();
+    for (const auto &tracker : link.trackers)
+      tiers.push_back(json::array({tracker}));
+    torrent["announce-list"] = tiers;
+  }
+  return torrent;
+}
+
+// info dictionaries fetched for magnet links, one bencoded file per hash
+std::filesystem::path metadata_cache_path(const std::string &info_hash) {
+  return cache_directory() / "metadata" /
+         (hex_string(reinterpret_cast<const unsigned char *>(info_hash.data()),
+                     info_hash.size()) +
+          ".info");
+}
+
+// the cached info dictionary, if there is one that still hashes right
+std::optional<std::string> load_cached_metadata(const std::string &info_hash) {
+  std::ifstream in(metadata_cache_path(info_hash), std::ios::binary);
+  if (!in)
+    return std::nullopt;
+  std::string info((std::istreambuf_iterator<char>(in)), {});
+  unsigned char hash[SHA_DIGEST_LENGTH];
+  SHA1(reinterpret_cast<const unsigned char *>(info.data()), info.size(),
+       hash);
+  if (info_hash.compare(0, SHA_DIGEST_LENGTH, reinterpret_cast<char *>(hash),
+                        SHA_DIGEST_LENGTH) != 0)
+    return std::nullopt;
+  return info;
+}
+
+void save_cached_metadata(const std::string &info_hash,
+                          const std::string &info) {
+  std::filesystem::path path = metadata_cache_path(info_hash);
+  std::filesystem::create_directories(path.parent_path());
+  // write then rename so a crash never leaves a half written file
+  std::filesystem::path temp_path = path;
+  temp_path += ".tmp";
+  {
+    std::ofstream out(temp_path, std::ios::binary);
+    if (!out)
+      throw std::runtime_error("Failed to open " + temp_path.string());
+    out.write(info.data(), info.size());
+  }
+  std::filesystem::rename(temp_path, path);
+}
+
+// Peer Wire Protocol
+
+// message ids from BEP 3
+enum wire_id : uint8_t {
+  msg_choke = 0,
+  msg_unchoke = 1,
+  msg_interested = 2,
+  msg_not_interested = 3,
+  msg_have = 4,
+  msg_bitfield = 5,
+  msg_request = 6,
+  msg_piece = 7,
+  msg_cancel = 8,
+  msg_port = 9,
+  // BEP 6 fast extension
+  msg_suggest = 13,
+  msg_have_all = 14,
+  msg_have_none = 15,
+  msg_reject = 16,
+  msg_allowed_fast = 17,
+  msg_extended = 20, // BEP 10, the first payload byte picks the extension
+};
+
+// reserved handshake bits, as byte index and mask
+constexpr int extension_protocol_byte = 5;
+constexpr uint8_t extension_protocol_bit = 0x10;
+constexpr int fast_extension_byte = 7;
+constexpr uint8_t fast_extension_bit = 0x04;
+
+// ids we give extensions in our extension handshake
+constexpr uint8_t ut_metadata_id = 1;
+constexpr uint8_t ut_pex_id = 2;
+
+// BEP 9 message types and the size of each piece of the info dictionary
+enum metadata_type : int64_t {
+  metadata_request = 0,
+  metadata_data = 1,
+  metadata_reject = 2,
+};
+constexpr size_t metadata_piece_size = 16384;
+// info dictionaries larger than this are refused
+constexpr int64_t max_metadata_size = 8 << 20;
+
+const uint32_t block_size = 16384;
+// larger than any legal message, smaller than anything that could hurt us
+const uint32_t max_message_length = 1 << 20;
+
+// one framed message; keep-alives have no id
+struct wire_message {
+  bool keep_alive = false;
+  uint8_t id = 0;
+  std::string payload;
+};
+
+// splits the byte stream from a peer into length-prefixed messages
+class wire_reader {
+public:
+  void feed(const char *data, size_t length) {
+    // drop consumed bytes before growing so the buffer stays small
+    if (pos_ > 0 && pos_ >= buffer_.size() / 2) {
+      buffer_.erase(0, pos_);
+      pos_ = 0;
+    }
+    buffer_.append(data, length);
+  }
+
+  // the next complete message, if one has fully arrived
+  std::optional<wire_message> next() {
+    if (buffer_.size() - pos_ < 4)
+      return std::nullopt;
+    uint32_t length = read_be32(
+        reinterpret_cast<const unsigned char *>(buffer_.data() + pos_));
+    if (length > max_message_length)
+      throw std::runtime_error("Message too large");
+    if (buffer_.size() - pos_ < 4 + static_cast<size_t>(length))
+      return std::nullopt;
+    wire_message message;
+    if (length == 0) {
+      message.keep_alive = true;
+    } else {
+      message.id = static_cast<uint8_t>(buffer_[pos_ + 4]);
+      message.payload.assign(buffer_, pos_ + 5, length - 1);
+    }
+    pos_ += 4 + length;
+    return message;
+  }
+
+private:
+  std::string buffer_;
+  size_t pos_ = 0;
+};
+
+// frame a message for the wire
+std::string encode_message(uint8_t id, const std::string &payload = "") {
+  std::string message(5, '\0');
+  write_be32(reinterpret_cast<unsigned char *>(message.data()),
+             static_cast<uint32_t>(payload.size() + 1));
+  message[4] = static_cast<char>(id);
+  return message + payload;
+}
+
+// payload of request, cancel and similar index/begin/length messages
+std::string encode_block(uint32_t index, uint32_t begin, uint32_t length) {
+  std::string payload(12, '\0');
+  auto *out = reinterpret_cast<unsigned char *>(payload.data());
+  write_be32(out, index);
+  write_be32(out + 4, begin);
+  write_be32(out + 8, length);
+  return payload;
+}
+
+// payload of a have message, the piece index
+std::string encode_have(uint32_t index) {
+  std::string payload(4, '\0');
+  write_be32(reinterpret_cast<unsigned char *>(payload.data()), index);
+  return payload;
+}
+
+// payload of an extended message: the extension's id, a bencoded
+// dictionary and, for ut_metadata data, the raw bytes after it
+std::string encode_extended(uint8_t extension_id, const json &header,
+                            const std::string &trailer = "") {
+  return std::string(1, static_cast<char>(extension_id)) + bencode(header) +
+         trailer;
+}
+
+// a ut_metadata message with the bytes that follow its dictionary
+struct metadata_message {
+  int64_t type = -1;
+  int64_t piece = -1;
+  int64_t total_size = 0;
+  std::string data;
+};
+
+// parse a ut_metadata payload, without the extension id byte
+metadata_message parse_metadata_message(const std::string &payload) {
+  size_t pos = 0;
+  json header = decode_bencoded_value(payload, pos);
+  if (!header.is_object() || !header.contains("msg_type") ||
+      !header["msg_type"].is_number_integer() || !header.contains("piece") ||
+      !header["piece"].is_number_integer())
+    throw std::runtime_error("Invalid metadata message");
+  metadata_message message;
+  message.type = header["msg_type"].get<int64_t>();
+  message.piece = header["piece"].get<int64_t>();
+  if (header.contains("total_size") && header["total_size"].is_number_integer())
+    message.total_size = header["total_size"].get<int64_t>();
+  message.data = payload.substr(pos);
+  return message;
+}
+
+// the id the peer gave an extension in its extension handshake, 0 if none
+uint8_t peer_extension_id(const json &handshake, const std::string &name) {
+  if (!handshake.contains("m") || !handshake["m"].is_object())
+    return 0;
+  const json &m = handshake["m"];
+  if (!m.contains(name) || !m[name].is_number_integer())
+    return 0;
+  int64_t id = m[name].get<int64_t>();
+  return id > 0 && id < 256 ? static_cast<uint8_t>(id) : 0;
+}
+
+// build the 68 byte handshake for a torrent
+std::string build_handshake(const std::string &info_hash,
+                            const std::string &peer_id) {
+  std::string handshake(68, '\0');
+  handshake[0] = 19;
+  std::copy_n("BitTorrent protocol", 19, handshake.begin() + 1);
+  handshake[20 + extension_protocol_byte] |= extension_protocol_bit;
+  handshake[20 + fast_extension_byte] |= fast_extension_bit;
+  std::copy(info_hash.begin(), info_hash.end(), handshake.begin() + 28);
+  std::copy(peer_id.begin(), peer_id.end(), handshake.begin() + 48);
+  return handshake;
+}
+
+// what the other side's handshake told us
+struct peer_handshake {
+  peer_endpoint endpoint;
+  std::string reserved; // 8 bytes of extension bits
+  std::string peer_id;
+  bool inbound = false; // the peer connected to us
+
+  bool supports(int byte, uint8_t bit) const {
+    return (static_cast<uint8_t>(reserved[byte]) & bit) != 0;
+  }
+};
+
+// pick the fields out of a received 68 byte handshake
+peer_handshake parse_handshake(const std::string &in,
+                               const peer_endpoint &endpoint, bool inbound) {
+  peer_handshake peer;
+  peer.endpoint = endpoint;
+  peer.reserved = in.substr(20, 8);
+  peer.peer_id = in.substr(48, 20);
+  peer.inbound = inbound;
+  return peer;
+}
+
+// BEP 6 canonical allowed fast set: pieces derived from the peer's /24 and
+// the info hash, so reconnecting from the same network gets the same ones
+std::vector<uint32_t> allowed_fast_set(const peer_endpoint &peer,
+                                       const std::string &info_hash,
+                                       int num_pieces, size_t count) {
+  std::vector<uint32_t> pieces;
+  in_addr addr;
+  if (peer.family != AF_INET || num_pieces <= 0 ||
+      inet_pton(AF_INET, peer.ip.c_str(), &addr) <= 0)
+    return pieces;
+  count = std::min(count, static_cast<size_t>(num_pieces));
+  std::string x(4, '\0');
+  write_be32(reinterpret_cast<unsigned char *>(x.data()),
+             ntohl(addr.s_addr) & 0xFFFFFF00);
+  x += info_hash;
+  while (pieces.size() < count) {
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const unsigned char *>(x.data()), x.size(), hash);
+    x.assign(reinterpret_cast<char *>(hash), SHA_DIGEST_LENGTH);
+    for (int i = 0; i < 5 && pieces.size() < count; ++i) {
+      uint32_t index = read_be32(hash + i * 4) % num_pieces;
+      if (std::find(pieces.begin(), pieces.end(), index) == pieces.end())
+        pieces.push_back(index);
+    }
+  }
+  return pieces;
+}
+
+// random peer id for our side of the handshake
+std::string random_peer_id() {
+  std::random_device rd;
+  std::mt19937 gen(rd());
+  std::uniform_int_distribution<> dis(0, 255);
+  std::string peer_id(20, '\0');
+  for (auto &byte : peer_id)
+    byte = static_cast<char>(dis(gen));
+  return peer_id;
+}
+
+// Fair Sharing
+
+// deficit round robin over weighted flows. Each visit adds quantum times
+// the flow's weight to its deficit and offers that much, so flows that keep
+// asking get units in proportion to their weights, while a flow that takes
+// less than it is offered drops out and leaves its share to the others
+class drr_scheduler {
+public:
+  // accepts up to offered units for a flow and says how many it took
+  using take_handler = std::function<size_t(size_t flow, size_t offered)>;
+
+  explicit drr_scheduler(double quantum) : quantum_(quantum) {}
+
+  size_t add_flow(double weight) {
+    for (size_t id = 0; id < flows_.size(); ++id) {
+      if (!flows_[id].used) {
+        flows_[id] = flow{weight, 0.0, false, true};
+        return id;
+      }
+    }
+    flows_.push_back(flow{weight, 0.0, false, true});
+    return flows_.size() - 1;
+  }
+
+  void remove_flow(size_t id) { flows_[id] = flow{}; }
+
+  void set_weight(size_t id, double weight) {
+    flows_[id].weight = std::max(weight, min_weight);
+  }
+  double weight(size_t id) const { return flows_[id].weight; }
+
+  // a flow that ran short waits for the next distribution
+  void set_backlogged(size_t id) { flows_[id].backlogged = true; }
+  void set_idle(size_t id) {
+    flows_[id].backlogged = false;
+    flows_[id].deficit = 0.0;
+  }
+  bool backlogged(size_t id) const { return flows_[id].backlogged; }
+
+  // the summed weight of every flow waiting, and of every flow
+  double backlogged_weight() const {
+    double total = 0.0;
+    for (const auto &f : flows_)
+      total += f.used && f.backlogged ? f.weight : 0.0;
+    return total;
+  }
+
+  // hand out up to budget units among the waiting flows, picking up the
+  // round where the last call stopped. A flow whose turn the budget cut
+  // short keeps its turn, so many small budgets still go out by weight
+  // rather than one flow each
+  size_t distribute(size_t budget, const take_handler &take) {
+    size_t given = 0;
+    bool visited = true;
+    while (given < budget && visited && !flows_.empty()) {
+      visited = false;
+      for (size_t n = 0; n < flows_.size() && given < budget; ++n) {
+        size_t id = cursor_ % flows_.size();
+        flow &f = flows_[id];
+        bool resumed = in_turn_;
+        in_turn_ = false;
+        if (!f.used || !f.backlogged) {
+          cursor_ = (id + 1) % flows_.size();
+          continue;
+        }
+        visited = true;
+        if (!resumed)
+          f.deficit += quantum_ * f.weight;
+        auto offered = std::min(static_cast<size_t>(f.deficit), budget - given);
+        size_t taken = take(id, offered);
+        f.deficit -= static_cast<double>(taken);
+        given += taken;
+        if (taken < offered) {
+          f.backlogged = false;
+          f.deficit = 0.0;
+        } else if (given == budget && f.deficit >= 1.0) {
+          in_turn_ = true;
+          break;
+        }
+        cursor_ = (id + 1) % flows_.size();
+      }
+    }
+    return given;
+  }
+
+private:
+  static constexpr double min_weight = 0.01;
+
+  struct flow {
+    double weight = 1.0;
+    double deficit = 0.0;
+    bool backlogged = false;
+    bool used = false;
+  };
+
+  double quantum_;
+  std::vector<flow> flows_;
+  size_t cursor_ = 0;
+  // the flow at the cursor has deficit left from a turn cut short
+  bool in_turn_ = false;
+};
+
+// Bandwidth Limits
+
+// one direction of traffic under a rate cap. Buckets nest (global, then
+// torrent, then peer) and bytes only pass when every bucket up the chain
+// has tokens for them; a rate of 0 means no cap. Tokens may go negative,
+// so a read that has to happen anyway is paid back before the next one.
+// A bucket that shares among its children hands its tokens to them by
+// weight instead of letting the first to ask take them all
+class token_bucket {
+public:
+  using clock = std::chrono::steady_clock;
+
+  explicit token_bucket(token_bucket *parent = nullptr) { set_parent(parent); }
+
+  ~token_bucket() { set_parent(nullptr); }
+  token_bucket(const token_bucket &) = delete;
+  token_bucket &operator=(const token_bucket &) = delete;
+
+  // under a sharing parent the weight sets this bucket's share of it
+  void set_parent(token_bucket *parent, double weight = 1.0) {
+    if (parent_ && parent_->children_) {
+      parent_->children_->remove_flow(flow_);
+      parent_->members_[flow_] = nullptr;
+    }
+    parent_ = parent;
+    granted_ = 0.0;
+    if (parent_ && parent_->children_) {
+      flow_ = parent_->children_->add_flow(weight);
+      parent_->children_->set_weight(flow_, weight);
+      parent_->members_.resize(std::max(parent_->members_.size(), flow_ + 1));
+      parent_->members_[flow_] = this;
+    }
+  }
+
+  // split this bucket between its children by weight; set before any
+  // child is attached
+  void share_by_weight() {
+    children_ = std::make_unique<drr_scheduler>(static_cast<double>(min_batch));
+  }
+
+  void set_weight(double weight) {
+    if (parent_ && parent_->children_)
+      parent_->children_->set_weight(flow_, weight);
+  }
+
+  // bytes per second, 0 for unlimited
+  void set_rate(double rate) {
+    refill(clock::now());
+    rate_ = std::max(rate, 0.0);
+    tokens_ = std::min(tokens_, capacity());
+  }
+  double rate() const { return rate_; }
+
+  bool limited() const { return rate_ > 0.0 || (parent_ && parent_->limited()); }
+
+  // bytes that may pass now through the whole chain
+  size_t available(clock::time_point now) {
+    size_t allowed = std::numeric_limits<size_t>::max();
+    if (rate_ > 0.0) {
+      refill(now);
+      allowed = static_cast<size_t>(std::max(tokens_, 0.0));
+    }
+    if (parent_)
+      allowed = std::min(allowed, parent_->available_to(*this, now));
+    return allowed;
+  }
+
+  void consume(size_t bytes) {
+    if (rate_ > 0.0)
+      tokens_ -= static_cast<double>(bytes);
+    if (parent_)
+      parent_->consume_from(*this, bytes);
+  }
+
+  // how long until bytes may pass through the whole chain
+  std::chrono::milliseconds delay(size_t bytes, clock::time_point now) {
+    std::chrono::milliseconds wait(0);
+    if (rate_ > 0.0) {
+      refill(now);
+      double missing = static_cast<double>(bytes) - tokens_;
+      if (missing > 0.0)
+        wait = std::chrono::milliseconds(
+            static_cast<int64_t>(std::ceil(missing * 1000.0 / rate_)));
+    }
+    if (parent_)
+      wait = std::max(wait, parent_->delay_to(*this, bytes, now));
+    return wait;
+  }
+
+  // the smallest transfer worth waking up for: a tenth of a second of the
+  // tightest rate up the chain, at least a block and at most four
+  size_t batch_size() const {
+    size_t batch = max_batch;
+    if (rate_ > 0.0)
+      batch = std::clamp(static_cast<size_t>(rate_ / 10.0), min_batch,
+                         max_batch);
+    if (parent_)
+      batch = std::min(batch, parent_->batch_size());
+    return batch;
+  }
+
+private:
+  static constexpr size_t min_batch = 16 * 1024;
+  static constexpr size_t max_batch = 64 * 1024;
+
+  // a quarter second of traffic, and never less than one batch
+  double capacity() const {
+    return std::max(rate_ / 4.0, static_cast<double>(min_batch));
+  }
+
+  void refill(clock::time_point now) {
+    std::chrono::duration<double> elapsed = now - last_refill_;
+    last_refill_ = now;
+    tokens_ = std::min(capacity(), tokens_ + rate_ * elapsed.count());
+  }
+
+  // what a child may take: without sharing, whatever the chain allows;
+  // with it, what the round robin granted the child
+  size_t available_to(token_bucket &child, clock::time_point now) {
+    if (!children_ || !limited())
+      return available(now);
+    if (child.granted_ < static_cast<double>(child.batch_size())) {
+      children_->set_backlogged(child.flow_);
+      grant(now);
+    }
+    return static_cast<size_t>(std::max(child.granted_, 0.0));
+  }
+
+  void consume_from(token_bucket &child, size_t bytes) {
+    if (!children_ || !limited()) {
+      consume(bytes);
+      return;
+    }
+    // the tokens left this bucket when they were granted; a child that
+    // spends them is in line for more
+    child.granted_ -= static_cast<double>(bytes);
+    children_->set_backlogged(child.flow_);
+  }
+
+  // a waiting child is next in line for its share of the refill
+  std::chrono::milliseconds delay_to(token_bucket &child, size_t bytes,
+                                     clock::time_point now) {
+    if (!children_ || !limited())
+      return delay(bytes, now);
+    double missing = static_cast<double>(bytes) - child.granted_;
+    if (missing <= 0.0)
+      return std::chrono::milliseconds(0);
+    children_->set_backlogged(child.flow_);
+    double total = std::max(children_->backlogged_weight(),
+                            children_->weight(child.flow_));
+    double share = children_->weight(child.flow_) / total;
+    std::chrono::milliseconds wait = delay(
+        static_cast<size_t>(std::ceil(missing / share)), now);
+    return std::max(wait, std::chrono::milliseconds(1));
+  }
+
+  // move the tokens that arrived since the last grant to the children
+  // waiting for them, a quantum per weight at a time
+  void grant(clock::time_point now) {
+    size_t pool = available(now);
+    double waiting = children_->backlogged_weight();
+    children_->distribute(pool, [this, waiting](size_t flow, size_t offered) {
+      token_bucket &child = *members_[flow];
+      // a child holds at most its share of a full bucket, so tokens that
+      // piled up between timer ticks still go out by weight
+      double share = capacity() * children_->weight(flow) / waiting;
+      double room = std::max(share, 2.0 * max_batch) - child.granted_;
+      auto taken =
+          std::min(offered, static_cast<size_t>(std::max(room, 0.0)));
+      child.granted_ += static_cast<double>(taken);
+      consume(taken);
+      return taken;
+    });
+  }
+
+  token_bucket *parent_ = nullptr;
+  double rate_ = 0.0;
+  double tokens_ = 0.0;
+  clock::time_point last_refill_ = clock::now();
+  // as a child of a sharing bucket: its flow there and tokens granted
+  size_t flow_ = 0;
+  double granted_ = 0.0;
+  // as a sharing bucket: the round robin and the child behind each flow
+  std::unique_ptr<drr_scheduler> children_;
+  std::vector<token_bucket *> members_;
+};
+
+// block requests in flight across every torrent of the process. A torrent
+// takes a slot before each request and gives it back when the block
+// arrives or the request is dropped; once the slots run out, freed ones go
+// round the waiting torrents by weight
+class request_slots {
+public:
+  // a waiting torrent was granted slots
+  using grant_handler = std::function<void()>;
+
+  explicit request_slots(size_t total)
+      : total_(total), free_(total), scheduler_(1.0) {}
+
+  size_t add_flow(double weight, grant_handler on_grant) {
+    size_t id = scheduler_.add_flow(weight);
+    scheduler_.set_weight(id, weight);
+    holders_.resize(std::max(holders_.size(), id + 1));
+    holders_[id] = holder{0, 0, std::move(on_grant)};
+    return id;
+  }
+
+  // give back everything the flow holds
+  void remove_flow(size_t id) {
+    free_ += holders_[id].held + holders_[id].granted;
+    holders_[id] = holder{};
+    scheduler_.remove_flow(id);
+    hand_out();
+  }
+
+  void set_weight(size_t id, double weight) {
+    scheduler_.set_weight(id, weight);
+  }
+
+  // take a slot for one request; false means wait for the grant handler
+  bool acquire(size_t id) {
+    holder &flow = holders_[id];
+    if (flow.granted == 0) {
+      scheduler_.set_backlogged(id);
+      hand_out();
+      if (flow.granted == 0)
+        return false;
+    }
+    flow.granted--;
+    flow.held++;
+    if (id < shares_.size() && flow.held > shares_[id])
+      charge_leftover(id);
+    return true;
+  }
+
+  void release(size_t id, size_t count = 1) {
+    count = std::min(count, holders_[id].held);
+    holders_[id].held -= count;
+    free_ += count;
+    hand_out();
+  }
+
+  // the flow wants no more slots for now; what it was granted but has
+  // not used goes to the others
+  void return_grants(size_t id) {
+    free_ += holders_[id].granted;
+    holders_[id].granted = 0;
+    scheduler_.set_idle(id);
+    hand_out();
+  }
+
+  size_t held(size_t id) const { return holders_[id].held; }
+
+private:
+  struct holder {
+    size_t held = 0;
+    size_t granted = 0;
+    grant_handler on_grant;
+    // how far the flow is owed left over slots, for the round robin
+    double credit = 0.0;
+  };
+
+  // a flow holds no more than the whole slots of its weighted share among
+  // the flows using them, so slots freed in a burst do not all go to
+  // whoever asks first. The slots those shares leave over go out one at a
+  // time to flows at their share, by smooth weighted round robin on the
+  // fractions the shares were rounded down by, so over many requests each
+  // flow gets its exact share
+  void hand_out() {
+    std::vector<size_t> &share = shares_;
+    std::vector<double> &fraction = fractions_;
+    share.assign(holders_.size(), 0);
+    fraction.assign(holders_.size(), 0.0);
+    double waiting = 0.0;
+    for (size_t id = 0; id < holders_.size(); ++id) {
+      const holder &flow = holders_[id];
+      if (flow.held + flow.granted > 0 || scheduler_.backlogged(id))
+        waiting += scheduler_.weight(id);
+    }
+    for (size_t id = 0; id < holders_.size(); ++id) {
+      const holder &flow = holders_[id];
+      if (flow.held + flow.granted == 0 && !scheduler_.backlogged(id))
+        continue;
+      double exact = total_ * scheduler_.weight(id) / waiting;
+      share[id] = static_cast<size_t>(exact);
+      fraction[id] = exact - share[id];
+    }
+    // grants not yet used come back from flows above a share that shrank
+    // since, such as a torrent that finished while holding them
+    for (size_t id = 0; id < holders_.size(); ++id) {
+      holder &flow = holders_[id];
+      size_t holding = flow.held + flow.granted;
+      if (holding == 0)
+        continue;
+      size_t allowed = share[id] + (fraction[id] > 0.0 ? 1 : 0);
+      size_t excess = holding - std::min(holding, allowed);
+      size_t reclaimed = std::min(excess, flow.granted);
+      flow.granted -= reclaimed;
+      free_ += reclaimed;
+    }
+    // a flow at its share still wants more and stays in line for slots
+    // it frees itself
+    std::vector<size_t> capped;
+    scheduler_.distribute(free_, [&](size_t id, size_t offered) {
+      holder &flow = holders_[id];
+      size_t holding = flow.held + flow.granted;
+      size_t taken = std::min(offered, share[id] - std::min(share[id], holding));
+      if (taken < offered)
+        capped.push_back(id);
+      flow.granted += taken;
+      free_ -= taken;
+      if (taken > 0 && flow.on_grant)
+        flow.on_grant();
+      return taken;
+    });
+    for (size_t id : capped)
+      scheduler_.set_backlogged(id);
+    while (free_ > 0 && grant_leftover()) {
+    }
+  }
+
+  // one left over slot to the flow at its share that is owed the most;
+  // false when every flow already holds one
+  bool grant_leftover() {
+    size_t best = holders_.size();
+    for (size_t id = 0; id < holders_.size(); ++id) {
+      const holder &flow = holders_[id];
+      if (fractions_[id] > 0.0 && flow.held + flow.granted == shares_[id] &&
+          (best == holders_.size() || flow.credit > holders_[best].credit))
+        best = id;
+    }
+    if (best == holders_.size())
+      return false;
+    holder &flow = holders_[best];
+    flow.granted++;
+    free_--;
+    if (flow.on_grant)
+      flow.on_grant();
+    return true;
+  }
+
+  // a flow put a left over slot to use: it is owed one slot less and
+  // every flow its fraction more. Only slots put to use count, not grants
+  // that change hands before they are used
+  void charge_leftover(size_t id) {
+    double fractions = 0.0;
+    for (size_t other = 0; other < holders_.size(); ++other) {
+      holders_[other].credit += fractions_[other];
+      fractions += fractions_[other];
+    }
+    holders_[id].credit -= fractions;
+  }
+
+  size_t total_;
+  size_t free_;
+  drr_scheduler scheduler_;
+  std::vector<holder> holders_;
+  // each flow's whole slots and the fraction they were rounded down by,
+  // as of the last hand out
+  std::vector<size_t> shares_;
+  std::vector<double> fractions_;
+};
+
+// caps for both directions, in bytes per second, 0 for none
+struct rate_limits {
+  double download = 0.0;
+  double upload = 0.0;
+};
+
+// Memory Budget
+
+// bytes of piece buffers every torrent of a process draws from, so many
+// downloads together stay under one memory cap
+class buffer_budget {
+public:
+  explicit buffer_budget(size_t limit) : limit_(limit) {}
+
+  // a piece always fits when nothing is held, so pieces larger than the
+  // whole budget still download one at a time
+  bool fits(size_t bytes) const { return used_ == 0 || used_ + bytes <= limit_; }
+  void reserve(size_t bytes) { used_ += bytes; }
+  void release(size_t bytes) { used_ -= std::min(bytes, used_); }
+
+  size_t used() const { return used_; }
+  size_t limit() const { return limit_; }
+
+private:
+  size_t limit_;
+  size_t used_ = 0;
+};
+
+// Peer Session
+
+// a block we asked a peer for
+struct block_request {
+  uint32_t piece = 0;
+  uint32_t begin = 0;
+  uint32_t length = 0;
+
+  bool operator==(const block_request &other) const {
+    return piece == other.piece && begin == other.begin &&
+           length == other.length;
+  }
+};
+
+// per-connection protocol state after the handshake
+class peer_session {
+public:
+  peer_session(int fd, const peer_endpoint &endpoint, int num_pieces)
+      : last_received(std::chrono::steady_clock::now()), fd_(fd),
+        endpoint_(endpoint), has_(num_pieces, false) {}
+
+  int fd() const { return fd_; }
+  const peer_endpoint &endpoint() const { return endpoint_; }
+
+  // the peer connected to us, so its port is not one we could dial
+  bool inbound = false;
+  // BEP 10 was offered in the handshake; reqq is the most requests the
+  // peer will queue for us, 0 until its extension handshake says
+  bool supports_extensions = false;
+  size_t peer_reqq = 0;
+  // the peer's ids for the ut_metadata and ut_pex messages it accepts,
+  // 0 for extensions it does not have
+  uint8_t peer_ut_metadata = 0;
+  uint8_t peer_ut_pex = 0;
+  // dialable peers our PEX updates have told this peer about
+  std::vector<peer_endpoint> pex_sent;
+  // when the last PEX update we took from this peer arrived
+  std::optional<std::chrono::steady_clock::time_point> pex_received;
+
+  // BEP 6, when both sides set the bit: pieces the peer lets us request
+  // while choked, pieces we let it request, and pieces it suggested
+  bool fast_extension = false;
+  std::vector<uint32_t> allowed_fast;
+  std::vector<uint32_t> allowed_fast_sent;
+  std::deque<uint32_t> suggested;
+
+  // what each side has told the other
+  bool peer_choking = true;
+  bool peer_interested = false;
+  bool am_interested = false;
+  bool am_choking = true;
+
+  bool has_piece(int index) const { return has_[index]; }
+  size_t piece_count() const { return has_count_; }
+
+  // record a have; returns false if we already knew
+  bool set_have(int index) {
+    if (index < 0 || index >= static_cast<int>(has_.size()))
+      throw std::runtime_error("Have for invalid piece");
+    if (has_[index])
+      return false;
+    has_[index] = true;
+    has_count_++;
+    return true;
+  }
+
+  // have_all and have_none
+  void set_all(bool have) {
+    std::fill(has_.begin(), has_.end(), have);
+    has_count_ = have ? has_.size() : 0;
+  }
+
+  // replace what the peer has with its bitfield
+  void set_bitfield(const std::string &bitfield) {
+    if (bitfield.size() != (has_.size() + 7) / 8)
+      throw std::runtime_error("Bitfield has wrong length");
+    has_count_ = 0;
+    for (size_t i = 0; i < has_.size(); ++i) {
+      has_[i] = (static_cast<unsigned char>(bitfield[i / 8]) >> (7 - i % 8)) & 1;
+      has_count_ += has_[i];
+    }
+  }
+
+  // our requests to this peer in the swarm's in-flight table, including
+  // ones that timed out and were handed to other peers
+  size_t outstanding = 0;
+
+  // smoothed block round trip and its variance (RFC 6298); backoff doubles
+  // the timeout after each expiry until a block arrives again
+  double srtt_ms = 0.0;
+  double rttvar_ms = 0.0;
+  bool has_rtt = false;
+  int rto_backoff = 1;
+  // the fastest round trip seen; queueing at the peer inflates the others
+  double min_rtt_ms = 0.0;
+
+  // download rate over one second windows for queue sizing; it follows
+  // increases at once so the queue ramps up quickly and decays slowly
+  double recent_rate = 0.0;
+
+  void add_received(size_t bytes, std::chrono::steady_clock::time_point now) {
+    window_bytes_ += bytes;
+    std::chrono::duration<double> elapsed = now - window_start_;
+    if (elapsed.count() < 1.0)
+      return;
+    double sample = window_bytes_ / elapsed.count();
+    recent_rate =
+        sample > recent_rate ? sample : 0.7 * recent_rate + 0.3 * sample;
+    window_bytes_ = 0;
+    window_start_ = now;
+  }
+
+  // requests to keep outstanding: the bandwidth-delay product in blocks,
+  // with headroom so a window-limited rate can still grow, within bounds
+  // and never past what the peer said it queues
+  size_t target_queue_depth(size_t min_depth, size_t max_depth) const {
+    size_t depth = min_depth;
+    if (has_rtt && recent_rate > 0.0) {
+      double bdp_blocks = recent_rate * (min_rtt_ms / 1000.0) / block_size;
+      depth = static_cast<size_t>(std::ceil(bdp_blocks * 1.5)) + 1;
+    }
+    depth = std::clamp(depth, min_depth, max_depth);
+    if (peer_reqq > 0)
+      depth = std::min(depth, peer_reqq);
+    return depth;
+  }
+
+  void add_rtt_sample(double sample_ms) {
+    min_rtt_ms = has_rtt ? std::min(min_rtt_ms, sample_ms) : sample_ms;
+    if (!has_rtt) {
+      srtt_ms = sample_ms;
+      rttvar_ms = sample_ms / 2;
+      has_rtt = true;
+    } else {
+      rttvar_ms = 0.75 * rttvar_ms + 0.25 * std::abs(srtt_ms - sample_ms);
+      srtt_ms = 0.875 * srtt_ms + 0.125 * sample_ms;
+    }
+    rto_backoff = 1;
+  }
+
+  // how long a block request may take before another peer is asked
+  std::chrono::milliseconds request_timeout() const {
+    double rto = has_rtt ? srtt_ms + 4 * rttvar_ms : initial_rto_ms;
+    rto = std::clamp(rto * rto_backoff, min_rto_ms, max_rto_ms);
+    return std::chrono::milliseconds(static_cast<int64_t>(rto));
+  }
+
+  // payload bytes received in piece messages since the connection opened
+  int64_t bytes_downloaded = 0;
+  std::chrono::steady_clock::time_point connected_at =
+      std::chrono::steady_clock::now();
+
+  // what the peer is judged on: its download rate smoothed over rechoke
+  // rounds, how many rounds it kept us unchoked while we wanted data, and
+  // the pieces it helped fill that passed or failed the hash check
+  double throughput = 0.0;
+  int interested_rounds = 0;
+  int unchoked_rounds = 0;
+  int pieces_verified = 0;
+  int pieces_failed = 0;
+
+  // the peer helped fill a piece that failed the hash check, so until it
+  // fills one alone that passes it only fetches whole pieces by itself
+  bool on_parole = false;
+
+  // unchoked with requests out but silent for too long; no more requests
+  // go to the peer until it sends a block or unchokes us afresh
+  bool snubbed = false;
+  // when the peer last sent a block or we started waiting for one
+  std::chrono::steady_clock::time_point waiting_since;
+
+  // higher is better; throughput counts most and is scaled down by the
+  // share of bad pieces, time spent choked and the round trip
+  double score() const {
+    if (snubbed)
+      return 0.0;
+    int pieces = pieces_verified + pieces_failed;
+    double clean =
+        pieces > 0 ? 1.0 - static_cast<double>(pieces_failed) / pieces : 1.0;
+    double unchoked =
+        interested_rounds > 0
+            ? static_cast<double>(unchoked_rounds) / interested_rounds
+            : 1.0;
+    return throughput * clean * clean * (0.5 + 0.5 * unchoked) /
+           (1.0 + srtt_ms / 1000.0);
+  }
+
+  wire_reader reader;
+  std::chrono::steady_clock::time_point last_received;
+
+  // requests the peer made of us, served as the socket drains
+  std::deque<block_request> peer_requests;
+  int64_t bytes_uploaded = 0;
+
+  // bytes per second over the last choke interval, refreshed by the choker
+  double download_rate = 0.0;
+  double upload_rate = 0.0;
+  int64_t downloaded_at_rechoke = 0;
+  int64_t uploaded_at_rechoke = 0;
+
+  // queue a message; it goes out on the next flush
+  void queue(uint8_t id, const std::string &payload = "") {
+    append(encode_message(id, payload));
+  }
+
+  void queue_keep_alive() { append(std::string(4, '\0')); }
+
+  // queue a piece message whose data is sent straight from the file
+  void queue_block(const block_request &block, int file_fd, off_t offset) {
+    std::string header(13, '\0');
+    auto *out = reinterpret_cast<unsigned char *>(header.data());
+    write_be32(out, 9 + block.length);
+    header[4] = static_cast<char>(msg_piece);
+    write_be32(out + 5, block.piece);
+    write_be32(out + 9, block.begin);
+    append(header);
+    out_segment data;
+    data.file_fd = file_fd;
+    data.offset = offset;
+    data.length = block.length;
+    out_.push_back(std::move(data));
+    out_bytes_ += block.length;
+  }
+
+  // messages queued since the connection opened
+  uint64_t messages_queued() const { return messages_queued_; }
+
+  // when nothing has been sent for a while a keep-alive goes out; the mark
+  // is the message count the current keep-alive timer was armed at
+  event_loop::timer_id keep_alive_timer = 0;
+  uint64_t keep_alive_mark = 0;
+  // evicts the peer once nothing has arrived for too long
+  event_loop::timer_id idle_timer = 0;
+
+  // write as much queued data as the socket takes, up to budget bytes;
+  // false on a send error
+  bool flush(size_t budget = std::numeric_limits<size_t>::max()) {
+    while (!out_.empty() && budget > 0) {
+      out_segment &segment = out_.front();
+      ssize_t sent;
+      if (segment.file_fd >= 0) {
+        // file data goes kernel to kernel without a userspace copy
+        sent = sendfile(fd_, segment.file_fd, &segment.offset,
+                        std::min(segment.length - segment.sent, budget));
+      } else {
+        sent = send(fd_, segment.bytes.data() + segment.sent,
+                    std::min(segment.bytes.size() - segment.sent, budget),
+                    MSG_NOSIGNAL);
+      }
+      if (sent < 0) {
+        if (errno == EAGAIN || errno == EWOULDBLOCK)
+          break;
+        return false;
+      }
+      if (sent == 0 && segment.file_fd >= 0)
+        return false; // the file is shorter than the torrent says
+      segment.sent += sent;
+      out_bytes_ -= sent;
+      bytes_sent_ += sent;
+      budget -= sent;
+      size_t total =
+          segment.file_fd >= 0 ? segment.length : segment.bytes.size();
+      if (segment.sent < total)
+        break;
+      out_.pop_front();
+    }
+    return true;
+  }
+
+  bool wants_write() const { return !out_.empty(); }
+  size_t queued_bytes() const { return out_bytes_; }
+  // every byte written to the socket, messages and file data alike
+  uint64_t bytes_sent() const { return bytes_sent_; }
+
+  // this peer's rate caps, under the torrent's; reads and writes they
+  // hold back resume from the throttle timer
+  token_bucket download_limit;
+  token_bucket upload_limit;
+  event_loop::timer_id throttle_timer = 0;
+
+private:
+  // bytes to send, or a range of a file when file_fd is set
+  struct out_segment {
+    std::string bytes;
+    int file_fd = -1;
+    off_t offset = 0;
+    size_t length = 0;
+    size_t sent = 0;
+  };
+
+  // add bytes to the tail of the queue, merging with earlier messages
+  void append(const std::string &bytes) {
+    if (!out_.empty() && out_.back().file_fd < 0) {
+      out_.back().bytes += bytes;
+    } else {
+      out_segment segment;
+      segment.bytes = bytes;
+      out_.push_back(std::move(segment));
+    }
+    out_bytes_ += bytes.size();
+    messages_queued_++;
+  }
+
+  size_t window_bytes_ = 0;
+  std::chrono::steady_clock::time_point window_start_ =
+      std::chrono::steady_clock::now();
+
+  static constexpr double initial_rto_ms = 10000;
+  static constexpr double min_rto_ms = 2000;
+  static constexpr double max_rto_ms = 60000;
+
+  int fd_;
+  peer_endpoint endpoint_;
+  std::vector<bool> has_;
+  size_t has_count_ = 0;
+  std::deque<out_segment> out_;
+  size_t out_bytes_ = 0;
+  uint64_t bytes_sent_ = 0;
+  uint64_t messages_queued_ = 0;
+};
+
+// In-Flight Blocks
+
+// every block request sent to any peer of a torrent, in one dense array;
+// an index maps (peer, block) to its slot and removal moves the last entry
+// into the hole, so scans over all requests touch contiguous memory
+class inflight_table {
+public:
+  struct entry {
+    int fd = -1;
+    block_request block;
+    std::chrono::steady_clock::time_point sent_at;
+    event_loop::timer_id timer = 0;
+    bool timed_out = false; // handed to other peers, still accepted late
+  };
+
+  void add(const entry &request) {
+    index_[{request.fd, block_key(request.block)}] = entries_.size();
+    entries_.push_back(request);
+    copies &count = copies_[block_key(request.block)];
+    count.total++;
+    count.live++;
+  }
+
+  // nullptr when we have no such request out to this peer
+  entry *find(int fd, const block_request &block) {
+    auto it = index_.find({fd, block_key(block)});
+    return it == index_.end() ? nullptr : &entries_[it->second];
+  }
+
+  void mark_timed_out(entry &request) {
+    if (request.timed_out)
+      return;
+    request.timed_out = true;
+    copies_[block_key(request.block)].live--;
+  }
+
+  entry remove(int fd, const block_request &block) {
+    auto it = index_.find({fd, block_key(block)});
+    size_t slot = it->second;
+    index_.erase(it);
+    entry removed = entries_[slot];
+    if (slot + 1 != entries_.size()) {
+      entries_[slot] = entries_.back();
+      index_[{entries_[slot].fd, block_key(entries_[slot].block)}] = slot;
+    }
+    entries_.pop_back();
+    auto count = copies_.find(block_key(block));
+    count->second.total--;
+    count->second.live -= !removed.timed_out;
+    if (count->second.total == 0)
+      copies_.erase(count);
+    return removed;
+  }
+
+  // take out every request sent to one peer
+  std::vector<entry> remove_peer(int fd) {
+    std::vector<entry> removed;
+    for (const auto &request : entries_) {
+      if (request.fd == fd)
+        removed.push_back(request);
+    }
+    for (const auto &request : removed)
+      remove(fd, request.block);
+    return removed;
+  }
+
+  // peers other than fd that have this block in flight, timed out or not
+  std::vector<int> other_peers(int fd, const block_request &block) const {
+    std::vector<int> peers;
+    auto count = copies_.find(block_key(block));
+    if (count == copies_.end() || count->second.total <= 1)
+      return peers;
+    for (const auto &request : entries_) {
+      if (request.fd != fd && request.block == block)
+        peers.push_back(request.fd);
+    }
+    return peers;
+  }
+
+  // requests for this block that have not timed out
+  int live_copies(const block_request &block) const {
+    auto count = copies_.find(block_key(block));
+    return count == copies_.end() ? 0 : count->second.live;
+  }
+
+private:
+  struct copies {
+    int total = 0;
+    int live = 0;
+  };
+
+  struct key {
+    int fd;
+    uint64_t block;
+    bool operator==(const key &other) const {
+      return fd == other.fd && block == other.block;
+    }
+  };
+
+  struct key_hash {
+    size_t operator()(const key &k) const {
+      return std::hash<uint64_t>()(k.block * 31 + static_cast<uint32_t>(k.fd));
+    }
+  };
+
+  static uint64_t block_key(const block_request &block) {
+    return (static_cast<uint64_t>(block.piece) << 32) | block.begin;
+  }
+
+  std::vector<entry> entries_;
+  std::unordered_map<key, size_t, key_hash> index_;
+  std::unordered_map<uint64_t, copies> copies_;
+};
+
+// Torrent Swarm
+
+// drives every peer session of one torrent: picks blocks, collects them and
+// verifies finished pieces
+class torrent_swarm {
+public:
+  using piece_handler = std::function<void(int, const std::vector<char> &)>;
+  using close_handler = std::function<void(const peer_endpoint &, bool)>;
+  // peers a PEX message said joined and left the swarm
+  using pex_handler =
+      std::function<void(const std::vector<peer_endpoint> &added,
+                         const std::vector<peer_endpoint> &dropped)>;
+  using replacement_check = std::function<bool()>;
+  // a peer caught sending corrupt data too often
+  using ban_handler = std::function<void(const peer_endpoint &)>;
+
+  torrent_swarm(event_loop &loop, const torrent_meta &meta,
+                std::vector<bool> wanted, piece_handler on_piece,
+                peer_cache *cache)
+      : loop_(loop), meta_(meta), wanted_(std::move(wanted)),
+        have_(meta.num_pieces, false), availability_(meta.num_pieces, 0),
+        on_piece_(std::move(on_piece)), cache_(cache) {
+    for (bool want : wanted_)
+      remaining_ += want;
+    schedule_rechoke();
+    schedule_pex();
+  }
+
+  ~torrent_swarm() {
+    // pool jobs hold on to this swarm and its piece buffers
+    if (hash_pool_)
+      hash_pool_->forget(this);
+    if (disk_pool_)
+      disk_pool_->forget(this);
+    if (budget_)
+      budget_->release(buffered_);
+    loop_.cancel(rechoke_timer_);
+    loop_.cancel(pex_timer_);
+    for (auto &entry : sessions_) {
+      cancel_timers(*entry.second);
+      drop_requests(*entry.second);
+      record_rate(*entry.second);
+      loop_.remove(entry.first);
+      close(entry.first);
+    }
+    if (slots_)
+      slots_->remove_flow(slot_flow_);
+  }
+  torrent_swarm(const torrent_swarm &) = delete;
+  torrent_swarm &operator=(const torrent_swarm &) = delete;
+
+  // called whenever a session ends, failed is true for misbehaving peers
+  void set_close_handler(close_handler on_close) {
+    on_close_ = std::move(on_close);
+  }
+
+  // called with the peers each PEX message names
+  void set_pex_handler(pex_handler on_pex) { on_pex_ = std::move(on_pex); }
+
+  // asked every few rechoke rounds whether an untried peer is waiting for
+  // a connection slot; if one is, the weakest peer makes room for it
+  void set_replacement_check(replacement_check wants_slot) {
+    wants_slot_ = std::move(wants_slot);
+  }
+
+  // called once for each address banned for corrupt data, after its
+  // sessions are closed
+  void set_ban_handler(ban_handler on_ban) { on_ban_ = std::move(on_ban); }
+
+  // the buckets shared by every torrent in the process
+  void set_global_limits(token_bucket *download, token_bucket *upload) {
+    download_limit_.set_parent(download, weight_);
+    upload_limit_.set_parent(upload, weight_);
+  }
+
+  // take a shared slot before each block request
+  void set_request_slots(request_slots *slots) {
+    slots_ = slots;
+    slot_flow_ = slots_->add_flow(weight_, [this] { slots_granted_ = true; });
+  }
+
+  // this torrent's share of the global limits and request slots against
+  // the other torrents'
+  void set_weight(double weight) {
+    weight_ = weight;
+    download_limit_.set_weight(weight);
+    upload_limit_.set_weight(weight);
+    if (slots_)
+      slots_->set_weight(slot_flow_, weight);
+  }
+
+  // hash finished pieces and write verified ones to the storage file on
+  // these threads instead of the event loop; the piece handler then only
+  // hears about pieces already on disk
+  void set_worker_pools(worker_pool *hash, worker_pool *disk) {
+    hash_pool_ = hash;
+    disk_pool_ = disk;
+  }
+
+  // draw piece buffers from a budget shared with other torrents; no piece
+  // starts while the budget is spent
+  void set_buffer_budget(buffer_budget *budget) { budget_ = budget; }
+
+  // caps for the torrent as a whole and for each of its peers
+  void set_rate_limits(const rate_limits &torrent, const rate_limits &peer) {
+    download_limit_.set_rate(torrent.download);
+    upload_limit_.set_rate(torrent.upload);
+    peer_limits_ = peer;
+    for (auto &entry : sessions_) {
+      entry.second->download_limit.set_rate(peer.download);
+      entry.second->upload_limit.set_rate(peer.upload);
+      update_events(*entry.second);
+    }
+  }
+
+  bool complete() const { return remaining_ == 0 && !fatal_; }
+  size_t peer_count() const { return sessions_.size(); }
+  size_t pieces_have() const { return have_count_; }
+  // payload bytes over every peer this swarm ever had
+  uint64_t bytes_downloaded() const { return downloaded_; }
+  uint64_t bytes_uploaded() const { return uploaded_; }
+
+  // serve verified pieces to peers straight from this file
+  void set_storage(int fd) { storage_fd_ = fd; }
+
+  // how many peers we upload to at once
+  void set_upload_slots(size_t slots) { upload_slots_ = slots; }
+
+  // requests per peer before any rate is known, and the default ceiling
+  static constexpr size_t default_min_queue_depth = 2;
+  static constexpr size_t default_max_queue_depth = 250;
+
+  // bounds for the per-peer request queue sized from rate and round trip
+  void set_queue_depth_bounds(size_t min_depth, size_t max_depth) {
+    min_queue_depth_ = std::max<size_t>(min_depth, 1);
+    max_queue_depth_ = std::max(max_depth, min_queue_depth_);
+  }
+
+  // mark pieces a verify pass found intact
+  void add_verified(const std::vector<bool> &verified) {
+    for (int i = 0; i < meta_.num_pieces; ++i) {
+      if (verified[i] && !have_[i]) {
+        have_[i] = true;
+        have_count_++;
+        if (wanted_[i])
+          remaining_--;
+      }
+    }
+  }
+
+  // take over a socket that completed the handshake
+  void add_peer(int fd, const peer_handshake &peer,
+                const std::string &leftover) {
+    auto session =
+        std::make_unique<peer_session>(fd, peer.endpoint, meta_.num_pieces);
+    session->inbound = peer.inbound;
+    session->supports_extensions =
+        peer.supports(extension_protocol_byte, extension_protocol_bit);
+    session->fast_extension =
+        peer.supports(fast_extension_byte, fast_extension_bit);
+    session->idle_timer = schedule_idle_check(fd, idle_timeout());
+    session->download_limit.set_parent(&download_limit_);
+    session->upload_limit.set_parent(&upload_limit_);
+    session->download_limit.set_rate(peer_limits_.download);
+    session->upload_limit.set_rate(peer_limits_.upload);
+    sessions_[fd] = std::move(session);
+    // a connect that was under way when the address was banned
+    auto strikes = strikes_.find(peer.endpoint.ip);
+    if (strikes != strikes_.end() && strikes->second >= ban_strikes)
+      closing_.push_back({fd, "Banned for sending corrupt data", true});
+    loop_.add(fd, EPOLLIN, [this, fd](uint32_t events) {
+      try {
+        on_event(fd, events);
+      } catch (const std::exception &e) {
+        close_session(fd, e.what(), true);
+      }
+    });
+    try {
+      peer_session &session = *sessions_.at(fd);
+      rearm_keep_alive(session);
+      // what we have has to be the first message after the handshake; the
+      // fast extension says all or nothing without a bitfield
+      if (session.fast_extension && seeding())
+        session.queue(msg_have_all);
+      else if (session.fast_extension && have_count_ == 0)
+        session.queue(msg_have_none);
+      else if (have_count_ > 0)
+        session.queue(msg_bitfield, encode_bitfield());
+      if (session.supports_extensions)
+        session.queue(msg_extended, encode_extension_handshake());
+      if (session.fast_extension)
+        send_allowed_fast(session);
+      session.reader.feed(leftover.data(), leftover.size());
+      process(session);
+      update_events(session);
+    } catch (const std::exception &e) {
+      close_session(fd, e.what(), true);
+    }
+  }
+
+  // close sessions handlers gave up on and report a failed piece write;
+  // timeouts, keep-alives and rechokes run from the event loop's timers
+  void tick() {
+    if (fatal_)
+      std::rethrow_exception(fatal_);
+    std::vector<pending_close> closing;
+    std::swap(closing, closing_);
+    for (const auto &entry : closing)
+      close_session(entry.fd, entry.reason, entry.failed);
+    if (slots_granted_) {
+      slots_granted_ = false;
+      refill_all();
+    }
+    // another torrent gave buffers back
+    if (budget_blocked_ && budget_->fits(meta_.piece_length)) {
+      budget_blocked_ = false;
+      refill_all();
+    }
+  }
+
+private:
+  // after a request times out the peer gets this long to deliver anyway
+  static constexpr int request_grace_sec = 60;
+  static constexpr int max_rto_backoff = 16;
+  // peers send keep-alives every two minutes, so allow for one going missing
+  static constexpr int keep_alive_sec = 120;
+  static constexpr int idle_timeout_sec = 180;
+  // largest block we serve and how many requests a peer may queue with us
+  static constexpr uint32_t max_request_length = 4 * block_size;
+  static constexpr size_t max_peer_requests = 250;
+  // BEP 6 limits: pieces we offer, and how many offers and suggestions we
+  // keep from each peer
+  static constexpr size_t allowed_fast_count = 10;
+  static constexpr size_t max_allowed_fast = 32;
+  static constexpr size_t max_suggested = 8;
+  // keep about two blocks in flight to the socket per peer
+  static constexpr size_t serve_watermark = 2 * block_size;
+  // the choker reranks peers this often and moves the optimistic unchoke
+  // every few rounds; peers newer than new_peer_sec are likelier to get it
+  static constexpr int rechoke_interval_sec = 10;
+  static constexpr int optimistic_rounds = 3;
+  static constexpr int new_peer_sec = 60;
+  static constexpr int new_peer_weight = 3;
+  // a peer that sends no block for this long while unchoked is snubbed
+  static constexpr int snub_sec = 60;
+  // every few rounds the lowest scoring peer connected for long enough to
+  // be judged is swapped for an untried one; each round moves a peer's
+  // smoothed throughput this far towards its latest rate
+  static constexpr int replace_rounds = 6;
+  static constexpr int score_warmup_sec = 30;
+  static constexpr double throughput_gain = 0.3;
+  // pieces an address is proven to have corrupted before it is banned
+  static constexpr int ban_strikes = 2;
+  // BEP 11: one PEX update a minute, with at most this many peers added
+  // and dropped in each; longer lists from peers are cut to it
+  static constexpr int pex_interval_sec = 60;
+  static constexpr size_t max_pex_peers = 50;
+  // updates from a peer sooner than this after its last one are ignored;
+  // a little under the interval, for timers that fire early
+  static constexpr int min_pex_gap_sec = 50;
+  static constexpr uint8_t pex_flag_seed = 0x02;
+  static constexpr uint8_t pex_flag_reachable = 0x10;
+
+  // a session to close on the next tick, once no handler is using it
+  struct pending_close {
+    int fd;
+    std::string reason;
+    bool failed;
+  };
+
+  // a piece some blocks of which are requested or received
+  struct piece_progress {
+    std::vector<char> data;
+    std::vector<uint8_t> block_state; // see block_* below
+    size_t blocks_received = 0;
+    // the peer each received block came from
+    std::vector<peer_endpoint> block_sources;
+    // parole pieces are fetched by one peer, its owner, so a failure
+    // points at whoever sent them
+    bool parole = false;
+    int owner = -1;
+  };
+
+  // a block of a piece that failed the hash check, kept until the piece
+  // passes so each sender's copy can be checked against the good one
+  struct failed_block {
+    peer_endpoint source;
+    size_t block;
+    std::string digest;
+  };
+  // the blocks of a piece's failed copies, and the peers already struck
+  // for it; a piece counts against each peer once
+  struct failed_piece {
+    std::vector<failed_block> blocks;
+    std::vector<peer_endpoint> charged;
+  };
+  static constexpr uint8_t block_missing = 0;
+  static constexpr uint8_t block_requested = 1;
+  static constexpr uint8_t block_received = 2;
+
+  void on_event(int fd, uint32_t events) {
+    peer_session &session = *sessions_.at(fd);
+    auto now = std::chrono::steady_clock::now();
+    if (events & EPOLLOUT && !flush_limited(session, now))
+      throw std::runtime_error("Failed to send to peer");
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+      char buffer[65536];
+      // an error or hangup is read even when the limit is spent, and paid
+      // back from later tokens
+      size_t length = std::min(sizeof(buffer),
+                               session.download_limit.available(now));
+      if (length == 0)
+        length = sizeof(buffer);
+      ssize_t bytes = recv(fd, buffer, length, 0);
+      if (bytes == 0)
+        throw std::runtime_error("Connection closed by peer");
+      if (bytes < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+          throw std::runtime_error("Failed to receive from peer");
+      } else {
+        session.download_limit.consume(bytes);
+        session.last_received = now;
+        session.reader.feed(buffer, bytes);
+        process(session);
+      }
+    }
+    // the session may have been closed while processing
+    if (sessions_.count(fd))
+      update_events(session);
+  }
+
+  // flush queued messages and watch for writability while some remain;
+  // send errors are handled on the next tick so callers never see them.
+  // A direction out of tokens stops being watched until the throttle
+  // timer says a whole batch may pass
+  void update_events(peer_session &session) {
+    auto now = std::chrono::steady_clock::now();
+    // keep serving while the socket takes everything we give it
+    do {
+      serve(session);
+      if (!can_send(session, now))
+        break;
+      if (!flush_limited(session, now)) {
+        closing_.push_back({session.fd(), "Failed to send to peer", true});
+        return;
+      }
+    } while (!session.wants_write() && !session.peer_requests.empty());
+    if (session.messages_queued() != session.keep_alive_mark)
+      rearm_keep_alive(session);
+    bool can_write = can_send(session, now);
+    bool can_read = can_receive(session, now);
+    if ((!can_write || !can_read) && session.throttle_timer == 0) {
+      std::chrono::milliseconds wait = std::chrono::milliseconds::max();
+      if (!can_write)
+        wait = session.upload_limit.delay(send_batch(session), now);
+      if (!can_read)
+        wait = std::min(wait, session.download_limit.delay(
+                                  session.download_limit.batch_size(), now));
+      int fd = session.fd();
+      session.throttle_timer =
+          loop_.schedule(std::max(wait, std::chrono::milliseconds(1)),
+                         [this, fd] {
+                           peer_session &throttled = *sessions_.at(fd);
+                           throttled.throttle_timer = 0;
+                           update_events(throttled);
+                         });
+    }
+    loop_.modify(session.fd(),
+                 (can_read ? static_cast<uint32_t>(EPOLLIN) : 0) |
+                     (session.wants_write() && can_write
+                          ? static_cast<uint32_t>(EPOLLOUT)
+                          : 0));
+  }
+
+  // what to wait for before writing: a whole batch, or everything queued
+  // when less than that is
+  static size_t send_batch(const peer_session &session) {
+    return std::min(session.upload_limit.batch_size(), session.queued_bytes());
+  }
+
+  bool can_send(peer_session &session, std::chrono::steady_clock::time_point now) {
+    return !session.upload_limit.limited() ||
+           session.upload_limit.available(now) >= send_batch(session);
+  }
+
+  bool can_receive(peer_session &session,
+                   std::chrono::steady_clock::time_point now) {
+    return !session.download_limit.limited() ||
+           session.download_limit.available(now) >=
+               session.download_limit.batch_size();
+  }
+
+  // write what the upload limits allow; false on a send error
+  bool flush_limited(peer_session &session,
+                     std::chrono::steady_clock::time_point now) {
+    uint64_t before = session.bytes_sent();
+    bool sent = session.flush(session.upload_limit.available(now));
+    session.upload_limit.consume(session.bytes_sent() - before);
+    return sent;
+  }
+
+  // give every peer a chance to request blocks that became available
+  void refill_all() {
+    for (auto &entry : sessions_) {
+      request_blocks(*entry.second);
+      update_events(*entry.second);
+    }
+  }
+
+  // handle every complete message, in whatever order the peer sent them
+  void process(peer_session &session) {
+    while (auto message = session.reader.next()) {
+      if (message->keep_alive)
+        continue;
+      handle(session, *message);
+    }
+    request_blocks(session);
+  }
+
+  void handle(peer_session &session, const wire_message &message) {
+    const auto *payload =
+        reinterpret_cast<const unsigned char *>(message.payload.data());
+    switch (message.id) {
+    case msg_choke:
+      session.peer_choking = true;
+      // a choke discards every request we had outstanding with the peer;
+      // with the fast extension the peer rejects each one it drops instead
+      if (!session.fast_extension)
+        drop_requests(session);
+      break;
+    case msg_unchoke:
+      // a fresh unchoke gives a snubbing peer another chance
+      if (session.peer_choking)
+        session.snubbed = false;
+      session.peer_choking = false;
+      break;
+    case msg_interested:
+      session.peer_interested = true;
+      apply_unchokes();
+      break;
+    case msg_not_interested:
+      session.peer_interested = false;
+      apply_unchokes();
+      break;
+    case msg_have:
+      if (message.payload.size() != 4)
+        throw std::runtime_error("Invalid have message");
+      if (session.set_have(static_cast<int>(read_be32(payload))))
+        availability_[read_be32(payload)]++;
+      update_interest(session);
+      drop_if_redundant(session);
+      break;
+    case msg_bitfield:
+      replace_pieces(session, [&] { session.set_bitfield(message.payload); });
+      break;
+    case msg_have_all:
+    case msg_have_none:
+      require_fast(session);
+      replace_pieces(session,
+                     [&] { session.set_all(message.id == msg_have_all); });
+      break;
+    case msg_suggest: {
+      require_fast(session);
+      if (message.payload.size() != 4)
+        throw std::runtime_error("Invalid suggest message");
+      uint32_t piece = read_be32(payload);
+      auto &suggested = session.suggested;
+      if (piece < static_cast<uint32_t>(meta_.num_pieces) &&
+          std::find(suggested.begin(), suggested.end(), piece) ==
+              suggested.end()) {
+        suggested.push_back(piece);
+        if (suggested.size() > max_suggested)
+          suggested.pop_front();
+      }
+      break;
+    }
+    case msg_allowed_fast: {
+      require_fast(session);
+      if (message.payload.size() != 4)
+        throw std::runtime_error("Invalid allowed fast message");
+      uint32_t piece = read_be32(payload);
+      auto &allowed = session.allowed_fast;
+      if (piece < static_cast<uint32_t>(meta_.num_pieces) &&
+          allowed.size() < max_allowed_fast &&
+          std::find(allowed.begin(), allowed.end(), piece) == allowed.end())
+        allowed.push_back(piece);
+      break;
+    }
+    case msg_reject: {
+      require_fast(session);
+      if (message.payload.size() != 12)
+        throw std::runtime_error("Invalid reject message");
+      block_request block{read_be32(payload), read_be32(payload + 4),
+                          read_be32(payload + 8)};
+      on_reject(session, block);
+      break;
+    }
+    case msg_piece:
+      if (message.payload.size() < 8)
+        throw std::runtime_error("Invalid piece message length");
+      // even a block we no longer want shows the peer is sending again
+      session.snubbed = false;
+      session.waiting_since = std::chrono::steady_clock::now();
+      on_block(session, read_be32(payload), read_be32(payload + 4),
+               message.payload.data() + 8, message.payload.size() - 8);
+      break;
+    case msg_request: {
+      if (message.payload.size() != 12)
+        throw std::runtime_error("Invalid request message");
+      block_request block{read_be32(payload), read_be32(payload + 4),
+                          read_be32(payload + 8)};
+      // choked peers may only ask for their allowed fast pieces; requests
+      // we cannot serve are ignored, or rejected under the fast extension
+      bool allowed = !session.am_choking ||
+                     std::find(session.allowed_fast_sent.begin(),
+                               session.allowed_fast_sent.end(),
+                               block.piece) != session.allowed_fast_sent.end();
+      if (!allowed || storage_fd_ < 0 ||
+          session.peer_requests.size() >= max_peer_requests ||
+          !can_serve(block)) {
+        if (session.fast_extension)
+          session.queue(msg_reject, message.payload);
+        break;
+      }
+      session.peer_requests.push_back(block);
+      break;
+    }
+    case msg_cancel: {
+      if (message.payload.size() != 12)
+        throw std::runtime_error("Invalid cancel message");
+      block_request block{read_be32(payload), read_be32(payload + 4),
+                          read_be32(payload + 8)};
+      auto &queued = session.peer_requests;
+      queued.erase(std::remove(queued.begin(), queued.end(), block),
+                   queued.end());
+      break;
+    }
+    case msg_port:
+      break;
+    case msg_extended:
+      if (message.payload.empty())
+        throw std::runtime_error("Invalid extended message");
+      // the first byte is 0 for the handshake, otherwise the id we gave
+      // the extension in ours
+      if (message.payload[0] == 0)
+        on_extension_handshake(session, message.payload.substr(1));
+      else if (message.payload[0] == ut_metadata_id)
+        on_metadata_message(session, message.payload.substr(1));
+      else if (message.payload[0] == ut_pex_id)
+        on_pex_message(session, message.payload.substr(1));
+      break;
+    default:
+      // unknown ids come from extensions we did not negotiate; skip them
+      break;
+    }
+  }
+
+  void require_fast(const peer_session &session) const {
+    if (!session.fast_extension)
+      throw std::runtime_error("Fast extension message without negotiation");
+  }
+
+  // swap in a new view of the peer's pieces, keeping availability in step
+  template <typename Update>
+  void replace_pieces(peer_session &session, Update update) {
+    for (int i = 0; i < meta_.num_pieces; ++i) {
+      if (session.has_piece(i))
+        availability_[i]--;
+    }
+    update();
+    for (int i = 0; i < meta_.num_pieces; ++i) {
+      if (session.has_piece(i))
+        availability_[i]++;
+    }
+    update_interest(session);
+    drop_if_redundant(session);
+  }
+
+  // the peer will not send this block; let another peer have it
+  void on_reject(peer_session &session, const block_request &block) {
+    inflight_table::entry *request = inflight_.find(session.fd(), block);
+    if (!request)
+      return;
+    loop_.cancel(request->timer);
+    inflight_.remove(session.fd(), block);
+    session.outstanding--;
+    release_slots(1);
+    // a rejected allowed fast piece is not asked for again while choked
+    if (session.peer_choking) {
+      auto &allowed = session.allowed_fast;
+      allowed.erase(std::remove(allowed.begin(), allowed.end(), block.piece),
+                    allowed.end());
+    }
+    release_block(block);
+    refill_all();
+  }
+
+  // offer the canonical allowed fast pieces we can serve
+  void send_allowed_fast(peer_session &session) {
+    if (storage_fd_ < 0)
+      return;
+    for (uint32_t piece : allowed_fast_set(session.endpoint(), meta_.info_hash,
+                                           meta_.num_pieces,
+                                           allowed_fast_count)) {
+      if (!have_[piece])
+        continue;
+      std::string payload(4, '\0');
+      write_be32(reinterpret_cast<unsigned char *>(payload.data()), piece);
+      session.queue(msg_allowed_fast, payload);
+      session.allowed_fast_sent.push_back(piece);
+    }
+  }
+
+  // BEP 10 handshake: ut_metadata for peers that came from a magnet link,
+  // ut_pex, and how many requests we queue for the peer
+  std::string encode_extension_handshake() const {
+    json handshake = {
+        {"m", {{"ut_metadata", ut_metadata_id}, {"ut_pex", ut_pex_id}}},
+        {"metadata_size", static_cast<int64_t>(meta_.info.size())},
+        {"reqq", static_cast<int64_t>(max_peer_requests)},
+        {"v", "CC 0.1"}};
+    return encode_extended(0, handshake);
+  }
+
+  void on_extension_handshake(peer_session &session,
+                              const std::string &payload) {
+    json handshake = decode_bencoded_value(payload);
+    if (!handshake.is_object())
+      throw std::runtime_error("Invalid extension handshake");
+    if (handshake.contains("reqq") && handshake["reqq"].is_number_integer() &&
+        handshake["reqq"].get<int64_t>() > 0)
+      session.peer_reqq = handshake["reqq"].get<int64_t>();
+    session.peer_ut_metadata = peer_extension_id(handshake, "ut_metadata");
+    session.peer_ut_pex = peer_extension_id(handshake, "ut_pex");
+  }
+
+  // serve pieces of the info dictionary; we never ask for any ourselves
+  void on_metadata_message(peer_session &session,
+                           const std::string &payload) {
+    metadata_message message = parse_metadata_message(payload);
+    if (message.type != metadata_request || session.peer_ut_metadata == 0)
+      return;
+    int64_t total = static_cast<int64_t>(meta_.info.size());
+    int64_t offset = message.piece * metadata_piece_size;
+    if (message.piece < 0 || offset >= total) {
+      session.queue(msg_extended,
+                    encode_extended(session.peer_ut_metadata,
+                                    {{"msg_type", metadata_reject},
+                                     {"piece", message.piece}}));
+      return;
+    }
+    session.queue(msg_extended,
+                  encode_extended(session.peer_ut_metadata,
+                                  {{"msg_type", metadata_data},
+                                   {"piece", message.piece},
+                                   {"total_size", total}},
+                                  meta_.info.substr(offset,
+                                                    metadata_piece_size)));
+  }
+
+  // BEP 11: pass the peers it names on to whoever keeps the candidates
+  void on_pex_message(peer_session &session, const std::string &payload) {
+    auto now = std::chrono::steady_clock::now();
+    if (session.pex_received &&
+        now - *session.pex_received < std::chrono::seconds(min_pex_gap_sec))
+      return;
+    session.pex_received = now;
+    json message = decode_bencoded_value(payload);
+    if (!message.is_object())
+      throw std::runtime_error("Invalid PEX message from " +
+                               format_endpoint(session.endpoint()));
+    auto read = [&message](const std::string &key, int family,
+                           std::vector<peer_endpoint> &peers) {
+      if (!message.contains(key) || !message[key].is_string())
+        return;
+      size_t before = peers.size();
+      for (const auto &peer :
+           parse_compact_peers(message[key].get<std::string>(), family)) {
+        if (peers.size() - before >= max_pex_peers)
+          break;
+        if (peer.port != 0)
+          peers.push_back(peer);
+      }
+    };
+    std::vector<peer_endpoint> added;
+    std::vector<peer_endpoint> dropped;
+    read("added", AF_INET, added);
+    read("added6", AF_INET6, added);
+    read("dropped", AF_INET, dropped);
+    read("dropped6", AF_INET6, dropped);
+    if (on_pex_ && (!added.empty() || !dropped.empty()))
+      on_pex_(added, dropped);
+  }
+
+  void schedule_pex() {
+    pex_timer_ = loop_.schedule(std::chrono::seconds(pex_interval_sec), [this] {
+      schedule_pex();
+      send_pex();
+    });
+  }
+
+  // tell every PEX peer which of our peers it has not heard about yet and
+  // which ones went away; only peers we dialed are listed, since the port
+  // of an incoming peer is not one anyone could connect to
+  void send_pex() {
+    std::vector<const peer_session *> dialable;
+    for (const auto &entry : sessions_) {
+      if (!entry.second->inbound)
+        dialable.push_back(entry.second.get());
+    }
+    for (auto &entry : sessions_) {
+      peer_session &session = *entry.second;
+      if (session.peer_ut_pex == 0)
+        continue;
+      std::string added, added_flags, added6, added6_flags;
+      std::string dropped, dropped6;
+      size_t added_count = 0;
+      std::vector<peer_endpoint> known;
+      for (const peer_session *other : dialable) {
+        if (other == &session)
+          continue;
+        const peer_endpoint &peer = other->endpoint();
+        bool sent = std::find(session.pex_sent.begin(), session.pex_sent.end(),
+                              peer) != session.pex_sent.end();
+        if (!sent) {
+          if (added_count >= max_pex_peers)
+            continue;
+          added_count++;
+          uint8_t flags = pex_flag_reachable;
+          if (other->piece_count() == static_cast<size_t>(meta_.num_pieces))
+            flags |= pex_flag_seed;
+          if (peer.family == AF_INET6) {
+            added6 += encode_compact_peer(peer);
+            added6_flags += static_cast<char>(flags);
+          } else {
+            added += encode_compact_peer(peer);
+            added_flags += static_cast<char>(flags);
+          }
+        }
+        known.push_back(peer);
+      }
+      size_t dropped_count = 0;
+      for (const auto &peer : session.pex_sent) {
+        if (std::find(known.begin(), known.end(), peer) != known.end())
+          continue;
+        // past the limit the peer stays listed and is dropped next time
+        if (dropped_count >= max_pex_peers) {
+          known.push_back(peer);
+          continue;
+        }
+        dropped_count++;
+        (peer.family == AF_INET6 ? dropped6 : dropped) +=
+            encode_compact_peer(peer);
+      }
+      session.pex_sent = std::move(known);
+      if (added_count == 0 && dropped_count == 0)
+        continue;
+      json message = {{"added", added},       {"added.f", added_flags},
+                      {"added6", added6},     {"added6.f", added6_flags},
+                      {"dropped", dropped},   {"dropped6", dropped6}};
+      session.queue(msg_extended, encode_extended(session.peer_ut_pex, message));
+      update_events(session);
+    }
+  }
+
+  // our pieces as a bitfield message payload
+  std::string encode_bitfield() const {
+    std::string bitfield((meta_.num_pieces + 7) / 8, '\0');
+    for (int i = 0; i < meta_.num_pieces; ++i) {
+      if (have_[i])
+        bitfield[i / 8] |= static_cast<char>(0x80 >> (i % 8));
+    }
+    return bitfield;
+  }
+
+  // a block we have verified and that lies inside its piece
+  bool can_serve(const block_request &block) const {
+    return block.piece < static_cast<uint32_t>(meta_.num_pieces) &&
+           have_[block.piece] && block.length > 0 &&
+           block.length <= max_request_length &&
+           static_cast<uint64_t>(block.begin) + block.length <=
+               static_cast<uint64_t>(meta_.piece_size(block.piece));
+  }
+
+  // move queued requests onto the socket as it drains
+  void serve(peer_session &session) {
+    while (!session.peer_requests.empty() &&
+           session.queued_bytes() < serve_watermark) {
+      block_request block = session.peer_requests.front();
+      session.peer_requests.pop_front();
+      off_t offset = static_cast<off_t>(block.piece) * meta_.piece_length +
+                     block.begin;
+      session.queue_block(block, storage_fd_, offset);
+      session.bytes_uploaded += block.length;
+      uploaded_ += block.length;
+    }
+  }
+
+  void set_choking(peer_session &session, bool choking) {
+    if (session.am_choking == choking)
+      return;
+    session.am_choking = choking;
+    session.queue(choking ? msg_choke : msg_unchoke);
+    // a choke discards whatever the peer had asked for; under the fast
+    // extension each dropped request is rejected and allowed fast ones stay
+    if (choking && session.fast_extension) {
+      std::deque<block_request> kept;
+      for (const auto &block : session.peer_requests) {
+        const auto &allowed = session.allowed_fast_sent;
+        if (std::find(allowed.begin(), allowed.end(), block.piece) !=
+            allowed.end())
+          kept.push_back(block);
+        else
+          session.queue(msg_reject,
+                        encode_block(block.piece, block.begin, block.length));
+      }
+      session.peer_requests = std::move(kept);
+    } else if (choking) {
+      session.peer_requests.clear();
+    }
+    update_events(session);
+  }
+
+  void schedule_rechoke() {
+    rechoke_timer_ =
+        loop_.schedule(std::chrono::seconds(rechoke_interval_sec), [this] {
+          schedule_rechoke();
+          rechoke(std::chrono::steady_clock::now());
+        });
+  }
+
+  // send a keep-alive once the peer has heard nothing from us for a while
+  void rearm_keep_alive(peer_session &session) {
+    session.keep_alive_mark = session.messages_queued();
+    loop_.cancel(session.keep_alive_timer);
+    int fd = session.fd();
+    session.keep_alive_timer =
+        loop_.schedule(std::chrono::seconds(keep_alive_sec), [this, fd] {
+          peer_session &idle = *sessions_.at(fd);
+          idle.queue_keep_alive();
+          update_events(idle);
+        });
+  }
+
+  static std::chrono::milliseconds idle_timeout() {
+    return std::chrono::seconds(idle_timeout_sec);
+  }
+
+  // the check is pushed back by however long ago the peer last spoke, so
+  // reads never touch the timer
+  event_loop::timer_id schedule_idle_check(int fd,
+                                           std::chrono::milliseconds delay) {
+    return loop_.schedule(delay, [this, fd] {
+      peer_session &session = *sessions_.at(fd);
+      auto quiet = std::chrono::duration_cast<std::chrono::milliseconds>(
+          std::chrono::steady_clock::now() - session.last_received);
+      if (quiet >= idle_timeout()) {
+        close_session(fd, "Peer idle", true);
+        return;
+      }
+      session.idle_timer = schedule_idle_check(fd, idle_timeout() - quiet);
+    });
+  }
+
+  void cancel_timers(const peer_session &session) {
+    loop_.cancel(session.keep_alive_timer);
+    loop_.cancel(session.idle_timer);
+    loop_.cancel(session.throttle_timer);
+  }
+
+  // BEP 3 choker: every interval take each peer's rate since the last one,
+  // move the optimistic unchoke every few rounds and rerank
+  void rechoke(std::chrono::steady_clock::time_point now) {
+    double elapsed =
+        std::chrono::duration<double>(now - last_rechoke_).count();
+    elapsed = std::max(elapsed, 1.0);
+    for (auto &entry : sessions_) {
+      peer_session &session = *entry.second;
+      session.download_rate =
+          (session.bytes_downloaded - session.downloaded_at_rechoke) / elapsed;
+      session.upload_rate =
+          (session.bytes_uploaded - session.uploaded_at_rechoke) / elapsed;
+      session.downloaded_at_rechoke = session.bytes_downloaded;
+      session.uploaded_at_rechoke = session.bytes_uploaded;
+      session.throughput += throughput_gain *
+                            (session.download_rate - session.throughput);
+      if (session.am_interested) {
+        session.interested_rounds++;
+        session.unchoked_rounds += !session.peer_choking;
+      }
+      check_snub(session, now);
+    }
+    last_rechoke_ = now;
+    if (rechoke_round_ % replace_rounds == replace_rounds - 1)
+      replace_weakest(now);
+    if (rechoke_round_++ % optimistic_rounds == 0)
+      rotate_optimistic(now);
+    apply_unchokes();
+  }
+
+  // stop asking a peer that keeps us unchoked but sends nothing; its
+  // blocks go to the others
+  void check_snub(peer_session &session,
+                  std::chrono::steady_clock::time_point now) {
+    if (session.snubbed || session.peer_choking || session.outstanding == 0 ||
+        now - session.waiting_since < std::chrono::seconds(snub_sec))
+      return;
+    std::cerr << "Snubbed by peer " << format_endpoint(session.endpoint())
+              << std::endl;
+    session.snubbed = true;
+    drop_requests(session);
+    disown(session.fd());
+    refill_all();
+  }
+
+  // close the lowest scoring peer when an untried one could have its slot,
+  // so the connected set drifts towards the fastest peers; seeds judge
+  // peers by what they take, which the choker already handles
+  void replace_weakest(std::chrono::steady_clock::time_point now) {
+    if (!wants_slot_ || seeding() || sessions_.size() < 2 || !wants_slot_())
+      return;
+    peer_session *weakest = nullptr;
+    for (auto &entry : sessions_) {
+      peer_session &session = *entry.second;
+      if (now - session.connected_at < std::chrono::seconds(score_warmup_sec))
+        continue;
+      if (!weakest || session.score() < weakest->score() ||
+          (session.score() == weakest->score() &&
+           session.srtt_ms > weakest->srtt_ms))
+        weakest = &session;
+    }
+    if (weakest)
+      closing_.push_back(
+          {weakest->fd(), "Replaced by an untried peer", false});
+  }
+
+  // give the optimistic slot to a random choked, interested peer so new
+  // peers get a chance to show what they upload
+  void rotate_optimistic(std::chrono::steady_clock::time_point now) {
+    std::vector<int> candidates;
+    for (const auto &entry : sessions_) {
+      const peer_session &session = *entry.second;
+      if (!session.am_choking || !session.peer_interested ||
+          entry.first == optimistic_fd_)
+        continue;
+      bool fresh =
+          now - session.connected_at < std::chrono::seconds(new_peer_sec);
+      candidates.insert(candidates.end(), fresh ? new_peer_weight : 1,
+                        entry.first);
+    }
+    if (candidates.empty())
+      return;
+    std::uniform_int_distribution<size_t> pick(0, candidates.size() - 1);
+    optimistic_fd_ = candidates[pick(rng_)];
+  }
+
+  // unchoke the interested peers that upload the most to us (or that we
+  // upload the most to once we are seeding) plus the optimistic one
+  void apply_unchokes() {
+    bool can_upload = storage_fd_ >= 0 && have_count_ > 0;
+    bool by_upload = seeding();
+    std::vector<peer_session *> ranked;
+    for (auto &entry : sessions_) {
+      peer_session &session = *entry.second;
+      if (entry.first == optimistic_fd_)
+        set_choking(session, !can_upload);
+      else if (!session.peer_interested)
+        set_choking(session, true);
+      else
+        ranked.push_back(&session);
+    }
+    // ties keep their current state so equal peers are not swapped around
+    std::stable_sort(
+        ranked.begin(), ranked.end(),
+        [by_upload](const peer_session *a, const peer_session *b) {
+          double rate_a = by_upload ? a->upload_rate : a->download_rate;
+          double rate_b = by_upload ? b->upload_rate : b->download_rate;
+          if (rate_a != rate_b)
+            return rate_a > rate_b;
+          return !a->am_choking && b->am_choking;
+        });
+    size_t slots = can_upload ? upload_slots_ : 0;
+    for (size_t i = 0; i < ranked.size(); ++i)
+      set_choking(*ranked[i], i >= slots);
+  }
+
+  bool seeding() const {
+    return have_count_ == static_cast<size_t>(meta_.num_pieces);
+  }
+
+  // two seeds have nothing to exchange. Nothing went wrong, so the manager
+  // only rests the peer and it stays in the cache for the next download
+  void drop_if_redundant(const peer_session &session) {
+    if (seeding() &&
+        session.piece_count() == static_cast<size_t>(meta_.num_pieces))
+      closing_.push_back({session.fd(), "Peer is also a seed", false});
+  }
+
+  // tell the peer whether it has anything we still need
+  void update_interest(peer_session &session) {
+    bool interesting = false;
+    for (int i = 0; i < meta_.num_pieces && !interesting; ++i) {
+      interesting = wanted_[i] && !have_[i] && session.has_piece(i);
+    }
+    if (interesting != session.am_interested) {
+      session.am_interested = interesting;
+      session.queue(interesting ? msg_interested : msg_not_interested);
+    }
+  }
+
+  size_t block_count(int piece) const {
+    return (meta_.piece_size(piece) + block_size - 1) / block_size;
+  }
+
+  block_request make_block(int piece, size_t block) const {
+    block_request request;
+    request.piece = piece;
+    request.begin = static_cast<uint32_t>(block * block_size);
+    request.length = std::min<uint32_t>(
+        block_size, meta_.piece_size(piece) - request.begin);
+    return request;
+  }
+
+  // a piece that failed before, or one a peer on parole starts, belongs
+  // to the peer that starts it
+  piece_progress &start_piece(const peer_session &session, int piece) {
+    piece_progress &progress = active_[piece];
+    progress.data.resize(meta_.piece_size(piece));
+    progress.block_state.assign(block_count(piece), block_missing);
+    progress.block_sources.assign(block_count(piece), peer_endpoint{});
+    progress.parole = session.on_parole || parole_pieces_.count(piece);
+    if (progress.parole)
+      progress.owner = session.fd();
+    return progress;
+  }
+
+  // whether the peer may fetch blocks of a piece under way; an unowned
+  // parole piece (its owner left) goes to the first peer that asks
+  bool can_share(const peer_session &session,
+                 const piece_progress &progress) const {
+    if (progress.parole)
+      return progress.owner == session.fd() || progress.owner < 0;
+    return !session.on_parole;
+  }
+
+  // the next block this peer should be asked for, if any
+  // while choked only the peer's allowed fast pieces may be requested
+  bool can_request(const peer_session &session, int piece) const {
+    if (!session.has_piece(piece))
+      return false;
+    return !session.peer_choking ||
+           std::find(session.allowed_fast.begin(), session.allowed_fast.end(),
+                     static_cast<uint32_t>(piece)) != session.allowed_fast.end();
+  }
+
+  bool can_start(const peer_session &session, int piece) const {
+    return wanted_[piece] && !have_[piece] && !active_.count(piece) &&
+           !finishing_.count(piece) && can_request(session, piece);
+  }
+
+  // take the buffer for a piece from the shared budget, if there is one
+  bool reserve_buffer(int piece) {
+    size_t size = meta_.piece_size(piece);
+    if (budget_) {
+      if (!budget_->fits(size)) {
+        budget_blocked_ = true;
+        return false;
+      }
+      budget_->reserve(size);
+    }
+    buffered_ += size;
+    return true;
+  }
+
+  void release_buffer(int piece) {
+    size_t size = meta_.piece_size(piece);
+    buffered_ -= size;
+    if (budget_)
+      budget_->release(size);
+  }
+
+  std::optional<block_request> pick_block(const peer_session &session) {
+    // finish pieces that are already under way first
+    for (auto &entry : active_) {
+      if (!can_request(session, entry.first) ||
+          !can_share(session, entry.second))
+        continue;
+      auto &states = entry.second.block_state;
+      for (size_t b = 0; b < states.size(); ++b) {
+        // a block that timed out with this peer goes to someone else
+        if (states[b] == block_missing &&
+            !inflight_.find(session.fd(), make_block(entry.first, b))) {
+          if (entry.second.parole)
+            entry.second.owner = session.fd();
+          return make_block(entry.first, b);
+        }
+      }
+    }
+    // then a piece the peer suggested, likely still in its cache
+    for (uint32_t piece : session.suggested) {
+      if (can_start(session, piece) && reserve_buffer(piece)) {
+        start_piece(session, piece);
+        return make_block(piece, 0);
+      }
+    }
+    // then start the rarest piece this peer has
+    int best = -1;
+    for (int i = 0; i < meta_.num_pieces; ++i) {
+      if (!can_start(session, i))
+        continue;
+      if (best < 0 || availability_[i] < availability_[best])
+        best = i;
+    }
+    if (best >= 0 && reserve_buffer(best)) {
+      start_piece(session, best);
+      return make_block(best, 0);
+    }
+    // end game: ask for blocks other peers are already fetching, except
+    // from pieces that belong to one peer
+    for (auto &entry : active_) {
+      if (!can_request(session, entry.first) || session.on_parole ||
+          entry.second.parole)
+        continue;
+      auto &states = entry.second.block_state;
+      for (size_t b = 0; b < states.size(); ++b) {
+        block_request request = make_block(entry.first, b);
+        if (states[b] == block_requested &&
+            !inflight_.find(session.fd(), request))
+          return request;
+      }
+    }
+    return std::nullopt;
+  }
+
+  // keep the peer's request pipeline full
+  void request_blocks(peer_session &session) {
+    if (!session.am_interested || session.snubbed ||
+        (session.peer_choking && session.allowed_fast.empty()))
+      return;
+    size_t depth =
+        session.target_queue_depth(min_queue_depth_, max_queue_depth_);
+    while (session.outstanding < depth) {
+      std::optional<block_request> request = pick_block(session);
+      if (!request)
+        break;
+      // a started piece is simply picked up again later
+      if (slots_ && !slots_->acquire(slot_flow_))
+        break;
+      active_[request->piece].block_state[request->begin / block_size] =
+          block_requested;
+      inflight_table::entry sent;
+      sent.fd = session.fd();
+      sent.block = *request;
+      sent.sent_at = std::chrono::steady_clock::now();
+      sent.timer = schedule_request_timeout(sent.fd, sent.block,
+                                            session.request_timeout());
+      if (session.outstanding == 0)
+        session.waiting_since = sent.sent_at;
+      inflight_.add(sent);
+      session.outstanding++;
+      session.queue(msg_request,
+                    encode_block(request->piece, request->begin, request->length));
+    }
+  }
+
+  // a request went away without data; let another peer have the block
+  void release_block(const block_request &request) {
+    auto it = active_.find(request.piece);
+    if (it == active_.end())
+      return;
+    uint8_t &state = it->second.block_state[request.begin / block_size];
+    if (state != block_requested)
+      return;
+    // in end game another peer may still be fetching it
+    if (inflight_.live_copies(request) > 0)
+      return;
+    state = block_missing;
+  }
+
+  // forget every request out to a peer that choked us or went away
+  void drop_requests(peer_session &session) {
+    for (const auto &request : inflight_.remove_peer(session.fd())) {
+      loop_.cancel(request.timer);
+      release_block(request.block);
+    }
+    release_slots(session.outstanding);
+    session.outstanding = 0;
+  }
+
+  void release_slots(size_t count) {
+    if (slots_ && count > 0)
+      slots_->release(slot_flow_, count);
+  }
+
+  event_loop::timer_id schedule_request_timeout(int fd, block_request block,
+                                                std::chrono::milliseconds delay) {
+    return loop_.schedule(delay,
+                          [this, fd, block] { on_request_timeout(fd, block); });
+  }
+
+  // the first expiry hands the block to other peers but still accepts it
+  // from this one; a peer that misses the grace period as well is dropped
+  void on_request_timeout(int fd, const block_request &block) {
+    inflight_table::entry *request = inflight_.find(fd, block);
+    if (!request)
+      return;
+    if (request->timed_out) {
+      // a peer that went quiet altogether is snubbed rather than dropped;
+      // one that sends other blocks but never this one is dropped
+      peer_session &late = *sessions_.at(fd);
+      check_snub(late, std::chrono::steady_clock::now());
+      if (!late.snubbed)
+        close_session(fd, "Request timeout", true);
+      return;
+    }
+    inflight_.mark_timed_out(*request);
+    request->timer = schedule_request_timeout(
+        fd, block, std::chrono::seconds(request_grace_sec));
+    peer_session &session = *sessions_.at(fd);
+    session.rto_backoff = std::min(session.rto_backoff * 2, max_rto_backoff);
+    release_block(block);
+    refill_all();
+  }
+
+  void on_block(peer_session &session, uint32_t piece, uint32_t begin,
+                const char *data, size_t length) {
+    block_request request{piece, begin, static_cast<uint32_t>(length)};
+    inflight_table::entry *sent = inflight_.find(session.fd(), request);
+    // blocks we did not ask for (or cancelled) are dropped, and so is one
+    // whose length is not what we asked for, since the index ignores it
+    if (!sent || sent->block.length != length)
+      return;
+    loop_.cancel(sent->timer);
+    session.add_rtt_sample(std::chrono::duration<double, std::milli>(
+                               std::chrono::steady_clock::now() - sent->sent_at)
+                               .count());
+    inflight_.remove(session.fd(), request);
+    session.outstanding--;
+    release_slots(1);
+    session.bytes_downloaded += length;
+    downloaded_ += length;
+    session.add_received(length, std::chrono::steady_clock::now());
+
+    auto active = active_.find(piece);
+    if (active == active_.end())
+      return;
+    piece_progress &progress = active->second;
+    uint8_t &state = progress.block_state[begin / block_size];
+    if (state == block_received || begin + length > progress.data.size())
+      return;
+    state = block_received;
+    std::copy_n(data, length, progress.data.begin() + begin);
+    progress.blocks_received++;
+    progress.block_sources[begin / block_size] = session.endpoint();
+
+    // cancel duplicates other peers are still sending, including the
+    // peer whose request timed out
+    for (int fd : inflight_.other_peers(session.fd(), request)) {
+      peer_session &other = *sessions_.at(fd);
+      loop_.cancel(inflight_.remove(fd, request).timer);
+      other.outstanding--;
+      release_slots(1);
+      other.queue(msg_cancel, encode_block(piece, begin, length));
+      update_events(other);
+    }
+
+    if (progress.blocks_received == progress.block_state.size())
+      finish_piece(piece);
+  }
+
+  // a piece being hashed or written stays out of active_ but is not
+  // started again until its outcome is known
+  void finish_piece(uint32_t piece) {
+    auto progress = std::make_shared<piece_progress>(std::move(active_[piece]));
+    active_.erase(piece);
+    if (!hash_pool_) {
+      check_piece(piece, *progress, hash_matches(piece, progress->data));
+      return;
+    }
+    finishing_.insert(piece);
+    auto matches = std::make_shared<bool>(false);
+    hash_pool_->submit(
+        this,
+        [this, piece, progress, matches] {
+          *matches = hash_matches(piece, progress->data);
+        },
+        [this, piece, progress, matches](std::exception_ptr) {
+          finishing_.erase(piece);
+          check_piece(piece, *progress, *matches);
+        });
+  }
+
+  bool hash_matches(uint32_t piece, const std::vector<char> &data) const {
+    unsigned char computed_hash[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const unsigned char *>(data.data()), data.size(),
+         computed_hash);
+    return meta_.pieces.compare(piece * 20, 20,
+                                reinterpret_cast<char *>(computed_hash),
+                                SHA_DIGEST_LENGTH) == 0;
+  }
+
+  void check_piece(uint32_t piece, piece_progress &progress, bool matches) {
+    if (!matches) {
+      std::cerr << "Piece " << piece << " hash mismatch, retrying" << std::endl;
+      release_buffer(piece);
+      on_hash_failure(piece, progress);
+      refill_all();
+      return;
+    }
+    on_hash_pass(piece, progress);
+    if (!disk_pool_ || storage_fd_ < 0) {
+      complete_piece(piece, progress.data);
+      return;
+    }
+    // peers only hear about the piece once it can be read back
+    finishing_.insert(piece);
+    auto data = std::make_shared<std::vector<char>>(std::move(progress.data));
+    int fd = storage_fd_;
+    int64_t offset = piece * meta_.piece_length;
+    disk_pool_->submit(
+        this,
+        [fd, offset, data] {
+          if (pwrite(fd, data->data(), data->size(), offset) !=
+              static_cast<ssize_t>(data->size()))
+            throw std::runtime_error("Failed to write output file");
+        },
+        [this, piece, data](std::exception_ptr error) {
+          finishing_.erase(piece);
+          if (error) {
+            release_buffer(piece);
+            fatal_ = error;
+            return;
+          }
+          complete_piece(piece, *data);
+        });
+  }
+
+  void complete_piece(uint32_t piece, const std::vector<char> &data) {
+    release_buffer(piece);
+    have_[piece] = true;
+    have_count_++;
+    remaining_--;
+    if (remaining_ == 0 && slots_)
+      slots_->return_grants(slot_flow_);
+    // a failed write is not the peer's fault, so it stops the whole download
+    try {
+      on_piece_(static_cast<int>(piece), data);
+    } catch (...) {
+      fatal_ = std::current_exception();
+    }
+    for (auto &entry : sessions_) {
+      entry.second->queue(msg_have, encode_have(piece));
+      update_interest(*entry.second);
+      // once complete, other seeds only hold on to connection slots
+      drop_if_redundant(*entry.second);
+    }
+    refill_all();
+    apply_unchokes();
+  }
+
+  static std::string block_digest(const std::vector<char> &data, size_t block) {
+    size_t begin = block * block_size;
+    size_t length = std::min<size_t>(block_size, data.size() - begin);
+    unsigned char digest[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const unsigned char *>(data.data() + begin), length,
+         digest);
+    return std::string(reinterpret_cast<char *>(digest), SHA_DIGEST_LENGTH);
+  }
+
+  // each distinct peer that sent blocks of a piece
+  static std::vector<peer_endpoint> piece_sources(const piece_progress &progress) {
+    std::vector<peer_endpoint> sources;
+    for (const auto &source : progress.block_sources) {
+      if (std::find(sources.begin(), sources.end(), source) == sources.end())
+        sources.push_back(source);
+    }
+    return sources;
+  }
+
+  // a lone sender is the culprit; several go on parole and the piece is
+  // fetched again by one peer. Every block is remembered so the copies can
+  // be compared once a good one arrives
+  void on_hash_failure(uint32_t piece, const piece_progress &progress) {
+    std::vector<peer_endpoint> sources = piece_sources(progress);
+    credit_sources(sources, false);
+    failed_piece &failed = failed_blocks_[piece];
+    for (size_t b = 0; b < progress.block_sources.size(); ++b)
+      failed.blocks.push_back({progress.block_sources[b], b,
+                               block_digest(progress.data, b)});
+    parole_pieces_.insert(piece);
+    if (sources.size() == 1) {
+      charge(failed, sources.front());
+      return;
+    }
+    for (const auto &source : sources) {
+      if (peer_session *session = find_session(source))
+        session->on_parole = true;
+    }
+  }
+
+  // anyone whose earlier copy of a block differs from the verified one
+  // sent corrupt data; a peer that filled a piece alone is off parole
+  void on_hash_pass(uint32_t piece, const piece_progress &progress) {
+    std::vector<peer_endpoint> sources = piece_sources(progress);
+    credit_sources(sources, true);
+    parole_pieces_.erase(piece);
+    if (sources.size() == 1) {
+      if (peer_session *session = find_session(sources.front()))
+        session->on_parole = false;
+    }
+    auto failed = failed_blocks_.find(piece);
+    if (failed == failed_blocks_.end())
+      return;
+    for (const auto &block : failed->second.blocks) {
+      if (block.digest != block_digest(progress.data, block.block))
+        charge(failed->second, block.source);
+    }
+    failed_blocks_.erase(failed);
+  }
+
+  // strike a peer for a piece unless it was already struck for it
+  void charge(failed_piece &failed, const peer_endpoint &peer) {
+    if (std::find(failed.charged.begin(), failed.charged.end(), peer) !=
+        failed.charged.end())
+      return;
+    failed.charged.push_back(peer);
+    add_strike(peer);
+  }
+
+  // count a proven corrupt piece against the peer's address and ban the
+  // address once it has too many
+  void add_strike(const peer_endpoint &peer) {
+    int &strikes = strikes_[peer.ip];
+    std::cerr << "Peer " << format_endpoint(peer) << " sent corrupt data"
+              << std::endl;
+    if (++strikes != ban_strikes)
+      return;
+    for (const auto &entry : sessions_) {
+      if (entry.second->endpoint().ip == peer.ip)
+        closing_.push_back(
+            {entry.first, "Banned for sending corrupt data", true});
+    }
+    if (on_ban_)
+      on_ban_(peer);
+  }
+
+  peer_session *find_session(const peer_endpoint &peer) {
+    for (auto &entry : sessions_) {
+      if (entry.second->endpoint() == peer)
+        return entry.second.get();
+    }
+    return nullptr;
+  }
+
+  // let the next peer that asks take over pieces this one owned
+  void disown(int fd) {
+    for (auto &entry : active_) {
+      if (entry.second.owner == fd)
+        entry.second.owner = -1;
+    }
+  }
+
+  // count a checked piece towards the score of every peer still connected
+  // that sent part of it
+  void credit_sources(const std::vector<peer_endpoint> &sources,
+                      bool verified) {
+    for (const auto &source : sources) {
+      peer_session *session = find_session(source);
+      if (!session)
+        continue;
+      if (verified)
+        session->pieces_verified++;
+      else
+        session->pieces_failed++;
+    }
+  }
+
+  // remember how fast the peer was for the next run
+  void record_rate(const peer_session &session) {
+    if (!cache_ || session.inbound || session.bytes_downloaded == 0)
+      return;
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - session.connected_at;
+    cache_->record_transfer(session.endpoint(),
+                            session.bytes_downloaded /
+                                std::max(elapsed.count(), 1e-3));
+  }
+
+  void close_session(int fd, const std::string &reason, bool failed) {
+    auto it = sessions_.find(fd);
+    if (it == sessions_.end())
+      return;
+    std::unique_ptr<peer_session> session = std::move(it->second);
+    sessions_.erase(it);
+    cancel_timers(*session);
+    loop_.remove(fd);
+    close(fd);
+    std::cerr << "Failed with peer " << format_endpoint(session->endpoint())
+              << " - " << reason << std::endl;
+    for (int i = 0; i < meta_.num_pieces; ++i) {
+      if (session->has_piece(i))
+        availability_[i]--;
+    }
+    drop_requests(*session);
+    disown(fd);
+    record_rate(*session);
+    if (failed && cache_ && !session->inbound)
+      cache_->record_failure(session->endpoint());
+    if (on_close_)
+      on_close_(session->endpoint(), failed);
+    // hand the released blocks to the remaining peers
+    refill_all();
+    if (fd == optimistic_fd_)
+      optimistic_fd_ = -1;
+    if (!session->am_choking)
+      apply_unchokes();
+  }
+
+  event_loop &loop_;
+  const torrent_meta &meta_;
+  std::vector<bool> wanted_;
+  std::vector<bool> have_;
+  std::vector<int> availability_;
+  size_t remaining_ = 0;
+  piece_handler on_piece_;
+  close_handler on_close_;
+  peer_cache *cache_;
+  std::map<int, piece_progress> active_;
+  inflight_table inflight_;
+  // declared before the sessions, whose buckets hang off these
+  double weight_ = 1.0;
+  token_bucket download_limit_;
+  token_bucket upload_limit_;
+  rate_limits peer_limits_;
+  request_slots *slots_ = nullptr;
+  size_t slot_flow_ = 0;
+  bool slots_granted_ = false;
+  size_t min_queue_depth_ = default_min_queue_depth;
+  size_t max_queue_depth_ = default_max_queue_depth;
+  std::unordered_map<int, std::unique_ptr<peer_session>> sessions_;
+  std::vector<pending_close> closing_;
+  std::exception_ptr fatal_;
+  int storage_fd_ = -1;
+  size_t upload_slots_ = 4;
+  size_t have_count_ = 0;
+  uint64_t downloaded_ = 0;
+  uint64_t uploaded_ = 0;
+  std::chrono::steady_clock::time_point last_rechoke_ =
+      std::chrono::steady_clock::now();
+  event_loop::timer_id rechoke_timer_ = 0;
+  event_loop::timer_id pex_timer_ = 0;
+  pex_handler on_pex_;
+  replacement_check wants_slot_;
+  ban_handler on_ban_;
+  // pieces to fetch from a single peer, blocks of failed pieces, and how
+  // many corrupt pieces each address sent
+  std::set<uint32_t> parole_pieces_;
+  std::map<uint32_t, failed_piece> failed_blocks_;
+  std::map<std::string, int> strikes_;
+  // off-loop hashing and writes, pieces waiting on them, and the piece
+  // buffers this torrent holds
+  worker_pool *hash_pool_ = nullptr;
+  worker_pool *disk_pool_ = nullptr;
+  std::set<uint32_t> finishing_;
+  buffer_budget *budget_ = nullptr;
+  size_t buffered_ = 0;
+  bool budget_blocked_ = false;
+  int rechoke_round_ = 0;
+  int optimistic_fd_ = -1;
+  std::mt19937 rng_{std::random_device{}()};
+};
+
+// Metadata Exchange
+
+// fetches the info dictionary of a magnet link (BEP 9): each peer that
+// offers ut_metadata is handed its own 16 KiB pieces, so several peers fill
+// the dictionary in parallel, and nothing is trusted until the whole of it
+// hashes to the info hash
+class metadata_fetcher {
+public:
+  using close_handler = std::function<void(const peer_endpoint &, bool)>;
+
+  metadata_fetcher(event_loop &loop, const std::string &info_hash)
+      : loop_(loop), info_hash_(info_hash) {}
+
+  ~metadata_fetcher() {
+    for (auto &entry : peers_) {
+      loop_.cancel(entry.second->timer);
+      loop_.remove(entry.first);
+      close(entry.first);
+    }
+  }
+  metadata_fetcher(const metadata_fetcher &) = delete;
+  metadata_fetcher &operator=(const metadata_fetcher &) = delete;
+
+  // called whenever a peer is dropped, failed is true for useless peers
+  void set_close_handler(close_handler on_close) {
+    on_close_ = std::move(on_close);
+  }
+
+  bool complete() const { return !metadata_.empty(); }
+  size_t peer_count() const { return peers_.size(); }
+
+  // the verified, bencoded info dictionary once complete
+  const std::string &metadata() const { return metadata_; }
+
+  // take over a socket that completed the handshake
+  void add_peer(int fd, const peer_handshake &handshake,
+                const std::string &leftover) {
+    peers_[fd] = std::make_unique<fetch_peer>(fd, handshake.endpoint);
+    loop_.add(fd, EPOLLIN, [this, fd](uint32_t events) {
+      try {
+        on_event(fd, events);
+      } catch (const std::exception &e) {
+        close_peer(fd, e.what(), true);
+      }
+    });
+    try {
+      fetch_peer &peer = *peers_.at(fd);
+      if (!handshake.supports(extension_protocol_byte, extension_protocol_bit))
+        throw std::runtime_error("Peer does not support extensions");
+      // the fast extension wants our pieces first, and we have none
+      if (handshake.supports(fast_extension_byte, fast_extension_bit))
+        peer.session.queue(msg_have_none);
+      json ours = {{"m", {{"ut_metadata", ut_metadata_id}}}, {"v", "CC 0.1"}};
+      peer.session.queue(msg_extended, encode_extended(0, ours));
+      arm_timer(peer);
+      peer.session.reader.feed(leftover.data(), leftover.size());
+      process(peer);
+      update_events(peer);
+    } catch (const std::exception &e) {
+      close_peer(fd, e.what(), true);
+    }
+  }
+
+  // drop peers whose sends failed or that sent bad metadata
+  void tick() {
+    std::vector<std::pair<int, std::string>> closing;
+    std::swap(closing, closing_);
+    for (const auto &entry : closing)
+      close_peer(entry.first, entry.second, true);
+  }
+
+private:
+  // metadata pieces asked of one peer at a time; the dictionary is small,
+  // so spreading it over peers matters more than a deep queue
+  static constexpr size_t max_requests_per_peer = 2;
+  // a peer that owes us a handshake or a piece for this long is dropped
+  static constexpr int request_timeout_sec = 10;
+
+  static constexpr uint8_t piece_missing = 0;
+  static constexpr uint8_t piece_requested = 1;
+  static constexpr uint8_t piece_received = 2;
+
+  struct fetch_peer {
+    fetch_peer(int fd, const peer_endpoint &endpoint)
+        : session(fd, endpoint, 0) {}
+
+    peer_session session;
+    std::vector<size_t> requested; // metadata pieces asked of this peer
+    event_loop::timer_id timer = 0;
+  };
+
+  void on_event(int fd, uint32_t events) {
+    fetch_peer &peer = *peers_.at(fd);
+    if (events & EPOLLOUT && !peer.session.flush())
+      throw std::runtime_error("Failed to send to peer");
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+      char buffer[65536];
+      ssize_t bytes = recv(fd, buffer, sizeof(buffer), 0);
+      if (bytes == 0)
+        throw std::runtime_error("Connection closed by peer");
+      if (bytes < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+          throw std::runtime_error("Failed to receive from peer");
+      } else {
+        peer.session.reader.feed(buffer, bytes);
+        process(peer);
+      }
+    }
+    // the peer may have been closed while processing
+    if (peers_.count(fd))
+      update_events(peer);
+  }
+
+  void update_events(fetch_peer &peer) {
+    if (!peer.session.flush()) {
+      closing_.emplace_back(peer.session.fd(), "Failed to send to peer");
+      return;
+    }
+    loop_.modify(peer.session.fd(),
+                 EPOLLIN | (peer.session.wants_write()
+                                ? static_cast<uint32_t>(EPOLLOUT)
+                                : 0));
+  }
+
+  // only extended messages matter; pieces and choking are for the download
+  void process(fetch_peer &peer) {
+    while (!complete()) {
+      std::optional<wire_message> message = peer.session.reader.next();
+      if (!message)
+        break;
+      if (message->keep_alive || message->id != msg_extended)
+        continue;
+      if (message->payload.empty())
+        throw std::runtime_error("Invalid extended message");
+      if (message->payload[0] == 0)
+        on_extension_handshake(peer, message->payload.substr(1));
+      else if (message->payload[0] == ut_metadata_id)
+        on_metadata_message(peer, message->payload.substr(1));
+    }
+  }
+
+  // the first peer to give a size decides how many pieces there are
+  void on_extension_handshake(fetch_peer &peer, const std::string &payload) {
+    json handshake = decode_bencoded_value(payload);
+    if (!handshake.is_object())
+      throw std::runtime_error("Invalid extension handshake");
+    peer.session.peer_ut_metadata =
+        peer_extension_id(handshake, "ut_metadata");
+    if (peer.session.peer_ut_metadata == 0)
+      throw std::runtime_error("Peer does not offer metadata");
+    if (!handshake.contains("metadata_size") ||
+        !handshake["metadata_size"].is_number_integer())
+      throw std::runtime_error("Peer did not give the metadata size");
+    int64_t size = handshake["metadata_size"].get<int64_t>();
+    if (size <= 0 || size > max_metadata_size)
+      throw std::runtime_error("Invalid metadata size");
+    if (size_ == 0) {
+      size_ = size;
+      size_t count = (size + metadata_piece_size - 1) / metadata_piece_size;
+      pieces_.assign(count, std::string());
+      state_.assign(count, piece_missing);
+      sources_.assign(count, -1);
+    } else if (size != size_) {
+      throw std::runtime_error("Metadata size differs from other peers");
+    }
+    request_pieces(peer);
+  }
+
+  void on_metadata_message(fetch_peer &peer, const std::string &payload) {
+    metadata_message message = parse_metadata_message(payload);
+    switch (message.type) {
+    case metadata_request:
+      // we have nothing to give until the fetch is done
+      if (peer.session.peer_ut_metadata != 0)
+        peer.session.queue(msg_extended,
+                           encode_extended(peer.session.peer_ut_metadata,
+                                           {{"msg_type", metadata_reject},
+                                            {"piece", message.piece}}));
+      break;
+    case metadata_data:
+      on_data(peer, message);
+      break;
+    case metadata_reject:
+      throw std::runtime_error("Peer rejected a metadata request");
+    default:
+      break;
+    }
+  }
+
+  void on_data(fetch_peer &peer, metadata_message &message) {
+    auto it = std::find(peer.requested.begin(), peer.requested.end(),
+                        static_cast<size_t>(message.piece));
+    if (message.piece < 0 || it == peer.requested.end())
+      return; // not asked of this peer
+    peer.requested.erase(it);
+    size_t index = message.piece;
+    // another peer answered first after a timeout
+    if (state_[index] == piece_received) {
+      request_pieces(peer);
+      return;
+    }
+    size_t expected = std::min<int64_t>(
+        metadata_piece_size, size_ - static_cast<int64_t>(index) *
+                                         static_cast<int64_t>(
+                                             metadata_piece_size));
+    if (message.total_size != size_ || message.data.size() != expected)
+      throw std::runtime_error("Invalid metadata piece");
+    pieces_[index] = std::move(message.data);
+    state_[index] = piece_received;
+    sources_[index] = peer.session.fd();
+    received_++;
+    if (received_ == pieces_.size()) {
+      assemble();
+      return;
+    }
+    arm_timer(peer);
+    request_pieces(peer);
+  }
+
+  // join the pieces and check them against the info hash; on a mismatch
+  // every peer that contributed is dropped and the fetch starts over
+  void assemble() {
+    std::string info;
+    for (const auto &piece : pieces_)
+      info += piece;
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const unsigned char *>(info.data()), info.size(),
+         hash);
+    if (info_hash_.compare(0, SHA_DIGEST_LENGTH,
+                           reinterpret_cast<char *>(hash),
+                           SHA_DIGEST_LENGTH) == 0) {
+      metadata_ = std::move(info);
+      return;
+    }
+    std::cerr << "Metadata does not match the info hash" << std::endl;
+    for (size_t i = 0; i < pieces_.size(); ++i) {
+      bool queued = std::any_of(
+          closing_.begin(), closing_.end(),
+          [this, i](const auto &entry) { return entry.first == sources_[i]; });
+      if (!queued)
+        closing_.emplace_back(sources_[i], "Sent bad metadata");
+      pieces_[i].clear();
+      state_[i] = piece_missing;
+      sources_[i] = -1;
+    }
+    // answers to requests from before the reset must not count
+    for (auto &entry : peers_)
+      entry.second->requested.clear();
+    received_ = 0;
+  }
+
+  // ask the peer for missing pieces up to its share
+  void request_pieces(fetch_peer &peer) {
+    if (peer.session.peer_ut_metadata == 0 || complete())
+      return;
+    bool was_idle = peer.requested.empty();
+    for (size_t i = 0; i < state_.size() &&
+                       peer.requested.size() < max_requests_per_peer;
+         ++i) {
+      if (state_[i] != piece_missing)
+        continue;
+      state_[i] = piece_requested;
+      peer.requested.push_back(i);
+      peer.session.queue(
+          msg_extended,
+          encode_extended(peer.session.peer_ut_metadata,
+                          {{"msg_type", metadata_request},
+                           {"piece", static_cast<int64_t>(i)}}));
+    }
+    if (was_idle && !peer.requested.empty())
+      arm_timer(peer);
+  }
+
+  void request_all() {
+    for (auto &entry : peers_) {
+      request_pieces(*entry.second);
+      update_events(*entry.second);
+    }
+  }
+
+  // drop the peer if it still owes us its handshake or a piece
+  void arm_timer(fetch_peer &peer) {
+    loop_.cancel(peer.timer);
+    int fd = peer.session.fd();
+    peer.timer =
+        loop_.schedule(std::chrono::seconds(request_timeout_sec), [this, fd] {
+          fetch_peer &late = *peers_.at(fd);
+          if (late.session.peer_ut_metadata == 0 || !late.requested.empty())
+            close_peer(fd, "Metadata request timeout", true);
+        });
+  }
+
+  void close_peer(int fd, const std::string &reason, bool failed) {
+    auto it = peers_.find(fd);
+    if (it == peers_.end())
+      return;
+    std::unique_ptr<fetch_peer> peer = std::move(it->second);
+    peers_.erase(it);
+    loop_.cancel(peer->timer);
+    loop_.remove(fd);
+    close(fd);
+    std::cerr << "Failed with peer "
+              << format_endpoint(peer->session.endpoint()) << " - " << reason
+              << std::endl;
+    for (size_t index : peer->requested) {
+      if (state_[index] == piece_requested)
+        state_[index] = piece_missing;
+    }
+    if (on_close_)
+      on_close_(peer->session.endpoint(), failed);
+    // hand its pieces to the remaining peers
+    request_all();
+  }
+
+  event_loop &loop_;
+  std::string info_hash_;
+  close_handler on_close_;
+  std::unordered_map<int, std::unique_ptr<fetch_peer>> peers_;
+  std::vector<std::pair<int, std::string>> closing_;
+  int64_t size_ = 0;
+  std::vector<std::string> pieces_;
+  std::vector<uint8_t> state_;
+  std::vector<int> sources_; // fd of the peer each piece came from
+  size_t received_ = 0;
+  std::string metadata_;
+};
+
+// UDP Socket
+
+// the protocols that share our UDP port
+enum class udp_protocol { utp, dht };
+
+// uTP packets open with a BEP 29 header (version 1, type 0 to 4) at least
+// 20 bytes long, KRPC messages are bencoded dictionaries
+std::optional<udp_protocol> classify_datagram(const char *data, size_t size) {
+  auto first = static_cast<uint8_t>(data[0]);
+  if (size >= 20 && (first & 0x0F) == 1 && (first >> 4) <= 4)
+    return udp_protocol::utp;
+  if (size > 0 && data[0] == 'd')
+    return udp_protocol::dht;
+  return std::nullopt;
+}
+
+// one IPv4 UDP port shared by uTP and the DHT. Datagrams are read in
+// batches with recvmmsg and handed to the protocol they belong to; sends
+// are queued and go out in batches with sendmmsg before the event loop
+// waits again, with runs of equal-sized datagrams to one peer folded into
+// a single GSO send where the kernel supports it
+class udp_socket {
+public:
+  using datagram_handler =
+      std::function<void(const char *data, size_t size, const sockaddr_in &from)>;
+  // called once a batch of datagrams has been dispatched, so a protocol
+  // can answer all of them together
+  using batch_handler = std::function<void()>;
+
+  // bind the first free port from preferred_port upwards, or any port for 0
+  udp_socket(event_loop &loop, uint16_t preferred_port)
+      : loop_(loop), buffers_(batch_size * max_datagram_size) {
+    uint16_t attempts = preferred_port == 0 ? 1 : port_attempts;
+    for (uint16_t port = preferred_port; port < preferred_port + attempts;
+         ++port) {
+      fd_ = open_socket(port);
+      if (fd_ >= 0)
+        break;
+    }
+    if (fd_ < 0)
+      throw std::runtime_error("Failed to open UDP socket");
+    sockaddr_in addr = {};
+    socklen_t addr_len = sizeof(addr);
+    getsockname(fd_, reinterpret_cast<sockaddr *>(&addr), &addr_len);
+    port_ = ntohs(addr.sin_port);
+    loop_.add(fd_, EPOLLIN, [this](uint32_t events) {
+      if (events & EPOLLOUT)
+        on_writable();
+      if (events & EPOLLIN)
+        on_readable();
+    });
+    flusher_ = loop_.add_flusher([this] { flush(); });
+  }
+
+  ~udp_socket() {
+    flush();
+    loop_.remove_flusher(flusher_);
+    loop_.remove(fd_);
+    close(fd_);
+  }
+  udp_socket(const udp_socket &) = delete;
+  udp_socket &operator=(const udp_socket &) = delete;
+
+  uint16_t port() const { return port_; }
+
+  void set_handler(udp_protocol protocol, datagram_handler on_datagram,
+                   batch_handler on_batch = nullptr) {
+    handlers_[static_cast<size_t>(protocol)] = {std::move(on_datagram),
+                                                std::move(on_batch)};
+  }
+
+  void remove_handler(udp_protocol protocol) {
+    handlers_[static_cast<size_t>(protocol)] = {};
+  }
+
+  // queue a datagram; it goes out with the next batch. While the socket
+  // buffer is full the queue waits for room, and past a limit new
+  // datagrams are dropped as a full network would drop them
+  void send(const sockaddr_in &to, std::string data) {
+    if (blocked_ && queue_.size() >= max_blocked)
+      return;
+    queue_.push_back({to, std::move(data)});
+    if (queue_.size() >= max_queued)
+      flush();
+  }
+
+  // send everything queued, or as much as the socket buffer takes
+  void flush() {
+    if (blocked_)
+      return;
+    size_t next = 0;
+    while (next < queue_.size()) {
+      mmsghdr messages[batch_size] = {};
+      iovec iovs[batch_size][max_segments];
+      alignas(cmsghdr) char control[batch_size][CMSG_SPACE(sizeof(uint16_t))];
+      size_t counts[batch_size];
+      size_t message_count = 0;
+      size_t pos = next;
+      while (message_count < batch_size && pos < queue_.size()) {
+        size_t count = segments_at(pos);
+        msghdr &header = messages[message_count].msg_hdr;
+        header.msg_name = &queue_[pos].to;
+        header.msg_namelen = sizeof(sockaddr_in);
+        for (size_t i = 0; i < count; ++i) {
+          iovs[message_count][i].iov_base = queue_[pos + i].data.data();
+          iovs[message_count][i].iov_len = queue_[pos + i].data.size();
+        }
+        header.msg_iov = iovs[message_count];
+        header.msg_iovlen = count;
+        if (count > 1) {
+          header.msg_control = control[message_count];
+          header.msg_controllen = sizeof(control[message_count]);
+          cmsghdr *cmsg = CMSG_FIRSTHDR(&header);
+          cmsg->cmsg_level = SOL_UDP;
+          cmsg->cmsg_type = UDP_SEGMENT;
+          cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+          auto segment_size = static_cast<uint16_t>(queue_[pos].data.size());
+          std::memcpy(CMSG_DATA(cmsg), &segment_size, sizeof(segment_size));
+        }
+        counts[message_count++] = count;
+        pos += count;
+      }
+
+      int sent = sendmmsg(fd_, messages, message_count, 0);
+      if (sent < 0 && gso_ && (errno == EIO || errno == EINVAL)) {
+        // no segmentation offload here; send datagrams one by one
+        gso_ = false;
+        continue;
+      }
+      if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK ||
+                       errno == ENOBUFS)) {
+        // the rest goes out once the socket is writable again
+        queue_.erase(queue_.begin(), queue_.begin() + next);
+        blocked_ = true;
+        loop_.modify(fd_, EPOLLIN | EPOLLOUT);
+        return;
+      }
+      // UDP may drop anything, so a datagram that fails to go out is
+      // dropped as well
+      size_t done = sent > 0 ? static_cast<size_t>(sent) : 1;
+      for (size_t i = 0; i < done; ++i)
+        next += counts[i];
+    }
+    queue_.clear();
+  }
+
+private:
+  static constexpr uint16_t port_attempts = 9;
+  static constexpr size_t batch_size = 32;
+  static constexpr size_t max_datagram_size = 2048;
+  static constexpr size_t max_queued = 512;
+  static constexpr size_t max_blocked = 4096;
+  // a GSO send carries up to 64 segments and 64 KiB
+  static constexpr size_t max_segments = 64;
+  static constexpr size_t max_gso_bytes = 65000;
+  // many connections' windows funnel through this one socket
+  static constexpr int socket_buffer_size = 4 << 20;
+
+  struct queued_datagram {
+    sockaddr_in to;
+    std::string data;
+  };
+
+  struct protocol_handlers {
+    datagram_handler on_datagram;
+    batch_handler on_batch;
+  };
+
+  static int open_socket(uint16_t port) {
+    int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0)
+      return -1;
+    int buffer = socket_buffer_size;
+    setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+    setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &buffer, sizeof(buffer));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0)
+      return fd;
+    close(fd);
+    return -1;
+  }
+
+  // how many queued datagrams from pos can go out as one GSO send: same
+  // peer, same size, except that the last one may be shorter
+  size_t segments_at(size_t pos) const {
+    if (!gso_)
+      return 1;
+    const queued_datagram &first = queue_[pos];
+    size_t segment_size = first.data.size();
+    size_t count = 1, bytes = segment_size;
+    while (pos + count < queue_.size() && count < max_segments) {
+      const queued_datagram &next = queue_[pos + count];
+      if (next.to.sin_addr.s_addr != first.to.sin_addr.s_addr ||
+          next.to.sin_port != first.to.sin_port ||
+          next.data.size() > segment_size || next.data.empty() ||
+          bytes + next.data.size() > max_gso_bytes)
+        break;
+      bytes += next.data.size();
+      count++;
+      if (next.data.size() < segment_size)
+        break;
+    }
+    return count;
+  }
+
+  void on_writable() {
+    blocked_ = false;
+    loop_.modify(fd_, EPOLLIN);
+    flush();
+  }
+
+  void on_readable() {
+    bool dispatched[2] = {false, false};
+    while (true) {
+      mmsghdr messages[batch_size] = {};
+      iovec iovs[batch_size];
+      sockaddr_in addrs[batch_size];
+      for (size_t i = 0; i < batch_size; ++i) {
+        iovs[i].iov_base = buffers_.data() + i * max_datagram_size;
+        iovs[i].iov_len = max_datagram_size;
+        messages[i].msg_hdr.msg_name = &addrs[i];
+        messages[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+        messages[i].msg_hdr.msg_iov = &iovs[i];
+        messages[i].msg_hdr.msg_iovlen = 1;
+      }
+      int count = recvmmsg(fd_, messages, batch_size, MSG_DONTWAIT, nullptr);
+      if (count <= 0)
+        break;
+      for (int i = 0; i < count; ++i) {
+        const char *data = buffers_.data() + i * max_datagram_size;
+        size_t size = messages[i].msg_len;
+        if (size == 0 || (messages[i].msg_hdr.msg_flags & MSG_TRUNC) ||
+            messages[i].msg_hdr.msg_namelen != sizeof(sockaddr_in))
+          continue;
+        std::optional<udp_protocol> protocol = classify_datagram(data, size);
+        if (!protocol)
+          continue;
+        auto index = static_cast<size_t>(*protocol);
+        if (!handlers_[index].on_datagram)
+          continue;
+        handlers_[index].on_datagram(data, size, addrs[i]);
+        dispatched[index] = true;
+      }
+      if (static_cast<size_t>(count) < batch_size)
+        break;
+    }
+    for (size_t i = 0; i < 2; ++i) {
+      if (dispatched[i] && handlers_[i].on_batch)
+        handlers_[i].on_batch();
+    }
+  }
+
+  event_loop &loop_;
+  int fd_ = -1;
+  uint16_t port_ = 0;
+  uint64_t flusher_ = 0;
+  bool gso_ = true;
+  // the last send found the socket buffer full
+  bool blocked_ = false;
+  std::vector<char> buffers_;
+  protocol_handlers handlers_[2];
+  std::vector<queued_datagram> queue_;
+};
+
+// uTP
+
+// BEP 29 micro transport protocol: a reliable stream over UDP whose LEDBAT
+// congestion control backs off as soon as its packets start queueing, so
+// transfers give way to other traffic on the same uplink
+
+enum utp_type : uint8_t {
+  utp_data = 0,
+  utp_fin = 1,
+  utp_state = 2,
+  utp_reset = 3,
+  utp_syn = 4
+};
+
+const uint8_t utp_version = 1;
+const size_t utp_header_size = 20;
+const uint8_t utp_ext_sack = 1;
+
+struct utp_packet {
+  uint8_t type = utp_data;
+  uint16_t connection_id = 0;
+  uint32_t timestamp = 0;      // sender's clock in microseconds
+  uint32_t timestamp_diff = 0; // the sender's last one-way delay sample
+  uint32_t wnd_size = 0;       // bytes the sender can still buffer
+  uint16_t seq_nr = 0;
+  uint16_t ack_nr = 0;
+  std::string sack; // bit i acknowledges ack_nr + 2 + i
+  std::string payload;
+};
+
+std::string encode_utp_packet(const utp_packet &packet) {
+  std::string out(utp_header_size, '\0');
+  auto *header = reinterpret_cast<unsigned char *>(out.data());
+  header[0] = static_cast<unsigned char>(packet.type << 4 | utp_version);
+  header[1] = packet.sack.empty() ? 0 : utp_ext_sack;
+  write_be16(header + 2, packet.connection_id);
+  write_be32(header + 4, packet.timestamp);
+  write_be32(header + 8, packet.timestamp_diff);
+  write_be32(header + 12, packet.wnd_size);
+  write_be16(header + 16, packet.seq_nr);
+  write_be16(header + 18, packet.ack_nr);
+  if (!packet.sack.empty()) {
+    out += '\0';
+    out += static_cast<char>(packet.sack.size());
+    out += packet.sack;
+  }
+  out += packet.payload;
+  return out;
+}
+
+// false for datagrams that are not uTP; extensions other than selective
+// acks are skipped
+bool parse_utp_packet(const char *data, size_t size, utp_packet &packet) {
+  auto *in = reinterpret_cast<const unsigned char *>(data);
+  if (size < utp_header_size || (in[0] & 0x0F) != utp_version ||
+      (in[0] >> 4) > utp_syn)
+    return false;
+  packet.type = in[0] >> 4;
+  packet.connection_id = read_be16(in + 2);
+  packet.timestamp = read_be32(in + 4);
+  packet.timestamp_diff = read_be32(in + 8);
+  packet.wnd_size = read_be32(in + 12);
+  packet.seq_nr = read_be16(in + 16);
+  packet.ack_nr = read_be16(in + 18);
+  size_t pos = utp_header_size;
+  uint8_t extension = in[1];
+  while (extension != 0) {
+    if (pos + 2 > size || pos + 2 + in[pos + 1] > size)
+      return false;
+    if (extension == utp_ext_sack)
+      packet.sack.assign(data + pos + 2, in[pos + 1]);
+    extension = in[pos];
+    pos += 2 + in[pos + 1];
+  }
+  packet.payload.assign(data + pos, size - pos);
+  return true;
+}
+
+// sequence numbers wrap at 16 bits: a comes before b when b is less than
+// half the space ahead of it
+bool seq_before(uint16_t a, uint16_t b) {
+  return static_cast<int16_t>(static_cast<uint16_t>(a - b)) < 0;
+}
+
+uint32_t utp_timestamp(std::chrono::steady_clock::time_point now) {
+  return static_cast<uint32_t>(
+      std::chrono::duration_cast<std::chrono::microseconds>(
+          now.time_since_epoch())
+          .count());
+}
+
+struct utp_stats {
+  uint64_t packets_sent = 0;
+  uint64_t packets_resent = 0;
+  uint64_t timeouts = 0;
+  uint64_t packets_dropped = 0; // by the test impairment
+};
+
+// every uTP connection on one UDP socket. Each connection is bridged to
+// one end of a socketpair and the other end is handed out, so peer sessions
+// read and write uTP peers exactly like TCP sockets
+class utp_socket_manager {
+public:
+  using accept_handler =
+      std::function<void(int fd, const peer_endpoint &peer)>;
+
+  utp_socket_manager(event_loop &loop, udp_socket &socket)
+      : loop_(loop), socket_(socket), rng_(std::random_device{}()) {
+    timer_fd_ = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (timer_fd_ < 0)
+      throw std::runtime_error("Failed to create uTP timer");
+    loop_.add(timer_fd_, EPOLLIN, [this](uint32_t) { on_timer(); });
+    // acks for a whole batch of datagrams go out together
+    socket_.set_handler(
+        udp_protocol::utp,
+        [this](const char *data, size_t size, const sockaddr_in &from) {
+          on_datagram(data, size, from);
+        },
+        [this] { finish_round(clock::now()); });
+  }
+
+  ~utp_socket_manager() {
+    for (auto &entry : connections_) {
+      if (!entry.second->closed)
+        close_connection(*entry.second, true);
+    }
+    reap();
+    socket_.remove_handler(udp_protocol::utp);
+    loop_.remove(timer_fd_);
+    close(timer_fd_);
+  }
+  utp_socket_manager(const utp_socket_manager &) = delete;
+  utp_socket_manager &operator=(const utp_socket_manager &) = delete;
+
+  uint16_t port() const { return socket_.port(); }
+  const utp_stats &stats() const { return stats_; }
+
+  // peers that connect to us are handed over as connected sockets
+  void set_accept_handler(accept_handler on_accept) {
+    on_accept_ = std::move(on_accept);
+  }
+
+  // start connecting to an IPv4 peer and return our end of the bridge right
+  // away; what is written to it goes out once the peer answers, and it
+  // reads EOF if the peer never does
+  int connect(const peer_endpoint &peer) {
+    if (peer.family != AF_INET)
+      throw std::runtime_error("uTP peers must be IPv4");
+    sockaddr_storage storage;
+    make_sockaddr(peer, storage);
+    sockaddr_in addr;
+    std::memcpy(&addr, &storage, sizeof(addr));
+    uint16_t recv_id;
+    std::string key;
+    do {
+      recv_id = static_cast<uint16_t>(rng_());
+      key = connection_key(addr, recv_id);
+    } while (connections_.count(key));
+
+    auto conn = std::make_unique<connection>();
+    conn->peer = peer;
+    conn->addr = addr;
+    conn->recv_id = recv_id;
+    conn->send_id = recv_id + 1;
+    int session = open_bridge(*conn);
+    auto now = std::chrono::steady_clock::now();
+    sent_packet syn;
+    syn.type = utp_syn;
+    syn.seq = conn->seq_nr++;
+    conn->unacked.push_back(syn);
+    transmit(*conn, conn->unacked.back(), now);
+    connections_[key] = std::move(conn);
+    arm_timer(now);
+    return session;
+  }
+
+  // for loopback tests: drop outgoing packets with probability loss and
+  // hold the rest back by delay
+  void set_impairment(double loss, std::chrono::milliseconds delay) {
+    loss_ = loss;
+    delay_ = delay;
+  }
+
+private:
+  using clock = std::chrono::steady_clock;
+
+  static constexpr size_t max_connections = 200;
+  static constexpr size_t max_packet_size = 1400;
+  static constexpr size_t max_payload = max_packet_size - utp_header_size;
+  // congestion window bounds, and the most we buffer for the session
+  static constexpr double min_window = 2 * max_payload;
+  static constexpr double max_window = 1 << 20;
+  static constexpr size_t receive_window = 1 << 20;
+  static constexpr uint16_t max_reorder = 1024;
+  static constexpr size_t max_sack_bytes = 128;
+  // LEDBAT aims for 100 ms of queueing delay and grows the window by at
+  // most 3000 bytes per round trip when below it
+  static constexpr double target_delay_us = 100000;
+  static constexpr double max_cwnd_gain = 3000;
+  // the base delay is the lowest of this minute and the last
+  static constexpr int base_delay_bucket_sec = 60;
+  static constexpr double initial_rto_us = 1000000;
+  static constexpr double min_rto_us = 500000;
+  static constexpr double max_rto_us = 16000000;
+  // three selectively acked packets past a hole mean it was lost
+  static constexpr int loss_threshold = 3;
+  // a peer that answers neither of two SYNs does not speak uTP
+  static constexpr int max_syn_sends = 2;
+  static constexpr int max_timeouts = 6;
+  static constexpr int linger_sec = 5;
+  // packets due within this much of now go out in the same burst
+  static constexpr std::chrono::microseconds pacing_quantum{1000};
+
+  struct sent_packet {
+    uint16_t seq = 0;
+    uint8_t type = utp_data;
+    std::string payload;
+    clock::time_point sent_at;
+    int transmissions = 0;
+    bool need_resend = false;
+    bool acked = false; // selectively, ahead of the cumulative ack
+  };
+
+  struct connection {
+    peer_endpoint peer;
+    sockaddr_in addr = {};
+    uint16_t recv_id = 0;
+    uint16_t send_id = 0;
+    bool connected = false;
+    bool closed = false;
+    int bridge = -1;
+    bool registered = false; // bridge watched by the event loop
+    uint32_t events = 0;
+    bool want_read = false;
+    bool bridge_eof = false;   // the session sent everything it will
+    bool session_gone = false; // and will read nothing more
+
+    // sending
+    uint16_t seq_nr = 1;
+    std::deque<sent_packet> unacked; // consecutive sequence numbers
+    size_t resend_count = 0;
+    size_t in_flight = 0;
+    uint16_t last_ack = 0;
+    int duplicate_acks = 0;
+    bool fin_sent = false;
+    double cwnd = min_window;
+    double ssthresh = max_window;
+    bool slow_start = true;
+    uint32_t peer_window = receive_window;
+    double srtt_us = 0;
+    double rttvar_us = 0;
+    double rto_us = initial_rto_us;
+    int timeouts = 0;
+    clock::time_point rto_deadline = clock::time_point::max();
+    clock::time_point next_send;
+    bool paced = false;
+    clock::time_point last_cut;
+    bool has_base_delay = false;
+    uint32_t base_delay = 0;          // this minute
+    uint32_t previous_base_delay = 0; // last minute
+    clock::time_point base_delay_rollover;
+    clock::time_point linger_deadline = clock::time_point::max();
+
+    // receiving
+    uint16_t ack_nr = 0;
+    bool ack_due = false;
+    uint32_t reply_micro = 0; // the delay of their last packet, echoed back
+    std::unordered_map<uint16_t, std::string> reorder;
+    size_t reorder_bytes = 0;
+    std::string to_bridge;
+    bool window_closed = false;
+    bool fin_received = false;
+    uint16_t eof_seq = 0;
+    bool shut = false; // told the session the peer is done
+  };
+
+  struct delayed_datagram {
+    clock::time_point due;
+    sockaddr_in to;
+    std::string data;
+  };
+
+  // connections are told apart by the peer's address and our receive id
+  static std::string connection_key(const sockaddr_in &addr, uint16_t id) {
+    std::string key(8, '\0');
+    std::memcpy(key.data(), &addr.sin_addr, 4);
+    std::memcpy(key.data() + 4, &addr.sin_port, 2);
+    std::memcpy(key.data() + 6, &id, 2);
+    return key;
+  }
+
+  int open_bridge(connection &conn) {
+    int fds[2];
+    if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                   fds) < 0)
+      throw std::runtime_error("Failed to create uTP bridge");
+    conn.bridge = fds[0];
+    conn.registered = true;
+    connection *c = &conn;
+    loop_.add(conn.bridge, 0, [this, c](uint32_t events) {
+      on_bridge(*c, events);
+    });
+    return fds[1];
+  }
+
+  void send_datagram(const sockaddr_in &to, std::string data,
+                     clock::time_point now) {
+    stats_.packets_sent++;
+    if (loss_ > 0 && std::uniform_real_distribution<>(0, 1)(rng_) < loss_) {
+      stats_.packets_dropped++;
+      return;
+    }
+    if (delay_.count() > 0) {
+      delayed_.push_back({now + delay_, to, std::move(data)});
+      return;
+    }
+    socket_.send(to, std::move(data));
+  }
+
+  size_t receive_space(const connection &conn) const {
+    size_t buffered = conn.to_bridge.size() + conn.reorder_bytes;
+    return buffered >= receive_window ? 0 : receive_window - buffered;
+  }
+
+  // the packets we hold past a hole, as a bitmask from ack_nr + 2
+  std::string selective_acks(const connection &conn) const {
+    if (conn.reorder.empty())
+      return "";
+    size_t last = 0;
+    for (const auto &entry : conn.reorder)
+      last = std::max<size_t>(last,
+                              static_cast<uint16_t>(entry.first - conn.ack_nr - 2));
+    std::string mask(std::min((last / 32 + 1) * 4, max_sack_bytes), '\0');
+    for (const auto &entry : conn.reorder) {
+      size_t bit = static_cast<uint16_t>(entry.first - conn.ack_nr - 2);
+      if (bit < mask.size() * 8)
+        mask[bit / 8] = static_cast<char>(mask[bit / 8] | 1 << (bit % 8));
+    }
+    return mask;
+  }
+
+  // fill in the fields every packet carries and send it
+  void send_packet(connection &conn, utp_packet &packet,
+                   clock::time_point now) {
+    packet.connection_id =
+        packet.type == utp_syn ? conn.recv_id : conn.send_id;
+    packet.timestamp = utp_timestamp(now);
+    packet.timestamp_diff = conn.reply_micro;
+    size_t space = receive_space(conn);
+    packet.wnd_size = static_cast<uint32_t>(space);
+    conn.window_closed = space < receive_window / 2;
+    packet.ack_nr = conn.ack_nr;
+    // holes are only reported by state packets
+    if (packet.type == utp_state)
+      packet.sack = selective_acks(conn);
+    if (packet.type == utp_state || conn.reorder.empty())
+      conn.ack_due = false;
+    send_datagram(conn.addr, encode_utp_packet(packet), now);
+  }
+
+  void send_state(connection &conn, clock::time_point now) {
+    utp_packet packet;
+    packet.type = utp_state;
+    packet.seq_nr = conn.seq_nr;
+    send_packet(conn, packet, now);
+  }
+
+  void transmit(connection &conn, sent_packet &sent, clock::time_point now) {
+    utp_packet packet;
+    packet.type = sent.type;
+    packet.seq_nr = sent.seq;
+    packet.payload = sent.payload;
+    send_packet(conn, packet, now);
+    if (sent.need_resend) {
+      sent.need_resend = false;
+      conn.resend_count--;
+    }
+    sent.transmissions++;
+    sent.sent_at = now;
+    conn.in_flight += sent.payload.size();
+    if (conn.rto_deadline == clock::time_point::max())
+      conn.rto_deadline =
+          now + std::chrono::microseconds(static_cast<int64_t>(conn.rto_us));
+  }
+
+  // the peer gets neither more data nor acks from us
+  void close_connection(connection &conn, bool reset) {
+    if (reset && conn.connected) {
+      utp_packet packet;
+      packet.type = utp_reset;
+      packet.seq_nr = conn.seq_nr;
+      send_packet(conn, packet, clock::now());
+    }
+    conn.closed = true;
+  }
+
+  void reap() {
+    for (auto it = connections_.begin(); it != connections_.end();) {
+      connection &conn = *it->second;
+      if (!conn.closed) {
+        ++it;
+        continue;
+      }
+      if (conn.registered)
+        loop_.remove(conn.bridge);
+      close(conn.bridge);
+      it = connections_.erase(it);
+    }
+  }
+
+  // send what the window and pacing allow: resends first, then new data
+  // read from the session
+  void pump(connection &conn, clock::time_point now) {
+    conn.paced = false;
+    conn.want_read = false;
+    if (!conn.connected || conn.closed)
+      return;
+    double window = std::min<double>(conn.cwnd, conn.peer_window);
+    while (true) {
+      auto resend = conn.unacked.end();
+      if (conn.resend_count > 0)
+        resend = std::find_if(
+            conn.unacked.begin(), conn.unacked.end(),
+            [](const sent_packet &p) { return p.need_resend; });
+      bool fresh = resend == conn.unacked.end();
+      if (fresh && conn.fin_sent)
+        break;
+      size_t size = fresh ? max_payload : resend->payload.size();
+      // one packet may always be in flight, which also probes a closed
+      // receive window
+      if (conn.in_flight > 0 && conn.in_flight + size > window)
+        break;
+      if (now + pacing_quantum < conn.next_send) {
+        conn.paced = true;
+        break;
+      }
+      sent_packet *sent;
+      if (fresh) {
+        sent_packet packet;
+        if (conn.bridge_eof) {
+          packet.type = utp_fin;
+        } else {
+          char buffer[max_payload];
+          ssize_t bytes = recv(conn.bridge, buffer, sizeof(buffer), 0);
+          if (bytes == 0 ||
+              (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK)) {
+            conn.bridge_eof = true;
+            continue;
+          }
+          if (bytes < 0) {
+            conn.want_read = true;
+            break;
+          }
+          packet.payload.assign(buffer, bytes);
+        }
+        packet.seq = conn.seq_nr++;
+        conn.fin_sent = packet.type == utp_fin;
+        conn.unacked.push_back(std::move(packet));
+        sent = &conn.unacked.back();
+      } else {
+        stats_.packets_resent++;
+        sent = &*resend;
+      }
+      transmit(conn, *sent, now);
+      // spread a window of packets over one round trip
+      if (conn.srtt_us > 0) {
+        double gap_us = conn.srtt_us *
+                        (sent->payload.size() + utp_header_size) / conn.cwnd;
+        conn.next_send = std::max(conn.next_send, now) +
+                         std::chrono::microseconds(static_cast<int64_t>(gap_us));
+      }
+    }
+  }
+
+  void update_rtt(connection &conn, double sample_us) {
+    if (conn.srtt_us == 0) {
+      conn.srtt_us = sample_us;
+      conn.rttvar_us = sample_us / 2;
+    } else {
+      conn.rttvar_us += (std::abs(conn.srtt_us - sample_us) - conn.rttvar_us) / 4;
+      conn.srtt_us += (sample_us - conn.srtt_us) / 8;
+    }
+    conn.rto_us = std::clamp(conn.srtt_us + 4 * conn.rttvar_us, min_rto_us,
+                             max_rto_us);
+  }
+
+  // halve the window at most once per round trip
+  void on_loss(connection &conn, clock::time_point now) {
+    if (now - conn.last_cut <
+        std::chrono::microseconds(static_cast<int64_t>(conn.srtt_us)))
+      return;
+    conn.cwnd = std::max(conn.cwnd / 2, min_window);
+    conn.ssthresh = conn.cwnd;
+    conn.slow_start = false;
+    conn.last_cut = now;
+  }
+
+  // LEDBAT: the lowest one-way delay of the last minute or two is the base,
+  // anything above it is queueing. The window grows while queueing stays
+  // under the target and shrinks in proportion once it goes over
+  void on_delay_sample(connection &conn, uint32_t sample, size_t acked_bytes,
+                       clock::time_point now) {
+    auto before = [](uint32_t a, uint32_t b) {
+      return static_cast<int32_t>(a - b) < 0;
+    };
+    if (!conn.has_base_delay || now >= conn.base_delay_rollover) {
+      conn.previous_base_delay = conn.has_base_delay ? conn.base_delay : sample;
+      conn.base_delay = sample;
+      conn.has_base_delay = true;
+      conn.base_delay_rollover =
+          now + std::chrono::seconds(base_delay_bucket_sec);
+    } else if (before(sample, conn.base_delay)) {
+      conn.base_delay = sample;
+    }
+    uint32_t base = before(conn.previous_base_delay, conn.base_delay)
+                        ? conn.previous_base_delay
+                        : conn.base_delay;
+    double queueing = std::max(0, static_cast<int32_t>(sample - base));
+    double off_target = (target_delay_us - queueing) / target_delay_us;
+
+    // double the window each round trip until queueing or loss shows up
+    if (conn.slow_start && queueing > target_delay_us / 2)
+      conn.slow_start = false;
+    if (conn.slow_start) {
+      conn.cwnd += acked_bytes;
+      if (conn.cwnd >= conn.ssthresh)
+        conn.slow_start = false;
+    } else {
+      double acked = static_cast<double>(acked_bytes);
+      double window_factor =
+          std::min(acked, conn.cwnd) / std::max(conn.cwnd, acked);
+      conn.cwnd += max_cwnd_gain * off_target * window_factor;
+    }
+    conn.cwnd = std::clamp(conn.cwnd, min_window, max_window);
+  }
+
+  void on_ack(connection &conn, const utp_packet &packet,
+              clock::time_point now) {
+    conn.peer_window = packet.wnd_size;
+    // ignore acks for packets we never sent
+    if (conn.unacked.empty() ||
+        seq_before(static_cast<uint16_t>(conn.seq_nr - 1), packet.ack_nr)) {
+      return;
+    }
+    size_t acked_bytes = 0;
+    double rtt_sample = -1;
+    auto take = [&](sent_packet &sent) {
+      if (!sent.need_resend)
+        conn.in_flight -= sent.payload.size();
+      else
+        conn.resend_count--;
+      acked_bytes += sent.payload.size();
+      // retransmitted packets say nothing about the round trip
+      if (sent.transmissions == 1)
+        rtt_sample = std::chrono::duration<double, std::micro>(
+                         now - sent.sent_at)
+                         .count();
+    };
+    while (!conn.unacked.empty() &&
+           !seq_before(packet.ack_nr, conn.unacked.front().seq)) {
+      sent_packet &sent = conn.unacked.front();
+      if (!sent.acked)
+        take(sent);
+      conn.unacked.pop_front();
+    }
+
+    bool lost = false;
+    if (!packet.sack.empty() && !conn.unacked.empty()) {
+      for (size_t bit = 0; bit < packet.sack.size() * 8; ++bit) {
+        if (!(static_cast<uint8_t>(packet.sack[bit / 8]) & 1 << (bit % 8)))
+          continue;
+        uint16_t seq = static_cast<uint16_t>(packet.ack_nr + 2 + bit);
+        size_t index = static_cast<uint16_t>(seq - conn.unacked.front().seq);
+        if (index >= conn.unacked.size() || conn.unacked[index].acked)
+          continue;
+        take(conn.unacked[index]);
+        conn.unacked[index].acked = true;
+      }
+      // packets with enough acked ones after them were lost; each is
+      // resent this way once, later losses wait for the timeout
+      int acked_after = 0;
+      for (auto it = conn.unacked.rbegin(); it != conn.unacked.rend(); ++it) {
+        if (it->acked) {
+          acked_after++;
+        } else if (acked_after >= loss_threshold && !it->need_resend &&
+                   it->transmissions == 1) {
+          it->need_resend = true;
+          conn.resend_count++;
+          conn.in_flight -= it->payload.size();
+          lost = true;
+        }
+      }
+    }
+    // without selective acks, repeated acks for the same packet point at
+    // the one after it
+    if (acked_bytes == 0 && packet.type == utp_state &&
+        packet.ack_nr == conn.last_ack && !conn.unacked.empty()) {
+      sent_packet &next = conn.unacked.front();
+      if (++conn.duplicate_acks == loss_threshold && !next.acked &&
+          !next.need_resend && next.transmissions == 1) {
+        next.need_resend = true;
+        conn.resend_count++;
+        conn.in_flight -= next.payload.size();
+        lost = true;
+      }
+    } else if (acked_bytes > 0) {
+      conn.duplicate_acks = 0;
+    }
+    conn.last_ack = packet.ack_nr;
+
+    if (rtt_sample >= 0)
+      update_rtt(conn, rtt_sample);
+    if (lost)
+      on_loss(conn, now);
+    if (acked_bytes > 0 && packet.timestamp_diff != 0)
+      on_delay_sample(conn, packet.timestamp_diff, acked_bytes, now);
+    if (acked_bytes > 0 || rtt_sample >= 0) {
+      conn.timeouts = 0;
+      conn.rto_deadline =
+          conn.unacked.empty()
+              ? clock::time_point::max()
+              : now + std::chrono::microseconds(
+                          static_cast<int64_t>(conn.rto_us));
+    }
+  }
+
+  void on_data(connection &conn, const utp_packet &packet) {
+    conn.ack_due = true;
+    uint16_t seq = packet.seq_nr;
+    if (!seq_before(conn.ack_nr, seq))
+      return; // a duplicate; the ack covers it again
+    if (conn.fin_received && seq_before(conn.eof_seq, seq))
+      return;
+    uint16_t ahead = static_cast<uint16_t>(seq - conn.ack_nr);
+    if (ahead > max_reorder)
+      return;
+    if (packet.type == utp_fin) {
+      conn.fin_received = true;
+      conn.eof_seq = seq;
+    }
+    if (ahead > 1) {
+      if (conn.reorder.emplace(seq, packet.payload).second)
+        conn.reorder_bytes += packet.payload.size();
+      return;
+    }
+    deliver(conn, packet.payload);
+    conn.ack_nr = seq;
+    while (true) {
+      auto next = conn.reorder.find(static_cast<uint16_t>(conn.ack_nr + 1));
+      if (next == conn.reorder.end())
+        break;
+      conn.reorder_bytes -= next->second.size();
+      deliver(conn, next->second);
+      conn.ack_nr = next->first;
+      conn.reorder.erase(next);
+    }
+    flush_bridge(conn);
+  }
+
+  void deliver(connection &conn, const std::string &payload) {
+    if (!conn.session_gone)
+      conn.to_bridge += payload;
+  }
+
+  // hand received data to the session, and EOF once the peer is done
+  void flush_bridge(connection &conn) {
+    while (!conn.to_bridge.empty()) {
+      ssize_t bytes = send(conn.bridge, conn.to_bridge.data(),
+                           conn.to_bridge.size(), MSG_NOSIGNAL);
+      if (bytes < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK) {
+          conn.to_bridge.clear();
+          conn.session_gone = true;
+        }
+        break;
+      }
+      conn.to_bridge.erase(0, bytes);
+    }
+    // tell the peer when there is room again
+    if (conn.window_closed && receive_space(conn) >= receive_window / 2)
+      conn.ack_due = true;
+    if (conn.to_bridge.empty() && peer_done(conn) && !conn.shut) {
+      shutdown(conn.bridge, SHUT_WR);
+      conn.shut = true;
+    }
+  }
+
+  static bool peer_done(const connection &conn) {
+    return conn.fin_received && conn.ack_nr == conn.eof_seq;
+  }
+
+  void on_bridge(connection &conn, uint32_t events) {
+    auto now = clock::now();
+    if (events & (EPOLLHUP | EPOLLERR)) {
+      // the session closed its end; what it wrote can still be read
+      conn.to_bridge.clear();
+      conn.session_gone = true;
+      loop_.remove(conn.bridge);
+      conn.registered = false;
+    } else if (events & EPOLLOUT) {
+      flush_bridge(conn);
+    }
+    pump(conn, now);
+    finish_round(now);
+  }
+
+  void on_syn(const sockaddr_in &from, const utp_packet &packet,
+              clock::time_point now) {
+    uint16_t recv_id = packet.connection_id + 1;
+    std::string key = connection_key(from, recv_id);
+    auto known = connections_.find(key);
+    if (known != connections_.end()) {
+      // our answer got lost
+      known->second->ack_due = true;
+      return;
+    }
+    if (!on_accept_ || connections_.size() >= max_connections)
+      return;
+    auto conn = std::make_unique<connection>();
+    sockaddr_storage storage = {};
+    std::memcpy(&storage, &from, sizeof(from));
+    conn->peer = endpoint_from_sockaddr(storage);
+    conn->addr = from;
+    conn->recv_id = recv_id;
+    conn->send_id = packet.connection_id;
+    conn->connected = true;
+    conn->ack_nr = packet.seq_nr;
+    conn->seq_nr = static_cast<uint16_t>(rng_());
+    conn->last_ack = conn->seq_nr - 1;
+    conn->peer_window = packet.wnd_size;
+    conn->reply_micro = utp_timestamp(now) - packet.timestamp;
+    conn->ack_due = true;
+    int session = open_bridge(*conn);
+    connection &accepted = *conn;
+    connections_[key] = std::move(conn);
+    on_accept_(session, accepted.peer);
+    pump(accepted, now);
+  }
+
+  void on_packet(const sockaddr_in &from, const utp_packet &packet,
+                 clock::time_point now) {
+    if (packet.type == utp_syn) {
+      on_syn(from, packet, now);
+      return;
+    }
+    auto it = connections_.find(connection_key(from, packet.connection_id));
+    if (it == connections_.end() || it->second->closed)
+      return;
+    connection &conn = *it->second;
+    conn.reply_micro = utp_timestamp(now) - packet.timestamp;
+    if (packet.type == utp_reset) {
+      close_connection(conn, false);
+      return;
+    }
+    if (!conn.connected) {
+      if (packet.type != utp_state)
+        return;
+      // a state packet carries the number of the next packet it will send
+      conn.connected = true;
+      conn.ack_nr = packet.seq_nr - 1;
+    }
+    on_ack(conn, packet, now);
+    if (packet.type == utp_data || packet.type == utp_fin)
+      on_data(conn, packet);
+    pump(conn, now);
+  }
+
+  void on_datagram(const char *data, size_t size, const sockaddr_in &from) {
+    utp_packet packet;
+    if (parse_utp_packet(data, size, packet))
+      on_packet(from, packet, clock::now());
+  }
+
+  void on_timeout(connection &conn, clock::time_point now) {
+    sent_packet &oldest = conn.unacked.front();
+    if (!conn.connected) {
+      if (oldest.transmissions >= max_syn_sends) {
+        close_connection(conn, false);
+        return;
+      }
+      conn.rto_us *= 2;
+      conn.rto_deadline = clock::time_point::max();
+      transmit(conn, oldest, now);
+      return;
+    }
+    if (++conn.timeouts > max_timeouts) {
+      close_connection(conn, true);
+      return;
+    }
+    stats_.timeouts++;
+    // start over from the smallest window and resend everything unacked
+    conn.rto_us = std::min(conn.rto_us * 2, max_rto_us);
+    conn.ssthresh = std::max(conn.cwnd / 2, min_window);
+    conn.cwnd = min_window;
+    conn.slow_start = true;
+    for (auto &sent : conn.unacked) {
+      if (!sent.acked && !sent.need_resend) {
+        sent.need_resend = true;
+        conn.resend_count++;
+        conn.in_flight -= sent.payload.size();
+      }
+    }
+    conn.rto_deadline =
+        now + std::chrono::microseconds(static_cast<int64_t>(conn.rto_us));
+    pump(conn, now);
+  }
+
+  void on_timer() {
+    uint64_t expirations;
+    if (read(timer_fd_, &expirations, sizeof(expirations)) < 0 &&
+        errno != EAGAIN)
+      return;
+    armed_at_ = clock::time_point::max();
+    auto now = clock::now();
+    while (!delayed_.empty() && delayed_.front().due <= now) {
+      socket_.send(delayed_.front().to, std::move(delayed_.front().data));
+      delayed_.pop_front();
+    }
+    for (auto &entry : connections_) {
+      connection &conn = *entry.second;
+      if (conn.closed)
+        continue;
+      if (now >= conn.linger_deadline)
+        close_connection(conn, false);
+      else if (!conn.unacked.empty() && now >= conn.rto_deadline)
+        on_timeout(conn, now);
+      else if (conn.paced && now + pacing_quantum >= conn.next_send)
+        pump(conn, now);
+    }
+    finish_round(now);
+  }
+
+  // after each batch of work: send owed acks, wind down finished
+  // connections and adjust what we wait for
+  void finish_round(clock::time_point now) {
+    for (auto &entry : connections_) {
+      connection &conn = *entry.second;
+      if (conn.closed)
+        continue;
+      if (conn.ack_due)
+        send_state(conn, now);
+      if (conn.session_gone && !conn.connected) {
+        close_connection(conn, false);
+        continue;
+      }
+      // our FIN is acked: wait a little for theirs so we can ack it
+      if (conn.fin_sent && conn.unacked.empty()) {
+        conn.linger_deadline = std::min(
+            conn.linger_deadline,
+            peer_done(conn) ? now : now + std::chrono::seconds(linger_sec));
+        if (now >= conn.linger_deadline) {
+          close_connection(conn, false);
+          continue;
+        }
+      }
+      if (conn.registered) {
+        uint32_t events =
+            (conn.want_read ? static_cast<uint32_t>(EPOLLIN) : 0) |
+            (conn.to_bridge.empty() ? 0 : static_cast<uint32_t>(EPOLLOUT));
+        if (events != conn.events) {
+          loop_.modify(conn.bridge, events);
+          conn.events = events;
+        }
+      }
+    }
+    reap();
+    arm_timer(now);
+  }
+
+  // wake up for the earliest retransmission, paced send, linger end or
+  // delayed datagram
+  void arm_timer(clock::time_point now) {
+    clock::time_point due = clock::time_point::max();
+    for (const auto &entry : connections_) {
+      const connection &conn = *entry.second;
+      if (!conn.unacked.empty())
+        due = std::min(due, conn.rto_deadline);
+      if (conn.paced)
+        due = std::min(due, conn.next_send - pacing_quantum);
+      due = std::min(due, conn.linger_deadline);
+    }
+    if (!delayed_.empty())
+      due = std::min(due, delayed_.front().due);
+    if (due == armed_at_)
+      return;
+    armed_at_ = due;
+    itimerspec spec = {};
+    if (due != clock::time_point::max()) {
+      auto wait = std::max<int64_t>(
+          std::chrono::duration_cast<std::chrono::nanoseconds>(due - now)
+              .count(),
+          1000);
+      spec.it_value.tv_sec = wait / 1000000000;
+      spec.it_value.tv_nsec = wait % 1000000000;
+    }
+    timerfd_settime(timer_fd_, 0, &spec, nullptr);
+  }
+
+  event_loop &loop_;
+  udp_socket &socket_;
+  int timer_fd_ = -1;
+  std::mt19937 rng_;
+  accept_handler on_accept_;
+  std::unordered_map<std::string, std::unique_ptr<connection>> connections_;
+  clock::time_point armed_at_ = clock::time_point::max();
+  double loss_ = 0;
+  std::chrono::milliseconds delay_{0};
+  std::deque<delayed_datagram> delayed_;
+  utp_stats stats_;
+};
+
+// Connection Manager
+
+// races non-blocking connects to many peers at once and hands every peer
+// that completes the handshake to the swarm
+class connection_manager {
+public:
+  using connected_handler = std::function<void(
+      int fd, const peer_handshake &peer, const std::string &leftover)>;
+
+  connection_manager(event_loop &loop, const std::string &info_hash,
+                     peer_cache *cache, connected_handler on_connected,
+                     size_t half_open_limit = 8)
+      : loop_(loop), info_hash_(info_hash), cache_(cache),
+        on_connected_(std::move(on_connected)),
+        half_open_limit_(half_open_limit),
+        handshake_(build_handshake(info_hash, random_peer_id())) {}
+
+  ~connection_manager() {
+    for (auto &entry : attempts_) {
+      loop_.cancel(entry.second.timer);
+      loop_.cancel(entry.second.fallback_timer);
+      loop_.remove(entry.first);
+      close(entry.first);
+    }
+  }
+  connection_manager(const connection_manager &) = delete;
+  connection_manager &operator=(const connection_manager &) = delete;
+
+  // how many connections we open ourselves; incoming peers may go beyond
+  // this up to max_connections
+  void set_connection_limit(size_t limit) { connection_limit_ = limit; }
+
+  // the handshake we send, also used to answer incoming peers
+  const std::string &handshake() const { return handshake_; }
+
+  // try IPv4 peers over uTP first, falling back to TCP for those that do
+  // not answer
+  void set_utp(utp_socket_manager *utp) { utp_ = utp; }
+
+  // take an incoming peer that already completed the handshake
+  bool accept_inbound(int fd, const peer_handshake &peer,
+                      const std::string &leftover) {
+    if (connected_ + attempts_.size() >= max_connections || is_self(peer) ||
+        banned_.count(peer.endpoint.ip))
+      return false;
+    connected_++;
+    on_connected_(fd, peer, leftover);
+    return true;
+  }
+
+  // queue peers we have not seen before; known ones listed again are no
+  // longer treated as dropped. Peers only PEX named can be dropped by PEX
+  // again. Once the set is full, new peers take the place of ones given
+  // up on, or are ignored
+  void add_candidates(const std::vector<peer_endpoint> &peers,
+                      bool from_pex = false) {
+    for (const auto &peer : peers) {
+      if (banned_.count(peer.ip))
+        continue;
+      auto known = candidate_index_.find(format_endpoint(peer));
+      if (known != candidate_index_.end()) {
+        candidate &entry = candidates_[known->second];
+        if (from_pex && !entry.from_pex)
+          continue;
+        entry.dropped = false;
+        entry.from_pex = from_pex;
+        continue;
+      }
+      candidate entry;
+      entry.endpoint = peer;
+      entry.from_pex = from_pex;
+      if (candidates_.size() < max_candidates) {
+        candidate_index_[format_endpoint(peer)] = candidates_.size();
+        candidates_.push_back(entry);
+        continue;
+      }
+      auto spent = std::find_if(candidates_.begin(), candidates_.end(),
+                                [](const candidate &c) {
+                                  return !c.active && (c.dropped ||
+                                                       c.failures >= max_failures);
+                                });
+      if (spent == candidates_.end())
+        continue;
+      candidate_index_.erase(format_endpoint(spent->endpoint));
+      candidate_index_[format_endpoint(peer)] = spent - candidates_.begin();
+      *spent = entry;
+    }
+  }
+
+  // skip peers another peer saw leave the swarm, unless we are connected
+  // or heard of them elsewhere
+  void drop_candidates(const std::vector<peer_endpoint> &peers) {
+    for (const auto &peer : peers) {
+      auto known = candidate_index_.find(format_endpoint(peer));
+      if (known == candidate_index_.end())
+        continue;
+      candidate &entry = candidates_[known->second];
+      if (entry.from_pex && !entry.active)
+        entry.dropped = true;
+    }
+  }
+
+  // a connected peer went away; failed peers are backed off and ones the
+  // swarm closed on purpose rest so untried peers get their slots first
+  void release(const peer_endpoint &peer, bool failed) {
+    connected_--;
+    auto known = candidate_index_.find(format_endpoint(peer));
+    if (known == candidate_index_.end())
+      return;
+    candidate &entry = candidates_[known->second];
+    entry.active = false;
+    if (failed) {
+      back_off(entry);
+    } else {
+      entry.failures = 0;
+      entry.retry_at = std::chrono::steady_clock::now() +
+                       std::chrono::seconds(rest_sec);
+    }
+  }
+
+  // never connect to or accept the address again, on any port
+  void ban(const peer_endpoint &peer) {
+    banned_.insert(peer.ip);
+    for (auto &entry : candidates_) {
+      if (entry.endpoint.ip == peer.ip)
+        entry.dropped = true;
+    }
+  }
+
+  // every slot is taken while a peer we never tried waits for one
+  bool wants_slot() const {
+    if (attempts_.size() + connected_ < connection_limit_)
+      return false;
+    return std::any_of(candidates_.begin(), candidates_.end(),
+                       [](const candidate &c) {
+                         return !c.tried && !c.active && !c.dropped;
+                       });
+  }
+
+  // nothing left to try: no candidates waiting or connecting
+  bool exhausted() const {
+    if (!attempts_.empty())
+      return false;
+    return std::none_of(candidates_.begin(), candidates_.end(),
+                        [](const candidate &c) {
+                          return !c.active && !c.dropped &&
+                                 c.failures < max_failures;
+                        });
+  }
+
+  // peers connected or being connected to
+  size_t connections() const { return connected_ + attempts_.size(); }
+
+  // start connects up to the limits
+  void tick() { launch_attempts(); }
+
+private:
+  static constexpr int max_failures = 4;
+  static constexpr size_t max_connections = 50;
+  static constexpr int connect_timeout_sec = 5;
+  static constexpr int handshake_timeout_sec = 10;
+  // when the first uTP SYN times out, TCP races the retry
+  static constexpr int tcp_fallback_ms = 1000;
+  static constexpr int base_backoff_sec = 5;
+  static constexpr int max_backoff_sec = 120;
+  static constexpr int rest_sec = 300;
+  static constexpr size_t max_candidates = 2000;
+
+  struct candidate {
+    peer_endpoint endpoint;
+    int failures = 0;
+    bool active = false;
+    bool dropped = false; // left the swarm according to PEX, or banned
+    bool from_pex = false; // only PEX named it
+    bool tcp_only = false;  // did not answer over uTP
+    bool tried = false;
+    std::chrono::steady_clock::time_point retry_at;
+  };
+
+  enum class attempt_stage { connecting, handshake };
+
+  struct attempt {
+    size_t candidate = 0;
+    attempt_stage stage = attempt_stage::connecting;
+    bool utp = false;
+    std::string in;
+    event_loop::timer_id timer = 0;
+    event_loop::timer_id fallback_timer = 0;
+    int rival = -1; // the other transport's attempt at the same peer
+  };
+
+  // PEX can hand us our own address; the peer id gives it away
+  bool is_self(const peer_handshake &peer) const {
+    return handshake_.compare(48, 20, peer.peer_id) == 0;
+  }
+
+  void back_off(candidate &entry) {
+    entry.failures++;
+    int delay = std::min(base_backoff_sec << (entry.failures - 1),
+                         max_backoff_sec);
+    entry.retry_at =
+        std::chrono::steady_clock::now() + std::chrono::seconds(delay);
+  }
+
+  void launch_attempts() {
+    auto now = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < candidates_.size(); ++i) {
+      if (attempts_.size() >= half_open_limit_ ||
+          attempts_.size() + connected_ >= connection_limit_)
+        return;
+      candidate &entry = candidates_[i];
+      if (entry.active || entry.dropped || entry.failures >= max_failures ||
+          now < entry.retry_at)
+        continue;
+      start_connect(i);
+    }
+  }
+
+  // returns the attempt's socket, or -1 if it could not start. A racing
+  // attempt joins one already under way, so its failure to start is left
+  // to the other
+  int start_connect(size_t index, bool racing = false) {
+    candidate &entry = candidates_[index];
+    entry.active = true;
+    entry.tried = true;
+    int fd = -1;
+    bool utp = false;
+    try {
+      if (utp_ && !entry.tcp_only && entry.endpoint.family == AF_INET) {
+        // the bridge is writable at once; the handshake waits in it until
+        // the peer answers
+        fd = utp_->connect(entry.endpoint);
+        utp = true;
+      } else {
+        sockaddr_storage addr;
+        socklen_t addr_len = make_sockaddr(entry.endpoint, addr);
+        fd = socket(entry.endpoint.family, SOCK_STREAM | SOCK_NONBLOCK, 0);
+        if (fd < 0)
+          throw std::runtime_error("Failed to create socket");
+        if (connect(fd, reinterpret_cast<sockaddr *>(&addr), addr_len) < 0 &&
+            errno != EINPROGRESS)
+          throw std::runtime_error("Failed to connect to peer");
+      }
+    } catch (const std::exception &e) {
+      if (fd >= 0)
+        close(fd);
+      if (racing)
+        return -1;
+      entry.active = false;
+      back_off(entry);
+      std::cerr << "Failed with peer " << format_endpoint(entry.endpoint)
+                << " - " << e.what() << std::endl;
+      return -1;
+    }
+    attempt &att = attempts_[fd];
+    att.candidate = index;
+    att.utp = utp;
+    att.timer = loop_.schedule(std::chrono::seconds(connect_timeout_sec),
+                               [this, fd] {
+                                 fail_attempt(fd, "Connection timeout");
+                               });
+    if (utp)
+      att.fallback_timer = loop_.schedule(
+          std::chrono::milliseconds(tcp_fallback_ms), [this, fd] {
+            attempts_.at(fd).fallback_timer = 0;
+            race_tcp(fd);
+          });
+    loop_.add(fd, EPOLLOUT, [this, fd](uint32_t events) {
+      try {
+        on_event(fd, events);
+      } catch (const std::exception &e) {
+        fail_attempt(fd, e.what());
+      }
+    });
+    return fd;
+  }
+
+  // the peer has not answered over uTP yet, so try TCP alongside it; the
+  // first to finish the handshake wins
+  void race_tcp(int utp_fd) {
+    attempt &att = attempts_.at(utp_fd);
+    if (!att.in.empty())
+      return;
+    candidates_[att.candidate].tcp_only = true;
+    int tcp_fd = start_connect(att.candidate, true);
+    if (tcp_fd < 0)
+      return;
+    attempts_.at(utp_fd).rival = tcp_fd;
+    attempts_.at(tcp_fd).rival = utp_fd;
+  }
+
+  void discard_attempt(int fd) {
+    auto it = attempts_.find(fd);
+    if (it == attempts_.end())
+      return;
+    loop_.cancel(it->second.timer);
+    loop_.cancel(it->second.fallback_timer);
+    loop_.remove(fd);
+    close(fd);
+    attempts_.erase(it);
+  }
+
+  void fail_attempt(int fd, const std::string &reason) {
+    auto it = attempts_.find(fd);
+    if (it == attempts_.end())
+      return;
+    size_t index = it->second.candidate;
+    candidate &entry = candidates_[index];
+    bool retry_tcp = false;
+    if (it->second.rival >= 0) {
+      // the other transport is still trying
+      attempts_.at(it->second.rival).rival = -1;
+    } else if (it->second.utp && !entry.tcp_only) {
+      // most peers still only speak TCP; try that at once without backing
+      // off
+      entry.active = false;
+      entry.tcp_only = true;
+      retry_tcp = !entry.dropped;
+    } else {
+      entry.active = false;
+      std::cerr << "Failed with peer " << format_endpoint(entry.endpoint)
+                << " - " << reason << std::endl;
+      back_off(entry);
+      if (cache_)
+        cache_->record_failure(entry.endpoint);
+    }
+    discard_attempt(fd);
+    if (retry_tcp)
+      start_connect(index);
+  }
+
+  void on_event(int fd, uint32_t events) {
+    attempt &att = attempts_.at(fd);
+    if (att.stage == attempt_stage::connecting) {
+      int error = 0;
+      socklen_t len = sizeof(error);
+      if (getsockopt(fd, SOL_SOCKET, SO_ERROR, &error, &len) < 0 || error != 0)
+        throw std::runtime_error("Connection failed");
+      if (send(fd, handshake_.data(), handshake_.size(), MSG_NOSIGNAL) !=
+          static_cast<ssize_t>(handshake_.size()))
+        throw std::runtime_error("Failed to send handshake");
+      att.stage = attempt_stage::handshake;
+      loop_.cancel(att.timer);
+      att.timer = loop_.schedule(std::chrono::seconds(handshake_timeout_sec),
+                                 [this, fd] {
+                                   fail_attempt(fd, "Handshake timeout");
+                                 });
+      loop_.modify(fd, EPOLLIN);
+      return;
+    }
+    if (events & (EPOLLERR | EPOLLHUP) && !(events & EPOLLIN))
+      throw std::runtime_error("Connection closed by peer");
+
+    char buffer[4096];
+    ssize_t bytes = recv(fd, buffer, sizeof(buffer), 0);
+    if (bytes == 0)
+      throw std::runtime_error("Connection closed by peer");
+    if (bytes < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+      throw std::runtime_error("Failed to receive from peer");
+    }
+    att.in.append(buffer, bytes);
+    if (att.in.size() < 68)
+      return;
+    if (att.in[0] != 19 || att.in.compare(1, 19, "BitTorrent protocol") != 0)
+      throw std::runtime_error("Invalid handshake response");
+    if (att.in.compare(28, 20, info_hash_) != 0)
+      throw std::runtime_error("Peer answered with another info hash");
+
+    peer_handshake peer =
+        parse_handshake(att.in, candidates_[att.candidate].endpoint, false);
+    if (is_self(peer))
+      throw std::runtime_error("Connected to ourselves");
+    if (cache_)
+      cache_->record_handshake(peer.endpoint);
+    std::string leftover = att.in.substr(68);
+    if (att.rival >= 0)
+      discard_attempt(att.rival);
+    loop_.cancel(att.timer);
+    loop_.cancel(att.fallback_timer);
+    loop_.remove(fd);
+    attempts_.erase(fd);
+    connected_++;
+    on_connected_(fd, peer, leftover);
+  }
+
+  event_loop &loop_;
+  std::string info_hash_;
+  peer_cache *cache_;
+  connected_handler on_connected_;
+  size_t half_open_limit_;
+  size_t connection_limit_ = 3;
+  std::string handshake_;
+  utp_socket_manager *utp_ = nullptr;
+  std::vector<candidate> candidates_;
+  // where each peer is in candidates_, by its formatted endpoint
+  std::unordered_map<std::string, size_t> candidate_index_;
+  std::unordered_map<int, attempt> attempts_;
+  std::set<std::string> banned_;
+  size_t connected_ = 0;
+};
+
+// route a swarm's closes, PEX news, replacement checks and bans to the
+// manager that finds its peers
+void wire_swarm(torrent_swarm &swarm, connection_manager &manager) {
+  swarm.set_close_handler(
+      [&manager](const peer_endpoint &endpoint, bool failed) {
+        manager.release(endpoint, failed);
+      });
+  swarm.set_pex_handler([&manager](const std::vector<peer_endpoint> &added,
+                                   const std::vector<peer_endpoint> &dropped) {
+    manager.add_candidates(added, true);
+    manager.drop_candidates(dropped);
+  });
+  swarm.set_replacement_check([&manager] { return manager.wants_slot(); });
+  swarm.set_ban_handler(
+      [&manager](const peer_endpoint &endpoint) { manager.ban(endpoint); });
+}
+
+// Incoming Connections
+
+// accepts peers that connect to us and routes each one, by the info hash in
+// its handshake, to the torrent it wants
+class peer_listener {
+public:
+  // returns false when the torrent does not want another connection
+  using accept_handler = std::function<bool(
+      int fd, const peer_handshake &peer, const std::string &leftover)>;
+
+  // listen on the first free port from preferred_port upwards
+  peer_listener(event_loop &loop, uint16_t preferred_port) : loop_(loop) {
+    for (uint16_t port = preferred_port; port < preferred_port + port_attempts;
+         ++port) {
+      fd_ = open_socket(port);
+      if (fd_ >= 0) {
+        port_ = port;
+        break;
+      }
+    }
+    if (fd_ < 0)
+      throw std::runtime_error("Failed to listen for incoming peers");
+    loop_.add(fd_, EPOLLIN, [this](uint32_t) { on_accept(); });
+  }
+
+  ~peer_listener() {
+    for (auto &entry : pending_) {
+      loop_.cancel(entry.second.timer);
+      loop_.remove(entry.first);
+      close(entry.first);
+    }
+    loop_.remove(fd_);
+    close(fd_);
+  }
+  peer_listener(const peer_listener &) = delete;
+  peer_listener &operator=(const peer_listener &) = delete;
+
+  uint16_t port() const { return port_; }
+
+  // route handshakes for info_hash to this torrent; we answer with handshake
+  void add_torrent(const std::string &info_hash, const std::string &handshake,
+                   accept_handler on_accept) {
+    torrents_[info_hash] = {handshake, std::move(on_accept)};
+  }
+
+  void remove_torrent(const std::string &info_hash) {
+    torrents_.erase(info_hash);
+  }
+
+  // wait for the handshake of a peer that is already connected, like an
+  // accepted socket or a uTP connection
+  void adopt(int fd, const peer_endpoint &endpoint) {
+    if (pending_.size() >= max_pending || torrents_.empty()) {
+      close(fd);
+      return;
+    }
+    pending_peer &peer = pending_[fd];
+    peer.endpoint = endpoint;
+    // drop peers that never finish their handshake
+    peer.timer = loop_.schedule(std::chrono::seconds(handshake_timeout_sec),
+                                [this, fd] { drop(fd); });
+    loop_.add(fd, EPOLLIN, [this, fd](uint32_t) {
+      try {
+        on_handshake(fd);
+      } catch (const std::exception &e) {
+        // the peer may already have been handed on when the error came
+        auto it = pending_.find(fd);
+        if (it == pending_.end())
+          return;
+        std::cerr << "Incoming peer " << format_endpoint(it->second.endpoint)
+                  << " - " << e.what() << std::endl;
+        drop(fd);
+      }
+    });
+  }
+
+private:
+  static constexpr uint16_t port_attempts = 9;
+  static constexpr size_t max_pending = 64;
+  static constexpr int handshake_timeout_sec = 10;
+
+  struct registration {
+    std::string handshake;
+    accept_handler on_accept;
+  };
+
+  struct pending_peer {
+    peer_endpoint endpoint;
+    std::string in;
+    event_loop::timer_id timer = 0;
+  };
+
+  // dual-stack when IPv6 is available so one socket takes both families
+  static int open_socket(uint16_t port) {
+    int fd = socket(AF_INET6, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd >= 0) {
+      int off = 0, on = 1;
+      setsockopt(fd, IPPROTO_IPV6, IPV6_V6ONLY, &off, sizeof(off));
+      setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+      sockaddr_in6 addr = {};
+      addr.sin6_family = AF_INET6;
+      addr.sin6_addr = in6addr_any;
+      addr.sin6_port = htons(port);
+      if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0 &&
+          listen(fd, SOMAXCONN) == 0)
+        return fd;
+      close(fd);
+      if (errno == EADDRINUSE)
+        return -1;
+    }
+    fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
+    if (fd < 0)
+      return -1;
+    int on = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+    sockaddr_in addr = {};
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_ANY);
+    addr.sin_port = htons(port);
+    if (bind(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) == 0 &&
+        listen(fd, SOMAXCONN) == 0)
+      return fd;
+    close(fd);
+    return -1;
+  }
+
+  void on_accept() {
+    while (true) {
+      sockaddr_storage addr;
+      socklen_t addr_len = sizeof(addr);
+      int fd = accept4(fd_, reinterpret_cast<sockaddr *>(&addr), &addr_len,
+                       SOCK_NONBLOCK);
+      if (fd < 0)
+        return;
+      adopt(fd, endpoint_from_sockaddr(addr));
+    }
+  }
+
+  // the connecting side sends its handshake first
+  void on_handshake(int fd) {
+    pending_peer &peer = pending_.at(fd);
+    char buffer[4096];
+    ssize_t bytes = recv(fd, buffer, sizeof(buffer), 0);
+    if (bytes == 0)
+      throw std::runtime_error("Connection closed by peer");
+    if (bytes < 0) {
+      if (errno == EAGAIN || errno == EWOULDBLOCK)
+        return;
+      throw std::runtime_error("Failed to receive from peer");
+    }
+    peer.in.append(buffer, bytes);
+    if (peer.in.size() < 68)
+      return;
+    if (peer.in[0] != 19 || peer.in.compare(1, 19, "BitTorrent protocol") != 0)
+      throw std::runtime_error("Invalid handshake");
+    auto torrent = torrents_.find(peer.in.substr(28, 20));
+    if (torrent == torrents_.end())
+      throw std::runtime_error("Handshake for a torrent we do not have");
+
+    const std::string &handshake = torrent->second.handshake;
+    if (send(fd, handshake.data(), handshake.size(), MSG_NOSIGNAL) !=
+        static_cast<ssize_t>(handshake.size()))
+      throw std::runtime_error("Failed to send handshake");
+
+    peer_handshake remote = parse_handshake(peer.in, peer.endpoint, true);
+    std::string leftover = peer.in.substr(68);
+    loop_.cancel(peer.timer);
+    loop_.remove(fd);
+    pending_.erase(fd);
+    if (!torrent->second.on_accept(fd, remote, leftover))
+      close(fd);
+  }
+
+  void drop(int fd) {
+    auto it = pending_.find(fd);
+    if (it == pending_.end())
+      return;
+    loop_.cancel(it->second.timer);
+    loop_.remove(fd);
+    close(fd);
+    pending_.erase(it);
+  }
+
+  event_loop &loop_;
+  int fd_ = -1;
+  uint16_t port_ = 0;
+  std::unordered_map<std::string, registration> torrents_;
+  std::unordered_map<int, pending_peer> pending_;
+};
+
+// DHT
+
+// a node we know the address of; the id is empty for bootstrap routers we
+// have not heard from yet
+struct dht_contact {
+  std::string id; // 20 raw bytes in the info hash space
+  peer_endpoint endpoint;
+};
+
+// true if a is nearer to target than b by XOR distance; unknown ids are
+// farther than any known one
+bool dht_closer(const std::string &target, const std::string &a,
+                const std::string &b) {
+  if (a.size() != SHA_DIGEST_LENGTH)
+    return false;
+  if (b.size() != SHA_DIGEST_LENGTH)
+    return true;
+  for (size_t i = 0; i < SHA_DIGEST_LENGTH; ++i) {
+    uint8_t da = static_cast<uint8_t>(a[i] ^ target[i]);
+    uint8_t db = static_cast<uint8_t>(b[i] ^ target[i]);
+    if (da != db)
+      return da < db;
+  }
+  return false;
+}
+
+// leading bits two ids have in common, 160 when they are equal
+int shared_prefix_bits(const std::string &a, const std::string &b) {
+  for (size_t i = 0; i < SHA_DIGEST_LENGTH; ++i) {
+    uint8_t x = static_cast<uint8_t>(a[i] ^ b[i]);
+    if (x != 0)
+      return static_cast<int>(i) * 8 + std::countl_zero(x);
+  }
+  return SHA_DIGEST_LENGTH * 8;
+}
+
+// compact node info: 20 byte id and 6 byte IPv4 address per node
+std::vector<dht_contact> parse_compact_nodes(const std::string &nodes) {
+  if (nodes.size() % 26 != 0)
+    throw std::runtime_error("Invalid nodes string length");
+  std::vector<dht_contact> result;
+  for (size_t i = 0; i < nodes.size(); i += 26) {
+    dht_contact contact;
+    contact.id = nodes.substr(i, 20);
+    contact.endpoint = parse_compact_peers(nodes.substr(i + 20, 6), AF_INET)[0];
+    result.push_back(contact);
+  }
+  return result;
+}
+
+std::string encode_compact_nodes(const std::vector<dht_contact> &contacts) {
+  std::string nodes;
+  for (const auto &contact : contacts) {
+    if (contact.endpoint.family == AF_INET)
+      nodes += contact.id + encode_compact_peer(contact.endpoint);
+  }
+  return nodes;
+}
+
+// resolve host:port strings to IPv4 endpoints, skipping ones that fail
+std::vector<peer_endpoint> resolve_hosts(const std::vector<std::string> &hosts) {
+  std::vector<peer_endpoint> result;
+  for (const auto &host_port : hosts) {
+    size_t colon = host_port.rfind(':');
+    if (colon == std::string::npos)
+      continue;
+    addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_DGRAM;
+    addrinfo *found = nullptr;
+    if (getaddrinfo(host_port.substr(0, colon).c_str(),
+                    host_port.substr(colon + 1).c_str(), &hints,
+                    &found) != 0)
+      continue;
+    for (addrinfo *entry = found; entry; entry = entry->ai_next) {
+      sockaddr_storage addr = {};
+      std::memcpy(&addr, entry->ai_addr, entry->ai_addrlen);
+      peer_endpoint peer = endpoint_from_sockaddr(addr);
+      if (std::find(result.begin(), result.end(), peer) == result.end())
+        result.push_back(peer);
+    }
+    freeaddrinfo(found);
+  }
+  return result;
+}
+
+// Kademlia routing table: one bucket of up to 8 nodes for each length of
+// id prefix shared with us, so we know many nodes near our own id and a
+// few far away
+class routing_table {
+public:
+  static constexpr size_t bucket_size = 8;
+
+  explicit routing_table(const std::string &own_id = "")
+      : own_id_(own_id), buckets_(SHA_DIGEST_LENGTH * 8) {}
+
+  // a node queried us or answered us; a full bucket only makes room by
+  // evicting a node that stopped answering
+  void heard_from(const dht_contact &contact) {
+    if (contact.id.size() != SHA_DIGEST_LENGTH || contact.id == own_id_ ||
+        contact.endpoint.port == 0)
+      return;
+    bucket &b = buckets_[shared_prefix_bits(own_id_, contact.id)];
+    auto now = std::chrono::steady_clock::now();
+    b.last_changed = now;
+    for (auto &node : b.nodes) {
+      if (node.contact.id == contact.id) {
+        node.contact.endpoint = contact.endpoint;
+        node.failures = 0;
+        return;
+      }
+    }
+    if (b.nodes.size() >= bucket_size) {
+      auto worst = std::max_element(
+          b.nodes.begin(), b.nodes.end(),
+          [](const node &x, const node &y) { return x.failures < y.failures; });
+      if (worst->failures == 0)
+        return;
+      b.nodes.erase(worst);
+    }
+    b.nodes.push_back({contact, 0});
+  }
+
+  // a query to the node timed out; nodes that keep failing are dropped
+  void failed(const peer_endpoint &endpoint) {
+    for (auto &b : buckets_) {
+      std::erase_if(b.nodes, [&endpoint](node &n) {
+        return n.contact.endpoint == endpoint && ++n.failures >= max_failures;
+      });
+    }
+  }
+
+  // the known nodes nearest to target, nearest first
+  std::vector<dht_contact> closest(const std::string &target,
+                                   size_t count) const {
+    std::vector<dht_contact> result = contacts();
+    std::sort(result.begin(), result.end(),
+              [&target](const dht_contact &a, const dht_contact &b) {
+                return dht_closer(target, a.id, b.id);
+              });
+    if (result.size() > count)
+      result.resize(count);
+    return result;
+  }
+
+  std::vector<dht_contact> contacts() const {
+    std::vector<dht_contact> result;
+    for (const auto &b : buckets_) {
+      for (const auto &n : b.nodes)
+        result.push_back(n.contact);
+    }
+    return result;
+  }
+
+  size_t size() const {
+    size_t count = 0;
+    for (const auto &b : buckets_)
+      count += b.nodes.size();
+    return count;
+  }
+
+  // a random id inside every bucket nothing happened in for a while;
+  // looking them up keeps the table fresh
+  std::vector<std::string> stale_targets(std::mt19937 &rng) const {
+    std::vector<std::string> targets;
+    auto cutoff = std::chrono::steady_clock::now() -
+                  std::chrono::minutes(bucket_refresh_min);
+    for (size_t depth = 0; depth < buckets_.size(); ++depth) {
+      const bucket &b = buckets_[depth];
+      if (b.nodes.empty() || b.last_changed > cutoff)
+        continue;
+      std::string target = own_id_;
+      for (size_t bit = depth; bit < SHA_DIGEST_LENGTH * 8; ++bit) {
+        uint8_t mask = static_cast<uint8_t>(0x80 >> (bit % 8));
+        if (bit == depth || rng() & 1)
+          target[bit / 8] = static_cast<char>(target[bit / 8] ^ mask);
+      }
+      targets.push_back(target);
+    }
+    return targets;
+  }
+
+private:
+  static constexpr int max_failures = 3;
+  static constexpr int bucket_refresh_min = 15;
+
+  struct node {
+    dht_contact contact;
+    int failures = 0;
+  };
+  struct bucket {
+    std::vector<node> nodes;
+    std::chrono::steady_clock::time_point last_changed =
+        std::chrono::steady_clock::now();
+  };
+
+  std::string own_id_;
+  std::vector<bucket> buckets_;
+};
+
+// mainline DHT node (BEP 5) on the shared UDP socket: answers KRPC queries from
+// other nodes, keeps the peers announced to it, and runs iterative lookups
+// that ask the alpha nearest unasked nodes at once until the k nearest
+// have all answered
+class dht_node {
+public:
+  using peers_handler = std::function<void(const std::vector<peer_endpoint> &)>;
+  using done_handler = std::function<void()>;
+  using lookup_id = uint64_t;
+
+  // the node id and known nodes are kept per port so local test nodes
+  // stay apart
+  dht_node(event_loop &loop, udp_socket &socket)
+      : loop_(loop), socket_(socket) {
+    state_path_ = cache_directory() / "dht" /
+                  (std::to_string(socket_.port()) + ".json");
+    load_state();
+    rotate_secret();
+    socket_.set_handler(
+        udp_protocol::dht,
+        [this](const char *data, size_t size, const sockaddr_in &from) {
+          on_datagram(data, size, from);
+        });
+    schedule_maintenance();
+  }
+
+  ~dht_node() {
+    loop_.cancel(maintenance_timer_);
+    loop_.cancel(resolve_timer_);
+    for (auto &entry : transactions_)
+      loop_.cancel(entry.second.timer);
+    try {
+      save_state();
+    } catch (const std::exception &e) {
+      std::cerr << "Failed to save DHT nodes: " << e.what() << std::endl;
+    }
+    socket_.remove_handler(udp_protocol::dht);
+  }
+  dht_node(const dht_node &) = delete;
+  dht_node &operator=(const dht_node &) = delete;
+
+  uint16_t port() const { return socket_.port(); }
+  const std::string &id() const { return own_id_; }
+  size_t node_count() const { return table_.size(); }
+
+  // join the network from these nodes, the ones the last run knew, and
+  // routers that are resolved in the background
+  void bootstrap(const std::vector<peer_endpoint> &nodes,
+                 const std::vector<std::string> &routers) {
+    for (const auto &node : nodes)
+      add_seed({"", node});
+    if (!routers.empty()) {
+      resolving_ = true;
+      resolve_ = std::async(std::launch::async, resolve_hosts, routers);
+      poll_resolve();
+    }
+    start_lookup(own_id_, false, 0, nullptr, nullptr);
+  }
+
+  // find peers for a torrent, announcing our port to the nearest nodes at
+  // the end when announce_port is set; on_peers gets each new batch
+  lookup_id get_peers(const std::string &info_hash, uint16_t announce_port,
+                      peers_handler on_peers, done_handler on_done) {
+    return start_lookup(info_hash, true, announce_port, std::move(on_peers),
+                        std::move(on_done));
+  }
+
+  // forget a lookup; its handlers are not called again
+  void cancel(lookup_id id) { lookups_.erase(id); }
+
+private:
+  // lookups ask this many nodes at once
+  static constexpr size_t alpha = 3;
+  static constexpr size_t max_lookup_candidates = 64;
+  static constexpr int query_timeout_ms = 2000;
+  static constexpr int maintenance_interval_sec = 60;
+  // tokens are good for two secrets, five to ten minutes
+  static constexpr int secret_rotation_sec = 300;
+  // peers announced to us are kept for half an hour, up to a limit per
+  // torrent and on the number of torrents
+  static constexpr int peer_lifetime_sec = 30 * 60;
+  static constexpr size_t max_peers_per_torrent = 100;
+  static constexpr size_t max_stored_torrents = 2000;
+  static constexpr size_t max_values = 50;
+  static constexpr size_t max_saved_nodes = 200;
+
+  static constexpr uint8_t candidate_new = 0;
+  static constexpr uint8_t candidate_asked = 1;
+  static constexpr uint8_t candidate_answered = 2;
+  static constexpr uint8_t candidate_failed = 3;
+
+  using reply_handler = std::function<void(const json *)>;
+
+  struct transaction {
+    peer_endpoint to;
+    reply_handler on_reply;
+    event_loop::timer_id timer = 0;
+  };
+
+  struct candidate {
+    dht_contact contact;
+    uint8_t state = candidate_new;
+    std::string token; // from get_peers, needed to announce
+  };
+
+  struct lookup {
+    std::string target;
+    bool want_peers = false;
+    uint16_t announce_port = 0;
+    std::vector<candidate> candidates; // nearest first
+    size_t in_flight = 0;
+    std::vector<peer_endpoint> peers;
+    peers_handler on_peers;
+    done_handler on_done;
+  };
+
+  struct stored_peer {
+    peer_endpoint endpoint;
+    std::chrono::steady_clock::time_point added;
+  };
+
+  void send_packet(const peer_endpoint &to, std::string packet) {
+    if (to.family != AF_INET)
+      return;
+    sockaddr_storage storage;
+    try {
+      make_sockaddr(to, storage);
+    } catch (const std::exception &) {
+      return;
+    }
+    sockaddr_in addr;
+    std::memcpy(&addr, &storage, sizeof(addr));
+    socket_.send(addr, std::move(packet));
+  }
+
+  void query(const peer_endpoint &to, const std::string &method, json args,
+             reply_handler on_reply) {
+    std::string t(2, '\0');
+    t[0] = static_cast<char>(next_transaction_ >> 8);
+    t[1] = static_cast<char>(next_transaction_ & 0xFF);
+    next_transaction_++;
+    args["id"] = own_id_;
+    send_packet(to, bencode({{"t", t}, {"y", "q"}, {"q", method}, {"a", args}}));
+    transaction &entry = transactions_[t];
+    loop_.cancel(entry.timer);
+    entry.to = to;
+    entry.on_reply = std::move(on_reply);
+    entry.timer = loop_.schedule(std::chrono::milliseconds(query_timeout_ms),
+                                 [this, t] { expire(t); });
+  }
+
+  void expire(const std::string &t) {
+    auto it = transactions_.find(t);
+    if (it == transactions_.end())
+      return;
+    transaction entry = std::move(it->second);
+    transactions_.erase(it);
+    table_.failed(entry.to);
+    if (entry.on_reply)
+      entry.on_reply(nullptr);
+  }
+
+  void on_datagram(const char *data, size_t size, const sockaddr_in &from) {
+    sockaddr_storage addr = {};
+    std::memcpy(&addr, &from, sizeof(from));
+    // nodes send all sorts of garbage; a bad packet only loses itself
+    try {
+      on_packet(std::string(data, size), endpoint_from_sockaddr(addr));
+    } catch (const std::exception &) {
+    }
+  }
+
+  void on_packet(const std::string &packet, const peer_endpoint &from) {
+    json message = decode_bencoded_value(packet);
+    if (!message.is_object() || !message.contains("t") ||
+        !message["t"].is_string() || !message.contains("y") ||
+        !message["y"].is_string())
+      return;
+    std::string t = message["t"].get<std::string>();
+    std::string y = message["y"].get<std::string>();
+    if (y == "q") {
+      on_query(message, t, from);
+      return;
+    }
+    auto it = transactions_.find(t);
+    if (it == transactions_.end() || !(it->second.to == from))
+      return;
+    transaction entry = std::move(it->second);
+    transactions_.erase(it);
+    loop_.cancel(entry.timer);
+    const json *reply = nullptr;
+    if (y == "r" && message.contains("r") && message["r"].is_object()) {
+      const json &r = message["r"];
+      if (r.contains("id") && r["id"].is_string() &&
+          r["id"].get<std::string>().size() == SHA_DIGEST_LENGTH) {
+        table_.heard_from({r["id"].get<std::string>(), from});
+        reply = &r;
+      }
+    }
+    if (entry.on_reply)
+      entry.on_reply(reply);
+  }
+
+  void on_query(const json &message, const std::string &t,
+                const peer_endpoint &from) {
+    if (!message.contains("q") || !message["q"].is_string() ||
+        !message.contains("a") || !message["a"].is_object()) {
+      send_error(from, t, 203, "Protocol Error");
+      return;
+    }
+    const json &args = message["a"];
+    auto binary = [&args](const char *key) {
+      if (!args.contains(key) || !args[key].is_string() ||
+          args[key].get<std::string>().size() != SHA_DIGEST_LENGTH)
+        return std::string();
+      return args[key].get<std::string>();
+    };
+    std::string sender = binary("id");
+    if (sender.empty()) {
+      send_error(from, t, 203, "Protocol Error");
+      return;
+    }
+    table_.heard_from({sender, from});
+
+    std::string method = message["q"].get<std::string>();
+    json r = {{"id", own_id_}};
+    if (method == "ping") {
+    } else if (method == "find_node" && !binary("target").empty()) {
+      r["nodes"] = encode_compact_nodes(
+          table_.closest(binary("target"), routing_table::bucket_size));
+    } else if (method == "get_peers" && !binary("info_hash").empty()) {
+      std::string info_hash = binary("info_hash");
+      r["token"] = make_token(from, secret_);
+      r["nodes"] = encode_compact_nodes(
+          table_.closest(info_hash, routing_table::bucket_size));
+      auto stored = peers_.find(info_hash);
+      if (stored != peers_.end() && !stored->second.empty()) {
+        json values = json::array();
+        for (const auto &peer : stored->second) {
+          if (values.size() >= max_values)
+            break;
+          if (peer.endpoint.family == AF_INET)
+            values.push_back(encode_compact_peer(peer.endpoint));
+        }
+        r["values"] = values;
+      }
+    } else if (method == "announce_peer" && !binary("info_hash").empty()) {
+      if (!args.contains("token") || !args["token"].is_string() ||
+          !valid_token(args["token"].get<std::string>(), from)) {
+        send_error(from, t, 203, "Bad token");
+        return;
+      }
+      peer_endpoint peer = from;
+      bool implied = args.contains("implied_port") &&
+                     args["implied_port"].is_number_integer() &&
+                     args["implied_port"].get<int64_t>() != 0;
+      if (!implied) {
+        if (!args.contains("port") || !args["port"].is_number_integer()) {
+          send_error(from, t, 203, "Protocol Error");
+          return;
+        }
+        int64_t port = args["port"].get<int64_t>();
+        if (port <= 0 || port > 65535) {
+          send_error(from, t, 203, "Invalid port");
+          return;
+        }
+        peer.port = static_cast<uint16_t>(port);
+      }
+      store_peer(binary("info_hash"), peer);
+    } else {
+      send_error(from, t, 204, "Method Unknown");
+      return;
+    }
+    send_packet(from, bencode({{"t", t}, {"y", "r"}, {"r", r}}));
+  }
+
+  void send_error(const peer_endpoint &to, const std::string &t, int code,
+                  const std::string &text) {
+    send_packet(to, bencode({{"t", t}, {"y", "e"}, {"e", {code, text}}}));
+  }
+
+  // tokens tie an announce to the address that asked get_peers
+  std::string make_token(const peer_endpoint &from,
+                         const std::string &secret) const {
+    std::string input = secret + from.ip;
+    unsigned char hash[SHA_DIGEST_LENGTH];
+    SHA1(reinterpret_cast<const unsigned char *>(input.data()), input.size(),
+         hash);
+    return std::string(reinterpret_cast<char *>(hash), 8);
+  }
+
+  bool valid_token(const std::string &token, const peer_endpoint &from) const {
+    return token == make_token(from, secret_) ||
+           token == make_token(from, previous_secret_);
+  }
+
+  void rotate_secret() {
+    previous_secret_ = secret_;
+    secret_ = random_peer_id();
+  }
+
+  void store_peer(const std::string &info_hash, const peer_endpoint &peer) {
+    auto now = std::chrono::steady_clock::now();
+    if (!peers_.count(info_hash) && peers_.size() >= max_stored_torrents) {
+      expire_peers(now);
+      // still full: forget the torrent nobody has announced for longest
+      if (peers_.size() >= max_stored_torrents) {
+        auto last_announce = [](const std::vector<stored_peer> &peers) {
+          auto newest = std::chrono::steady_clock::time_point::min();
+          for (const auto &peer : peers)
+            newest = std::max(newest, peer.added);
+          return newest;
+        };
+        peers_.erase(std::min_element(
+            peers_.begin(), peers_.end(), [&](const auto &a, const auto &b) {
+              return last_announce(a.second) < last_announce(b.second);
+            }));
+      }
+    }
+    auto &stored = peers_[info_hash];
+    for (auto &entry : stored) {
+      if (entry.endpoint == peer) {
+        entry.added = now;
+        return;
+      }
+    }
+    if (stored.size() >= max_peers_per_torrent)
+      stored.erase(stored.begin());
+    stored.push_back({peer, now});
+  }
+
+  // a node to start lookups from when the table is short of nodes
+  void add_seed(const dht_contact &contact) {
+    bool known = std::any_of(
+        seeds_.begin(), seeds_.end(), [&contact](const dht_contact &seed) {
+          return seed.endpoint == contact.endpoint;
+        });
+    if (!known)
+      seeds_.push_back(contact);
+  }
+
+  // pick up the resolved routers and hand them to lookups waiting for nodes
+  void poll_resolve() {
+    if (resolve_.wait_for(std::chrono::seconds(0)) !=
+        std::future_status::ready) {
+      resolve_timer_ = loop_.schedule(std::chrono::milliseconds(100),
+                                      [this] { poll_resolve(); });
+      return;
+    }
+    resolving_ = false;
+    std::vector<dht_contact> routers;
+    for (const auto &endpoint : resolve_.get()) {
+      add_seed({"", endpoint});
+      routers.push_back({"", endpoint});
+    }
+    std::vector<lookup_id> ids;
+    for (auto &entry : lookups_) {
+      add_candidates(entry.second, routers);
+      ids.push_back(entry.first);
+    }
+    for (lookup_id id : ids)
+      step(id);
+  }
+
+  lookup_id start_lookup(const std::string &target, bool want_peers,
+                         uint16_t announce_port, peers_handler on_peers,
+                         done_handler on_done) {
+    lookup_id id = next_lookup_++;
+    lookup &search = lookups_[id];
+    search.target = target;
+    search.want_peers = want_peers;
+    search.announce_port = announce_port;
+    search.on_peers = std::move(on_peers);
+    search.on_done = std::move(on_done);
+    add_candidates(search,
+                   table_.closest(target, 2 * routing_table::bucket_size));
+    if (search.candidates.size() < routing_table::bucket_size)
+      add_candidates(search, seeds_);
+    step(id);
+    return id;
+  }
+
+  // merge nodes into a lookup, nearest first, keeping the list bounded
+  void add_candidates(lookup &search, const std::vector<dht_contact> &nodes) {
+    for (const auto &node : nodes) {
+      if (node.id == own_id_ || node.endpoint.port == 0)
+        continue;
+      bool known = std::any_of(
+          search.candidates.begin(), search.candidates.end(),
+          [&node](const candidate &c) {
+            return c.contact.endpoint == node.endpoint;
+          });
+      if (!known)
+        search.candidates.push_back({node, candidate_new, ""});
+    }
+    const std::string &target = search.target;
+    std::stable_sort(search.candidates.begin(), search.candidates.end(),
+                     [&target](const candidate &a, const candidate &b) {
+                       return dht_closer(target, a.contact.id, b.contact.id);
+                     });
+    for (size_t i = search.candidates.size();
+         i > 0 && search.candidates.size() > max_lookup_candidates; --i) {
+      if (search.candidates[i - 1].state == candidate_new)
+        search.candidates.erase(search.candidates.begin() + (i - 1));
+    }
+  }
+
+  // ask the nearest unasked nodes while fewer than alpha queries are out;
+  // the lookup is over once the k nearest live nodes have all answered
+  void step(lookup_id id) {
+    auto it = lookups_.find(id);
+    if (it == lookups_.end())
+      return;
+    lookup &search = it->second;
+    size_t live = 0;
+    for (auto &c : search.candidates) {
+      if (search.in_flight >= alpha)
+        break;
+      if (c.state == candidate_failed)
+        continue;
+      if (++live > routing_table::bucket_size)
+        break;
+      if (c.state != candidate_new)
+        continue;
+      c.state = candidate_asked;
+      search.in_flight++;
+      peer_endpoint to = c.contact.endpoint;
+      json args = {{search.want_peers ? "info_hash" : "target", search.target}};
+      query(to, search.want_peers ? "get_peers" : "find_node", args,
+            [this, id, to](const json *reply) { on_lookup_reply(id, to, reply); });
+    }
+    // routers still resolving may bring the nodes a lookup is waiting for
+    if (search.in_flight == 0 && !resolving_)
+      finish(id);
+  }
+
+  void on_lookup_reply(lookup_id id, const peer_endpoint &from,
+                       const json *reply) {
+    auto it = lookups_.find(id);
+    if (it == lookups_.end())
+      return;
+    lookup &search = it->second;
+    search.in_flight--;
+    auto c = std::find_if(
+        search.candidates.begin(), search.candidates.end(),
+        [&from](const candidate &entry) { return entry.contact.endpoint == from; });
+    if (!reply) {
+      if (c != search.candidates.end())
+        c->state = candidate_failed;
+      step(id);
+      return;
+    }
+    std::vector<dht_contact> nodes;
+    std::vector<peer_endpoint> found;
+    try {
+      if (c != search.candidates.end()) {
+        c->state = candidate_answered;
+        c->contact.id = (*reply)["id"].get<std::string>();
+        if (reply->contains("token") && (*reply)["token"].is_string())
+          c->token = (*reply)["token"].get<std::string>();
+      }
+      if (reply->contains("nodes") && (*reply)["nodes"].is_string())
+        nodes = parse_compact_nodes((*reply)["nodes"].get<std::string>());
+      if (reply->contains("values") && (*reply)["values"].is_array()) {
+        for (const auto &value : (*reply)["values"]) {
+          if (!value.is_string() || value.get<std::string>().size() != 6)
+            continue;
+          peer_endpoint peer =
+              parse_compact_peers(value.get<std::string>(), AF_INET)[0];
+          if (peer.port != 0 &&
+              std::find(search.peers.begin(), search.peers.end(), peer) ==
+                  search.peers.end()) {
+            search.peers.push_back(peer);
+            found.push_back(peer);
+          }
+        }
+      }
+    } catch (const std::exception &) {
+      // keep whatever parsed before the bad field
+    }
+    add_candidates(search, nodes);
+    if (!found.empty() && search.on_peers) {
+      search.on_peers(found);
+      // the handler may have cancelled the lookup
+      if (!lookups_.count(id))
+        return;
+    }
+    step(id);
+  }
+
+  // announce to the nearest nodes that gave us a token, then report
+  void finish(lookup_id id) {
+    auto it = lookups_.find(id);
+    lookup search = std::move(it->second);
+    lookups_.erase(it);
+    if (search.announce_port != 0) {
+      size_t sent = 0;
+      for (const auto &c : search.candidates) {
+        if (sent >= routing_table::bucket_size)
+          break;
+        if (c.state != candidate_answered || c.token.empty())
+          continue;
+        query(c.contact.endpoint, "announce_peer",
+              {{"info_hash", search.target},
+               {"port", search.announce_port},
+               {"token", c.token},
+               {"implied_port", 0}},
+              nullptr);
+        sent++;
+      }
+    }
+    if (search.on_done)
+      search.on_done();
+  }
+
+  void schedule_maintenance() {
+    maintenance_timer_ = loop_.schedule(
+        std::chrono::seconds(maintenance_interval_sec), [this] {
+          schedule_maintenance();
+          maintain();
+        });
+  }
+
+  void expire_peers(std::chrono::steady_clock::time_point now) {
+    for (auto it = peers_.begin(); it != peers_.end();) {
+      std::erase_if(it->second, [now](const stored_peer &peer) {
+        return now - peer.added > std::chrono::seconds(peer_lifetime_sec);
+      });
+      it = it->second.empty() ? peers_.erase(it) : std::next(it);
+    }
+  }
+
+  // rotate the token secret, forget old peers, refresh quiet buckets and
+  // keep the node file current
+  void maintain() {
+    auto now = std::chrono::steady_clock::now();
+    if (now - last_rotation_ >= std::chrono::seconds(secret_rotation_sec)) {
+      rotate_secret();
+      last_rotation_ = now;
+    }
+    expire_peers(now);
+    if (table_.size() == 0 && lookups_.empty())
+      start_lookup(own_id_, false, 0, nullptr, nullptr);
+    for (const auto &target : table_.stale_targets(rng_))
+      start_lookup(target, false, 0, nullptr, nullptr);
+    try {
+      save_state();
+    } catch (const std::exception &e) {
+      std::cerr << "Failed to save DHT nodes: " << e.what() << std::endl;
+    }
+  }
+
+  // a missing or corrupt file just means a new id and no known nodes
+  void load_state() {
+    own_id_.clear();
+    std::ifstream in(state_path_);
+    if (in) {
+      try {
+        json state = json::parse(in);
+        own_id_ = decode_hex(state.at("id").get<std::string>());
+        for (const auto &item : state.at("nodes")) {
+          dht_contact contact;
+          contact.id = decode_hex(item.at("id").get<std::string>());
+          contact.endpoint.ip = item.at("ip").get<std::string>();
+          contact.endpoint.port = item.at("port").get<uint16_t>();
+          add_seed(contact);
+        }
+      } catch (const std::exception &e) {
+        std::cerr << "Ignoring corrupt DHT state " << state_path_ << ": "
+                  << e.what() << std::endl;
+        seeds_.clear();
+      }
+    }
+    if (own_id_.size() != SHA_DIGEST_LENGTH)
+      own_id_ = random_peer_id();
+    table_ = routing_table(own_id_);
+  }
+
+  void save_state() {
+    json nodes = json::array();
+    for (const auto &contact : table_.contacts()) {
+      if (nodes.size() >= max_saved_nodes)
+        break;
+      nodes.push_back({{"id", hex_string(reinterpret_cast<const unsigned char *>(
+                                             contact.id.data()),
+                                         contact.id.size())},
+                       {"ip", contact.endpoint.ip},
+                       {"port", contact.endpoint.port}});
+    }
+    json state = {{"id", hex_string(reinterpret_cast<const unsigned char *>(
+                                        own_id_.data()),
+                                    own_id_.size())},
+                  {"nodes", nodes}};
+    std::filesystem::create_directories(state_path_.parent_path());
+    // write then rename so a crash never leaves a half written file
+    std::filesystem::path temp_path = state_path_;
+    temp_path += ".tmp";
+    {
+      std::ofstream out(temp_path);
+      if (!out)
+        throw std::runtime_error("Failed to open " + temp_path.string());
+      out << state.dump();
+    }
+    std::filesystem::rename(temp_path, state_path_);
+  }
+
+  event_loop &loop_;
+  udp_socket &socket_;
+  std::filesystem::path state_path_;
+  std::string own_id_;
+  routing_table table_;
+  std::vector<dht_contact> seeds_;
+  std::future<std::vector<peer_endpoint>> resolve_;
+  bool resolving_ = false;
+  event_loop::timer_id resolve_timer_ = 0;
+  std::unordered_map<std::string, transaction> transactions_;
+  uint16_t next_transaction_ = 0;
+  std::map<lookup_id, lookup> lookups_;
+  lookup_id next_lookup_ = 1;
+  std::map<std::string, std::vector<stored_peer>> peers_;
+  std::string secret_;
+  std::string previous_secret_;
+  std::chrono::steady_clock::time_point last_rotation_ =
+      std::chrono::steady_clock::now();
+  event_loop::timer_id maintenance_timer_ = 0;
+  std::mt19937 rng_{std::random_device{}()};
+};
+
+// Peer Sources
+
+// candidate peers for a download: cached peers are available at once,
+// tracker peers are merged in as soon as the announce finishes and DHT
+// peers as each lookup reply brings them
+class peer_source {
+public:
+  peer_source(const json &torrent, const unsigned char *info_hash,
+              int64_t left, uint16_t port, peer_cache &cache,
+              dht_node *dht = nullptr)
+      : torrent_(torrent), info_hash_(info_hash), port_(port), dht_(dht),
+        announce_(announce(left)) {
+    peers_ = cache.best_peers(cached_peers_to_try);
+    if (dht_)
+      start_dht_lookup();
+  }
+
+  ~peer_source() {
+    if (dht_ && dht_searching_)
+      dht_->cancel(dht_lookup_);
+  }
+  peer_source(const peer_source &) = delete;
+  peer_source &operator=(const peer_source &) = delete;
+
+  // announce again once the tracker interval has passed
+  void refresh(int64_t left) {
+    if (!announced_ || std::chrono::steady_clock::now() < next_announce_)
+      return;
+    announce_ = announce(left);
+    announced_ = false;
+    if (dht_ && !dht_searching_)
+      start_dht_lookup();
+  }
+
+  // pick up the tracker peers once the announce is done
+  void poll() {
+    if (announced_ || announce_.wait_for(std::chrono::seconds(0)) !=
+                          std::future_status::ready) {
+      return;
+    }
+    announced_ = true;
+    auto now = std::chrono::steady_clock::now();
+    next_announce_ = now + std::chrono::seconds(announce_retry_sec);
+    try {
+      peer_discovery discovery = announce_.get();
+      swarm_ = discovery.swarm;
+      next_announce_ =
+          now + std::chrono::seconds(discovery.interval > 0
+                                         ? discovery.interval
+                                         : default_announce_interval_sec);
+      merge(discovery.peers);
+    } catch (const std::exception &e) {
+      // with the DHT there are still peers to come
+      if (peers_.empty() && !dht_)
+        throw;
+      std::cerr << "Tracker announce failed: " << e.what() << std::endl;
+    }
+  }
+
+  bool announced() const { return announced_; }
+  // more peers may still arrive from the tracker or the DHT
+  bool searching() const { return !announced_ || dht_searching_; }
+  const swarm_info &swarm() const { return swarm_; }
+  const std::vector<peer_endpoint> &peers() const { return peers_; }
+
+private:
+  static constexpr size_t cached_peers_to_try = 10;
+  static constexpr int default_announce_interval_sec = 1800;
+  static constexpr int announce_retry_sec = 60;
+
+  // the announce works on copies, so a source dropped mid-announce (a
+  // queued or removed torrent) does not wait for slow trackers
+  std::future<peer_discovery> announce(int64_t left) const {
+    return run_detached(
+        [torrent = torrent_,
+         info_hash = std::string(reinterpret_cast<const char *>(info_hash_),
+                                 SHA_DIGEST_LENGTH),
+         left, port = port_] {
+          return discover_peers(
+              torrent, reinterpret_cast<const unsigned char *>(info_hash.data()),
+              left, port);
+        });
+  }
+
+  void merge(const std::vector<peer_endpoint> &peers) {
+    for (const auto &peer : peers) {
+      if (std::find(peers_.begin(), peers_.end(), peer) == peers_.end())
+        peers_.push_back(peer);
+    }
+  }
+
+  // the lookup announces our port to the nodes nearest the info hash
+  void start_dht_lookup() {
+    dht_searching_ = true;
+    dht_lookup_ = dht_->get_peers(
+        std::string(reinterpret_cast<const char *>(info_hash_),
+                    SHA_DIGEST_LENGTH),
+        port_, [this](const std::vector<peer_endpoint> &peers) { merge(peers); },
+        [this] { dht_searching_ = false; });
+  }
+
+  const json &torrent_;
+  const unsigned char *info_hash_;
+  uint16_t port_;
+  dht_node *dht_;
+  dht_node::lookup_id dht_lookup_ = 0;
+  bool dht_searching_ = false;
+  std::future<peer_discovery> announce_;
+  std::chrono::steady_clock::time_point next_announce_;
+  std::vector<peer_endpoint> peers_;
+  swarm_info swarm_;
+  bool announced_ = false;
+};
+
+
+// listen for incoming peers if a port is free; downloads work without it
+std::unique_ptr<peer_listener> open_listener(event_loop &loop) {
+  try {
+    return std::make_unique<peer_listener>(loop, default_listen_port);
+  } catch (const std::exception &e) {
+    std::cerr << "Not accepting incoming peers: " << e.what() << std::endl;
+    return nullptr;
+  }
+}
+
+// the UDP side of the listening port, which uTP and the DHT share; both
+// are off without it
+std::unique_ptr<udp_socket> open_udp(event_loop &loop, uint16_t port) {
+  try {
+    return std::make_unique<udp_socket>(loop, port);
+  } catch (const std::exception &e) {
+    std::cerr << "Not using UDP: " << e.what() << std::endl;
+    return nullptr;
+  }
+}
+
+// take uTP peers on the listener's port and reach peers over uTP first;
+// without it everything goes over TCP
+std::unique_ptr<utp_socket_manager>
+open_utp(event_loop &loop, udp_socket *udp, peer_listener *listener) {
+  if (!udp || !listener)
+    return nullptr;
+  try {
+    auto utp = std::make_unique<utp_socket_manager>(loop, *udp);
+    utp->set_accept_handler([listener](int fd, const peer_endpoint &peer) {
+      listener->adopt(fd, peer);
+    });
+    return utp;
+  } catch (const std::exception &e) {
+    std::cerr << "Not using uTP: " << e.what() << std::endl;
+    return nullptr;
+  }
+}
+
+// public routers a node without known nodes joins the network through
+const std::vector<std::string> dht_routers = {"router.bittorrent.com:6881",
+                                              "dht.transmissionbt.com:6881",
+                                              "router.utorrent.com:6881"};
+
+// host:port nodes to join the DHT through: the comma separated list in
+// BITTORRENT_DHT_BOOTSTRAP, which local test networks use, or the routers
+std::vector<std::string> dht_bootstrap_nodes() {
+  std::vector<std::string> nodes;
+  const char *env = std::getenv("BITTORRENT_DHT_BOOTSTRAP");
+  std::stringstream list(env ? env : "");
+  std::string node;
+  while (std::getline(list, node, ',')) {
+    if (!node.empty())
+      nodes.push_back(node);
+  }
+  return nodes.empty() ? dht_routers : nodes;
+}
+
+// run a DHT node next to the listener; downloads work without it
+std::unique_ptr<dht_node> open_dht(event_loop &loop, udp_socket *udp) {
+  if (!udp)
+    return nullptr;
+  try {
+    auto dht = std::make_unique<dht_node>(loop, *udp);
+    dht->bootstrap({}, dht_bootstrap_nodes());
+    return dht;
+  } catch (const std::exception &e) {
+    std::cerr << "Not using the DHT: " << e.what() << std::endl;
+    return nullptr;
+  }
+}
+
+// run the event loop until the swarm has every wanted piece, or the
+// metadata fetcher has the info dictionary, feeding tracker peers to the
+// connection manager as they arrive
+template <typename Swarm>
+void run_swarm(event_loop &loop, Swarm &swarm, connection_manager &manager,
+               peer_source &source) {
+  while (!swarm.complete()) {
+    source.poll();
+    manager.add_candidates(source.peers());
+    manager.set_connection_limit(connection_limit_for_swarm(source.swarm()));
+    manager.tick();
+    if (swarm.peer_count() == 0 && manager.exhausted() && !source.searching())
+      throw std::runtime_error("No peers available");
+    loop.run_once(100);
+    swarm.tick();
+  }
+}
+
+// get the info dictionary of a magnet link from the peers of its swarm
+std::string fetch_metadata(const magnet_link &link, const json &torrent) {
+  auto info_hash = reinterpret_cast<const unsigned char *>(link.info_hash.data());
+  event_loop loop;
+  std::unique_ptr<peer_listener> listener = open_listener(loop);
+  uint16_t port = listener ? listener->port() : default_listen_port;
+  std::unique_ptr<udp_socket> udp = open_udp(loop, port);
+  std::unique_ptr<utp_socket_manager> utp =
+      open_utp(loop, udp.get(), listener.get());
+  std::unique_ptr<dht_node> dht = open_dht(loop, udp.get());
+  peer_cache cache(info_hash);
+  // the size is unknown until the metadata arrives; announcing something
+  // left keeps us a leecher to the tracker
+  peer_source source(torrent, info_hash, 1, port, cache, dht.get());
+
+  metadata_fetcher fetcher(loop, link.info_hash);
+  connection_manager manager(loop, link.info_hash, &cache,
+                             [&fetcher](int fd, const peer_handshake &peer,
+                                        const std::string &leftover) {
+                               fetcher.add_peer(fd, peer, leftover);
+                             });
+  manager.set_utp(utp.get());
+  fetcher.set_close_handler(
+      [&manager](const peer_endpoint &endpoint, bool failed) {
+        manager.release(endpoint, failed);
+      });
+  if (listener) {
+    listener->add_torrent(link.info_hash, manager.handshake(),
+                          [&manager](int fd, const peer_handshake &peer,
+                                     const std::string &leftover) {
+                            return manager.accept_inbound(fd, peer, leftover);
+                          });
+  }
+  run_swarm(loop, fetcher, manager, source);
+  return fetcher.metadata();
+}
+
+// read a .torrent file, or turn a magnet link into the same shape: its
+// trackers plus the info dictionary from the cache or, failing that, peers
+json load_torrent(const std::string &source) {
+  if (!is_magnet_link(source)) {
+    std::ifstream file(source, std::ios::binary);
+    if (!file)
+      throw std::runtime_error("Could not open file " + source);
+    std::string encoded_value((std::istreambuf_iterator<char>(file)), {});
+    return decode_bencoded_value(encoded_value);
+  }
+  magnet_link link = parse_magnet_link(source);
+  json torrent = magnet_torrent(link);
+  std::optional<std::string> info = load_cached_metadata(link.info_hash);
+  if (!info) {
+    std::cerr << "Fetching metadata from peers" << std::endl;
+    info = fetch_metadata(link, torrent);
+    try {
+      save_cached_metadata(link.info_hash, *info);
+    } catch (const std::exception &e) {
+      std::cerr << "Failed to save metadata: " << e.what() << std::endl;
+    }
+  }
+  torrent["info"] = decode_bencoded_value(*info);
+  return torrent;
+}
+
+// rate caps from the command line: for the whole process and for each peer
+struct bandwidth_options {
+  rate_limits global;
+  rate_limits peer;
+};
+
+const char *bandwidth_usage =
+    "[--download-limit KiB/s] [--upload-limit KiB/s] "
+    "[--peer-download-limit KiB/s] [--peer-upload-limit KiB/s]";
+
+// take the rate option at argv[arg] and its value; false if there is none
+bool parse_rate_option(int argc, char *argv[], int &arg,
+                       bandwidth_options &options) {
+  if (arg + 1 >= argc)
+    return false;
+  std::string option = argv[arg];
+  double *target = nullptr;
+  if (option == "--download-limit")
+    target = &options.global.download;
+  else if (option == "--upload-limit")
+    target = &options.global.upload;
+  else if (option == "--peer-download-limit")
+    target = &options.peer.download;
+  else if (option == "--peer-upload-limit")
+    target = &options.peer.upload;
+  if (!target)
+    return false;
+  double kib = 0.0;
+  try {
+    kib = std::stod(argv[arg + 1]);
+  } catch (const std::exception &) {
+    kib = -1.0;
+  }
+  if (kib < 0.0)
+    throw std::runtime_error("Invalid rate limit " + std::string(argv[arg + 1]));
+  *target = kib * 1024.0;
+  arg += 2;
+  return true;
+}
+
+struct queue_depth_options {
+  size_t min = torrent_swarm::default_min_queue_depth;
+  size_t max = torrent_swarm::default_max_queue_depth;
+};
+
+const char *queue_depth_usage = "[--min-queue-depth N] [--max-queue-depth N]";
+
+// take the queue depth option at argv[arg] and its value; false if there is
+// none
+bool parse_queue_depth_option(int argc, char *argv[], int &arg,
+                              queue_depth_options &options) {
+  if (arg + 1 >= argc)
+    return false;
+  std::string option = argv[arg];
+  size_t *target = nullptr;
+  if (option == "--min-queue-depth")
+    target = &options.min;
+  else if (option == "--max-queue-depth")
+    target = &options.max;
+  if (!target)
+    return false;
+  long long depth = 0;
+  try {
+    depth = std::stoll(argv[arg + 1]);
+  } catch (const std::exception &) {
+    depth = 0;
+  }
+  if (depth < 1)
+    throw std::runtime_error("Invalid queue depth " + std::string(argv[arg + 1]));
+  *target = static_cast<size_t>(depth);
+  arg += 2;
+  return true;
+}
+
+// set by SIGINT or SIGTERM to stop seeding
+volatile sig_atomic_t stop_requested = 0;
+
+void request_stop(int) { stop_requested = 1; }
+
+// serve pieces until interrupted, re-announcing at the tracker interval and
+// connecting to the leechers it returns
+void run_seed(event_loop &loop, torrent_swarm &swarm,
+              connection_manager &manager, peer_source &source,
+              int64_t left) {
+  while (!stop_requested) {
+    source.refresh(left);
+    try {
+      source.poll();
+    } catch (const std::exception &e) {
+      // a seed keeps waiting for incoming peers when the trackers are down
+      std::cerr << "Tracker announce failed: " << e.what() << std::endl;
+    }
+    manager.add_candidates(source.peers());
+    manager.set_connection_limit(connection_limit_for_swarm(source.swarm()));
+    manager.tick();
+    loop.run_once(100);
+    swarm.tick();
+  }
+}
+
+// Session
+
+// many torrents in one process. They share the event loop, the listening
+// port, the UDP socket under uTP and the DHT, the hashing and disk threads,
+// the bandwidth caps and request slots, and limits on connections and on
+// memory held in piece buffers. Each torrent downloads to a file named
+// after it in one directory and seeds once complete. Only so many
+// downloads and seeds run at once; the rest wait in a queue ordered by
+// priority and swarm health, and a running torrent that stalls gives its
+// place to a queued one
+class torrent_session {
+public:
+  enum class torrent_state { checking, queued, downloading, seeding, error };
+
+  struct options {
+    std::string directory;
+    size_t max_connections = 200;
+    size_t max_memory = 256 << 20;
+    bandwidth_options bandwidth;
+    queue_depth_options queue_depth;
+    size_t active_downloads = 8;
+    size_t active_seeds = 16;
+    // bytes per second below which a running torrent counts as stalled
+    double stall_rate = 1024.0;
+    // a download that spends this long stalled while running, in total,
+    // fails; 0 keeps trying forever
+    double give_up_sec = 0.0;
+  };
+
+  explicit torrent_session(const options &opts)
+      : options_(opts),
+        hash_pool_(loop_, std::max(std::thread::hardware_concurrency(), 1u)),
+        disk_pool_(loop_, disk_threads), budget_(opts.max_memory),
+        slots_(std::max<size_t>(opts.max_memory / block_size, min_request_slots)) {
+    listener_ = open_listener(loop_);
+    port_ = listener_ ? listener_->port() : default_listen_port;
+    udp_ = open_udp(loop_, port_);
+    utp_ = open_utp(loop_, udp_.get(), listener_.get());
+    dht_ = open_dht(loop_, udp_.get());
+    download_limit_.share_by_weight();
+    upload_limit_.share_by_weight();
+    download_limit_.set_rate(opts.bandwidth.global.download);
+    upload_limit_.set_rate(opts.bandwidth.global.upload);
+    schedule_sample();
+  }
+
+  ~torrent_session() {
+    loop_.cancel(sample_timer_);
+    for (auto &entry : torrents_)
+      stop(*entry.second);
+  }
+  torrent_session(const torrent_session &) = delete;
+  torrent_session &operator=(const torrent_session &) = delete;
+
+  uint16_t port() const { return port_; }
+
+  // for anything else that runs inside the session, like the control API
+  event_loop &loop() { return loop_; }
+
+  // start a torrent: its file is checked first if it already exists.
+  // Returns the info hash
+  std::string add_torrent(const json &torrent) {
+    auto entry = std::make_unique<torrent_entry>();
+    entry->torrent = torrent;
+    entry->meta = parse_torrent_meta(entry->torrent);
+    const torrent_meta &meta = entry->meta;
+    if (torrents_.count(meta.info_hash))
+      throw std::runtime_error("Torrent already added");
+    // nothing counts as downloaded until the check or enqueue says so
+    entry->left = meta.length;
+    entry->name = file_name(meta);
+    entry->path = (std::filesystem::path(options_.directory) / entry->name).string();
+    for (const auto &other : torrents_) {
+      if (other.second->path == entry->path)
+        throw std::runtime_error("Another torrent writes to " + entry->path);
+    }
+    bool existing = std::filesystem::exists(entry->path);
+    entry->fd = open(entry->path.c_str(), O_RDWR | O_CREAT, 0644);
+    if (entry->fd < 0)
+      throw std::runtime_error("Failed to open " + entry->path);
+    if (ftruncate(entry->fd, meta.length) < 0) {
+      close(entry->fd);
+      throw std::runtime_error("Failed to write " + entry->path);
+    }
+    torrent_entry &added = *entry;
+    torrents_[meta.info_hash] = std::move(entry);
+    if (!existing) {
+      enqueue(added, std::vector<bool>(meta.num_pieces, false));
+      return meta.info_hash;
+    }
+    // resume: only pieces that pass the hash check are kept
+    std::cout << "Checking " << added.name << std::endl;
+    auto verified = std::make_shared<std::vector<bool>>();
+    hash_pool_.submit(
+        &added,
+        [&added, verified] { *verified = verify_pieces(added.fd, added.meta); },
+        [this, &added, verified](std::exception_ptr error) {
+          if (error)
+            fail(added, "Failed to check " + added.path);
+          else
+            enqueue(added, *verified);
+        });
+    return meta.info_hash;
+  }
+
+  // stop a torrent and forget it; its file is kept
+  void remove_torrent(const std::string &info_hash) {
+    auto it = torrents_.find(info_hash);
+    if (it == torrents_.end())
+      throw std::runtime_error("Unknown torrent");
+    stop(*it->second);
+    torrents_.erase(it);
+    manage_queue();
+  }
+
+  size_t torrent_count() const { return torrents_.size(); }
+
+  // the torrent's share of the bandwidth and request slots against the
+  // others', 1 by default
+  void set_priority(const std::string &info_hash, double priority) {
+    if (!(priority > 0.0))
+      throw std::runtime_error("Priority must be positive");
+    torrent_entry &entry = find(info_hash);
+    entry.priority = priority;
+    if (entry.swarm)
+      entry.swarm->set_weight(priority);
+    manage_queue();
+  }
+
+  // how many downloads and seeds run at once
+  void set_active_limits(size_t downloads, size_t seeds) {
+    if (downloads == 0)
+      throw std::runtime_error("At least one download must be active");
+    options_.active_downloads = downloads;
+    options_.active_seeds = seeds;
+    manage_queue();
+  }
+
+  std::pair<size_t, size_t> active_limits() const {
+    return {options_.active_downloads, options_.active_seeds};
+  }
+
+  // no torrent is checking, downloading or waiting to download
+  bool downloads_finished() const {
+    return std::none_of(torrents_.begin(), torrents_.end(), [](const auto &item) {
+      const torrent_entry &entry = *item.second;
+      return entry.state == torrent_state::checking ||
+             entry.state == torrent_state::downloading ||
+             (entry.state == torrent_state::queued && entry.left > 0);
+    });
+  }
+
+  void set_rate_limits(const rate_limits &global) {
+    download_limit_.set_rate(global.download);
+    upload_limit_.set_rate(global.upload);
+  }
+
+  rate_limits global_limits() const {
+    return {download_limit_.rate(), upload_limit_.rate()};
+  }
+
+  // caps for one torrent under the global ones
+  void set_torrent_limits(const std::string &info_hash,
+                          const rate_limits &limits) {
+    torrent_entry &entry = find(info_hash);
+    entry.limits = limits;
+    if (entry.swarm)
+      entry.swarm->set_rate_limits(limits, options_.bandwidth.peer);
+  }
+
+  rate_limits torrent_limits(const std::string &info_hash) const {
+    return find(info_hash).limits;
+  }
+
+  void set_max_connections(size_t limit) {
+    if (limit == 0)
+      throw std::runtime_error("Connection limit must be positive");
+    options_.max_connections = limit;
+  }
+
+  // the counters of the last sample, for the whole session or one
+  // torrent; nothing is walked but the torrents being listed
+  json stats(const std::string &info_hash = {}) const {
+    if (!info_hash.empty())
+      return torrent_stats(find(info_hash));
+    json result = {{"downloaded", totals_.downloaded},
+                   {"uploaded", totals_.uploaded},
+                   {"download_rate", totals_.download_rate},
+                   {"upload_rate", totals_.upload_rate},
+                   {"connections", totals_.connections},
+                   {"max_connections", options_.max_connections},
+                   {"memory", budget_.used()},
+                   {"max_memory", budget_.limit()},
+                   {"download_limit", download_limit_.rate()},
+                   {"upload_limit", upload_limit_.rate()},
+                   {"active_downloads", options_.active_downloads},
+                   {"active_seeds", options_.active_seeds},
+                   {"torrents", json::array()}};
+    for (const auto &entry : torrents_)
+      result["torrents"].push_back(torrent_stats(*entry.second));
+    return result;
+  }
+
+  // peers connected or being connected to, over every torrent
+  size_t connections() const {
+    size_t total = 0;
+    for (const auto &entry : torrents_) {
+      if (entry.second->manager)
+        total += entry.second->manager->connections();
+    }
+    return total;
+  }
+
+  // one round: wait for events for up to a tick, then feed each torrent
+  // its new peers and split the connection limit between them. Downloads
+  // connect first, so seeds never keep them from the last free slots
+  void tick() {
+    loop_.run_once(100);
+    std::vector<torrent_entry *> running;
+    for (const auto &item : torrents_) {
+      if (item.second->swarm)
+        running.push_back(item.second.get());
+    }
+    if (running.empty())
+      return;
+    std::stable_partition(running.begin(), running.end(),
+                          [](const torrent_entry *entry) {
+                            return entry->state == torrent_state::downloading;
+                          });
+    size_t share =
+        std::max<size_t>(options_.max_connections / running.size(), 1);
+    size_t total = connections();
+    bool finished = false;
+    for (torrent_entry *running_entry : running) {
+      torrent_entry &entry = *running_entry;
+      try {
+        entry.source->refresh(entry.left);
+        try {
+          entry.source->poll();
+        } catch (const std::exception &e) {
+          // the next announce may go better; incoming peers still arrive
+          std::cerr << entry.name << ": tracker announce failed: " << e.what()
+                    << std::endl;
+        }
+        if (entry.source->swarm().known())
+          entry.scraped = entry.source->swarm();
+        entry.manager->add_candidates(entry.source->peers());
+        entry.manager->set_connection_limit(std::min(
+            connection_limit_for_swarm(entry.source->swarm()), share));
+        if (total < options_.max_connections) {
+          size_t before = entry.manager->connections();
+          entry.manager->tick();
+          total += entry.manager->connections() - before;
+        }
+        entry.swarm->tick();
+        if (entry.state == torrent_state::downloading &&
+            entry.swarm->complete()) {
+          entry.state = torrent_state::seeding;
+          entry.last_busy = std::chrono::steady_clock::now();
+          std::cout << "Downloaded " << entry.path << std::endl;
+          finished = true;
+        }
+      } catch (const std::exception &e) {
+        fail(entry, e.what());
+        finished = true;
+      }
+    }
+    // the next queued download takes the place, and the seed cap holds
+    if (finished)
+      manage_queue();
+  }
+
+private:
+  static constexpr size_t disk_threads = 4;
+  static constexpr size_t min_request_slots = 64;
+  static constexpr int sample_interval_ms = 1000;
+  // a running torrent below the stall rate for this long makes way for a
+  // queued one, which it does not push out again for a while
+  static constexpr int stall_sec = 120;
+  static constexpr int stall_retry_sec = 600;
+  // queued torrents are scraped a few at a time, and again this often
+  static constexpr size_t max_scrapes = 8;
+  static constexpr int rescrape_sec = 1800;
+
+  // transfer totals and the rates over the last sample
+  struct transfer_counters {
+    uint64_t downloaded = 0;
+    uint64_t uploaded = 0;
+    double download_rate = 0.0;
+    double upload_rate = 0.0;
+    size_t connections = 0;
+  };
+
+  struct torrent_entry {
+    json torrent;
+    torrent_meta meta;
+    std::string name;
+    std::string path;
+    int fd = -1;
+    torrent_state state = torrent_state::checking;
+    std::string error;
+    int64_t left = 0;
+    double priority = 1.0;
+    rate_limits limits;
+    transfer_counters counters;
+    size_t pieces = 0;
+    // pieces on disk, kept while the torrent waits in the queue
+    std::vector<bool> have;
+    // the swarm's byte counts at the last sample
+    uint64_t sampled_downloaded = 0;
+    uint64_t sampled_uploaded = 0;
+    // the last time it moved data at the stall rate, and when a torrent
+    // that stalled may push out another again
+    std::chrono::steady_clock::time_point last_busy;
+    std::chrono::steady_clock::time_point retry_at;
+    // seconds spent running below the stall rate since it last moved data
+    double stalled_for = 0.0;
+    swarm_info scraped;
+    std::future<std::vector<tracker_status>> scrape;
+    std::chrono::steady_clock::time_point next_scrape;
+    // destroyed in reverse: the source and swarm use the cache
+    std::unique_ptr<peer_cache> cache;
+    std::unique_ptr<connection_manager> manager;
+    std::unique_ptr<torrent_swarm> swarm;
+    std::unique_ptr<peer_source> source;
+  };
+
+  // the torrent's own name when it is a plain file name, else its info hash
+  static std::string file_name(const torrent_meta &meta) {
+    const std::string &name = meta.name;
+    if (name.empty() || name == "." || name == ".." ||
+        name.find('/') != std::string::npos ||
+        name.find('\0') != std::string::npos)
+      return hex_string(reinterpret_cast<const unsigned char *>(
+                            meta.info_hash.data()),
+                        SHA_DIGEST_LENGTH);
+    return name;
+  }
+
+  // a checked torrent waits in the queue until it may run
+  void enqueue(torrent_entry &entry, const std::vector<bool> &verified) {
+    const torrent_meta &meta = entry.meta;
+    entry.have = verified;
+    entry.left = 0;
+    entry.pieces = 0;
+    for (int i = 0; i < meta.num_pieces; ++i) {
+      if (verified[i])
+        entry.pieces++;
+      else
+        entry.left += meta.piece_size(i);
+    }
+    entry.state = torrent_state::queued;
+    manage_queue();
+  }
+
+  // hook a queued torrent up to the shared parts and start it
+  void activate(torrent_entry &entry) {
+    const torrent_meta &meta = entry.meta;
+    auto info_hash = reinterpret_cast<const unsigned char *>(meta.info_hash.data());
+    entry.cache = std::make_unique<peer_cache>(info_hash);
+    entry.source = std::make_unique<peer_source>(
+        entry.torrent, info_hash, entry.left, port_, *entry.cache, dht_.get());
+    entry.swarm = std::make_unique<torrent_swarm>(
+        loop_, meta, std::vector<bool>(meta.num_pieces, true),
+        [&entry](int index, const std::vector<char> &) {
+          entry.have[index] = true;
+          entry.left -= entry.meta.piece_size(index);
+        },
+        entry.cache.get());
+    torrent_swarm &swarm = *entry.swarm;
+    entry.sampled_downloaded = entry.sampled_uploaded = 0;
+    entry.last_busy = std::chrono::steady_clock::now();
+    swarm.add_verified(entry.have);
+    swarm.set_storage(entry.fd);
+    swarm.set_worker_pools(&hash_pool_, &disk_pool_);
+    swarm.set_buffer_budget(&budget_);
+    swarm.set_global_limits(&download_limit_, &upload_limit_);
+    swarm.set_request_slots(&slots_);
+    swarm.set_weight(entry.priority);
+    swarm.set_rate_limits(entry.limits, options_.bandwidth.peer);
+    swarm.set_queue_depth_bounds(options_.queue_depth.min,
+                                 options_.queue_depth.max);
+    entry.manager = std::make_unique<connection_manager>(
+        loop_, meta.info_hash, entry.cache.get(),
+        [&swarm](int fd, const peer_handshake &peer,
+                 const std::string &leftover) {
+          swarm.add_peer(fd, peer, leftover);
+        });
+    connection_manager &manager = *entry.manager;
+    manager.set_utp(utp_.get());
+    wire_swarm(swarm, manager);
+    if (listener_) {
+      listener_->add_torrent(meta.info_hash, manager.handshake(),
+                             [this, &manager](int fd, const peer_handshake &peer,
+                                              const std::string &leftover) {
+                               if (connections() >= options_.max_connections)
+                                 return false;
+                               return manager.accept_inbound(fd, peer,
+                                                             leftover);
+                             });
+    }
+    entry.state = swarm.complete() ? torrent_state::seeding
+                                   : torrent_state::downloading;
+    std::cout << (entry.state == torrent_state::seeding ? "Seeding "
+                                                        : "Downloading ")
+              << entry.path << std::endl;
+  }
+
+  // back to the queue; pieces being hashed or written are dropped and
+  // fetched again later
+  void deactivate(torrent_entry &entry) {
+    if (listener_ && entry.manager)
+      listener_->remove_torrent(entry.meta.info_hash);
+    entry.source.reset();
+    entry.swarm.reset();
+    entry.manager.reset();
+    entry.cache.reset();
+    entry.counters.download_rate = entry.counters.upload_rate = 0.0;
+    entry.counters.connections = 0;
+    entry.state = torrent_state::queued;
+  }
+
+  // tear down everything but the file; a pending check is dropped
+  void stop(torrent_entry &entry) {
+    hash_pool_.forget(&entry);
+    deactivate(entry);
+    if (entry.fd >= 0) {
+      close(entry.fd);
+      entry.fd = -1;
+    }
+  }
+
+  torrent_entry &find(const std::string &info_hash) const {
+    auto it = torrents_.find(info_hash);
+    if (it == torrents_.end())
+      throw std::runtime_error("Unknown torrent");
+    return *it->second;
+  }
+
+  static const char *state_name(torrent_state state) {
+    switch (state) {
+    case torrent_state::checking:
+      return "checking";
+    case torrent_state::queued:
+      return "queued";
+    case torrent_state::downloading:
+      return "downloading";
+    case torrent_state::seeding:
+      return "seeding";
+    case torrent_state::error:
+      break;
+    }
+    return "error";
+  }
+
+  json torrent_stats(const torrent_entry &entry) const {
+    const transfer_counters &counters = entry.counters;
+    json result = {
+        {"info_hash",
+         hex_string(reinterpret_cast<const unsigned char *>(
+                        entry.meta.info_hash.data()),
+                    SHA_DIGEST_LENGTH)},
+        {"name", entry.name},
+        {"path", entry.path},
+        {"state", state_name(entry.state)},
+        {"priority", entry.priority},
+        {"length", entry.meta.length},
+        {"left", entry.left},
+        {"pieces", entry.pieces},
+        {"num_pieces", entry.meta.num_pieces},
+        {"downloaded", counters.downloaded},
+        {"uploaded", counters.uploaded},
+        {"download_rate", counters.download_rate},
+        {"upload_rate", counters.upload_rate},
+        {"connections", counters.connections},
+        {"download_limit", entry.limits.download},
+        {"upload_limit", entry.limits.upload},
+        {"stalled", stalled(entry, std::chrono::steady_clock::now())},
+        {"seeders", entry.scraped.seeders},
+        {"leechers", entry.scraped.leechers}};
+    if (entry.state == torrent_state::error)
+      result["error"] = entry.error;
+    return result;
+  }
+
+  void schedule_sample() {
+    sample_timer_ = loop_.schedule(
+        std::chrono::milliseconds(sample_interval_ms), [this] {
+          sample();
+          schedule_sample();
+        });
+  }
+
+  // fold each swarm's byte counts into rates and the session totals, so
+  // stats requests only read what is here
+  void sample() {
+    auto now = std::chrono::steady_clock::now();
+    double elapsed = std::max(
+        std::chrono::duration<double>(now - last_sample_).count(), 1e-3);
+    last_sample_ = now;
+    transfer_counters totals;
+    totals.downloaded = totals_.downloaded;
+    totals.uploaded = totals_.uploaded;
+    for (auto &item : torrents_) {
+      torrent_entry &entry = *item.second;
+      transfer_counters &counters = entry.counters;
+      if (!entry.swarm)
+        continue;
+      uint64_t downloaded = entry.swarm->bytes_downloaded() - entry.sampled_downloaded;
+      uint64_t uploaded = entry.swarm->bytes_uploaded() - entry.sampled_uploaded;
+      entry.sampled_downloaded += downloaded;
+      entry.sampled_uploaded += uploaded;
+      counters.download_rate = downloaded / elapsed;
+      counters.upload_rate = uploaded / elapsed;
+      counters.downloaded += downloaded;
+      counters.uploaded += uploaded;
+      totals.downloaded += downloaded;
+      totals.uploaded += uploaded;
+      counters.connections = entry.manager->connections();
+      entry.pieces = entry.swarm->pieces_have();
+      totals.download_rate += counters.download_rate;
+      totals.upload_rate += counters.upload_rate;
+      totals.connections += counters.connections;
+      double rate = entry.state == torrent_state::seeding
+                        ? counters.upload_rate
+                        : counters.download_rate;
+      if (rate >= options_.stall_rate) {
+        entry.last_busy = now;
+        entry.stalled_for = 0.0;
+      } else if (entry.state == torrent_state::downloading) {
+        entry.stalled_for += elapsed;
+        if (options_.give_up_sec > 0.0 &&
+            entry.stalled_for >= options_.give_up_sec)
+          fail(entry, "Stalled for " +
+                          std::to_string(std::lround(entry.stalled_for)) +
+                          " seconds");
+      }
+    }
+    totals_ = totals;
+    manage_queue();
+  }
+
+  // a running torrent that moved too little for too long
+  bool stalled(const torrent_entry &entry,
+               std::chrono::steady_clock::time_point now) const {
+    return entry.swarm && now - entry.last_busy >= std::chrono::seconds(stall_sec);
+  }
+
+  // the order queued torrents start in: the user's priority first, then
+  // what the trackers say about the swarm
+  static bool ranks_before(const torrent_entry &a, const torrent_entry &b) {
+    if (a.priority != b.priority)
+      return a.priority > b.priority;
+    if (a.left == 0)
+      return seed_demand(a.scraped) > seed_demand(b.scraped);
+    return swarm_priority(a.scraped) > swarm_priority(b.scraped);
+  }
+
+  // scrape queued torrents so they can be ranked; running ones learn the
+  // same from their announces
+  void update_scrapes(std::chrono::steady_clock::time_point now) {
+    size_t pending = 0;
+    for (auto &item : torrents_) {
+      torrent_entry &entry = *item.second;
+      if (!entry.scrape.valid())
+        continue;
+      if (entry.scrape.wait_for(std::chrono::seconds(0)) !=
+          std::future_status::ready) {
+        pending++;
+        continue;
+      }
+      entry.scraped = best_swarm(entry.scrape.get());
+      entry.next_scrape = now + std::chrono::seconds(rescrape_sec);
+    }
+    for (auto &item : torrents_) {
+      torrent_entry &entry = *item.second;
+      if (pending >= max_scrapes)
+        break;
+      if (entry.state != torrent_state::queued || entry.scrape.valid() ||
+          now < entry.next_scrape)
+        continue;
+      entry.scrape = run_detached(
+          [torrent = entry.torrent, info_hash = entry.meta.info_hash] {
+            return scrape_all_trackers(
+                torrent, reinterpret_cast<const unsigned char *>(info_hash.data()));
+          });
+      pending++;
+    }
+  }
+
+  // keep the running downloads and seeds at their caps, best ranked
+  // first, and swap stalled ones for queued torrents that did not stall
+  // lately
+  void manage_queue() {
+    auto now = std::chrono::steady_clock::now();
+    update_scrapes(now);
+    balance(false, now);
+    balance(true, now);
+  }
+
+  void balance(bool seeds, std::chrono::steady_clock::time_point now) {
+    torrent_state running_state =
+        seeds ? torrent_state::seeding : torrent_state::downloading;
+    size_t cap = seeds ? options_.active_seeds : options_.active_downloads;
+    std::vector<torrent_entry *> running, waiting;
+    for (auto &item : torrents_) {
+      torrent_entry &entry = *item.second;
+      if (entry.state == running_state)
+        running.push_back(&entry);
+      else if (entry.state == torrent_state::queued && (entry.left == 0) == seeds)
+        waiting.push_back(&entry);
+    }
+    if (waiting.empty() && running.size() <= cap)
+      return;
+    std::stable_sort(waiting.begin(), waiting.end(),
+                     [now](const torrent_entry *a, const torrent_entry *b) {
+                       bool a_ready = a->retry_at <= now;
+                       bool b_ready = b->retry_at <= now;
+                       if (a_ready != b_ready)
+                         return a_ready;
+                       return ranks_before(*a, *b);
+                     });
+    std::stable_sort(running.begin(), running.end(),
+                     [](const torrent_entry *a, const torrent_entry *b) {
+                       return ranks_before(*a, *b);
+                     });
+    size_t next = 0;
+    auto promote = [&] {
+      torrent_entry &entry = *waiting[next++];
+      activate(entry);
+      running.push_back(&entry);
+    };
+    for (size_t i = 0; i < running.size() && next < waiting.size(); ++i) {
+      torrent_entry &entry = *running[i];
+      if (!stalled(entry, now) || waiting[next]->retry_at > now)
+        continue;
+      std::cout << "Queued stalled " << entry.path << std::endl;
+      deactivate(entry);
+      entry.retry_at = now + std::chrono::seconds(stall_retry_sec);
+      running.erase(running.begin() + i--);
+      promote();
+    }
+    while (running.size() < cap && next < waiting.size())
+      promote();
+    // the cap went down: the lowest ranked wait again
+    while (running.size() > cap) {
+      torrent_entry &entry = *running.back();
+      running.pop_back();
+      deactivate(entry);
+      std::cout << "Queued " << entry.path << std::endl;
+    }
+  }
+
+  // one torrent's failure leaves the others running
+  void fail(torrent_entry &entry, const std::string &reason) {
+    std::cerr << entry.name << " failed: " << reason << std::endl;
+    stop(entry);
+    entry.state = torrent_state::error;
+    entry.error = reason;
+  }
+
+  options options_;
+  // declared before the torrents, which use all of these
+  event_loop loop_;
+  std::unique_ptr<peer_listener> listener_;
+  uint16_t port_ = default_listen_port;
+  std::unique_ptr<udp_socket> udp_;
+  std::unique_ptr<utp_socket_manager> utp_;
+  std::unique_ptr<dht_node> dht_;
+  worker_pool hash_pool_;
+  worker_pool disk_pool_;
+  buffer_budget budget_;
+  token_bucket download_limit_;
+  token_bucket upload_limit_;
+  request_slots slots_;
+  std::map<std::string, std::unique_ptr<torrent_entry>> torrents_;
+  transfer_counters totals_;
+  std::chrono::steady_clock::time_point last_sample_ =
+      std::chrono::steady_clock::now();
+  event_loop::timer_id sample_timer_ = 0;
+};
+
+// a count given on the command line, which must be a whole number from
+// minimum to maximum
+size_t parse_count(const char *text, int64_t minimum,
+                   int64_t maximum = std::numeric_limits<int64_t>::max()) {
+  int64_t count = 0;
+  try {
+    count = std::stoll(text);
+  } catch (const std::exception &) {
+    throw std::runtime_error("Invalid count " + std::string(text));
+  }
+  if (count < minimum || count > maximum)
+    throw std::runtime_error("Invalid count " + std::string(text));
+  return static_cast<size_t>(count);
+}
+
+const char *session_usage =
+    "-o <directory> [--max-connections N] [--max-memory MiB] "
+    "[--stall-rate KiB/s]";
+
+// take an option that session and download-batch share at argv[arg] and
+// its value; false if there is none
+bool parse_session_option(int argc, char *argv[], int &arg,
+                          torrent_session::options &options) {
+  if (parse_rate_option(argc, argv, arg, options.bandwidth) ||
+      parse_queue_depth_option(argc, argv, arg, options.queue_depth))
+    return true;
+  if (arg + 1 >= argc)
+    return false;
+  std::string option = argv[arg];
+  if (option == "-o")
+    options.directory = argv[arg + 1];
+  else if (option == "--max-connections")
+    options.max_connections = parse_count(argv[arg + 1], 1);
+  else if (option == "--max-memory") // in MiB, so the bytes must still fit
+    options.max_memory =
+        parse_count(argv[arg + 1], 1, std::numeric_limits<int64_t>::max() >> 20)
+        << 20;
+  else if (option == "--stall-rate")
+    options.stall_rate = std::stod(argv[arg + 1]) * 1024.0;
+  else
+    return false;
+  arg += 2;
+  return true;
+}
+
+// whether the shared options describe a session that can run
+bool valid_session_options(const torrent_session::options &options) {
+  return !options.directory.empty() && options.max_connections > 0 &&
+         options.max_memory > 0 && options.active_downloads > 0 &&
+         options.stall_rate >= 0;
+}
+
+// Control API
+
+// a control request that failed, with its JSON-RPC error code
+class rpc_error : public std::runtime_error {
+public:
+  rpc_error(int code, const std::string &message)
+      : std::runtime_error(message), code_(code) {}
+  int code() const { return code_; }
+
+private:
+  int code_;
+};
+
+// JSON-RPC 2.0 codes
+constexpr int rpc_parse_error = -32700;
+constexpr int rpc_invalid_request = -32600;
+constexpr int rpc_method_not_found = -32601;
+constexpr int rpc_invalid_params = -32602;
+constexpr int rpc_server_error = -32000;
+
+// JSON-RPC 2.0 over a Unix domain socket, one request or response per
+// line. Requests are answered in order on the event loop, so a handler
+// sees the session between two ticks
+class control_server {
+public:
+  using method_handler =
+      std::function<json(const std::string &method, const json &params)>;
+
+  control_server(event_loop &loop, const std::string &path,
+                 method_handler handler)
+      : loop_(loop), path_(path), handler_(std::move(handler)) {
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (path.empty() || path.size() >= sizeof(addr.sun_path))
+      throw std::runtime_error("Invalid control socket path " + path);
+    std::copy(path.begin(), path.end(), addr.sun_path);
+    // a socket left behind by a session that did not shut down cleanly
+    struct stat info;
+    if (lstat(path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode))
+      unlink(path.c_str());
+    fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd_ < 0)
+      throw std::runtime_error("Failed to create control socket");
+    // only the user running the session may control it
+    mode_t mask = umask(0077);
+    int bound = bind(fd_, reinterpret_cast<sockaddr *>(&addr), sizeof(addr));
+    umask(mask);
+    if (bound < 0 || listen(fd_, listen_backlog) < 0) {
+      close(fd_);
+      throw std::runtime_error("Failed to listen on " + path);
+    }
+    loop_.add(fd_, EPOLLIN, [this](uint32_t) { on_accept(); });
+  }
+
+  ~control_server() {
+    for (auto &entry : clients_) {
+      loop_.remove(entry.first);
+      close(entry.first);
+    }
+    loop_.remove(fd_);
+    close(fd_);
+    unlink(path_.c_str());
+  }
+  control_server(const control_server &) = delete;
+  control_server &operator=(const control_server &) = delete;
+
+private:
+  static constexpr int listen_backlog = 16;
+  static constexpr size_t max_clients = 16;
+  static constexpr size_t max_request_size = 1 << 20;
+
+  struct client {
+    std::string in;
+    std::string out;
+  };
+
+  void on_accept() {
+    while (true) {
+      int fd = accept4(fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+      if (fd < 0)
+        return;
+      if (clients_.size() >= max_clients) {
+        close(fd);
+        continue;
+      }
+      clients_[fd] = client{};
+      loop_.add(fd, EPOLLIN, [this, fd](uint32_t events) {
+        if (!on_client(fd, events))
+          drop(fd);
+      });
+    }
+  }
+
+  // false once the client is gone or broke the protocol
+  bool on_client(int fd, uint32_t events) {
+    client &c = clients_.at(fd);
+    if (events & (EPOLLIN | EPOLLERR | EPOLLHUP)) {
+      char buffer[65536];
+      ssize_t bytes = recv(fd, buffer, sizeof(buffer), 0);
+      if (bytes == 0)
+        return false;
+      if (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+        return false;
+      if (bytes > 0)
+        c.in.append(buffer, bytes);
+      size_t end;
+      while ((end = c.in.find('\n')) != std::string::npos) {
+        std::string line = c.in.substr(0, end);
+        c.in.erase(0, end + 1);
+        if (line.find_first_not_of(" \t\r") == std::string::npos)
+          continue;
+        std::optional<json> response = answer(line);
+        if (response)
+          c.out += response->dump() + "\n";
+      }
+      if (c.in.size() > max_request_size)
+        return false;
+    }
+    while (!c.out.empty()) {
+      ssize_t sent = send(fd, c.out.data(), c.out.size(), MSG_NOSIGNAL);
+      if (sent < 0) {
+        if (errno != EAGAIN && errno != EWOULDBLOCK)
+          return false;
+        break;
+      }
+      c.out.erase(0, sent);
+    }
+    loop_.modify(fd, EPOLLIN |
+                         (c.out.empty() ? 0 : static_cast<uint32_t>(EPOLLOUT)));
+    return true;
+  }
+
+  void drop(int fd) {
+    loop_.remove(fd);
+    close(fd);
+    clients_.erase(fd);
+  }
+
+  // the response to one request line; none for notifications
+  std::optional<json> answer(const std::string &line) {
+    json id = nullptr;
+    try {
+      json request;
+      try {
+        request = json::parse(line);
+      } catch (const json::exception &) {
+        throw rpc_error(rpc_parse_error, "Parse error");
+      }
+      if (!request.is_object() || !request.contains("method") ||
+          !request["method"].is_string())
+        throw rpc_error(rpc_invalid_request, "Invalid request");
+      bool notification = !request.contains("id");
+      if (!notification)
+        id = request["id"];
+      json params = request.value("params", json::object());
+      json result = handler_(request["method"].get<std::string>(), params);
+      if (notification)
+        return std::nullopt;
+      return json{{"jsonrpc", "2.0"}, {"id", id}, {"result", result}};
+    } catch (const rpc_error &e) {
+      return error_response(id, e.code(), e.what());
+    } catch (const json::exception &e) {
+      return error_response(id, rpc_invalid_params, e.what());
+    } catch (const std::exception &e) {
+      return error_response(id, rpc_server_error, e.what());
+    }
+  }
+
+  static json error_response(const json &id, int code,
+                             const std::string &message) {
+    return {{"jsonrpc", "2.0"},
+            {"id", id},
+            {"error", {{"code", code}, {"message", message}}}};
+  }
+
+  event_loop &loop_;
+  std::string path_;
+  method_handler handler_;
+  int fd_ = -1;
+  std::unordered_map<int, client> clients_;
+};
+
+// a torrent named over the control API: a .torrent file, or a magnet
+// link whose metadata is already cached. Fetching metadata runs its own
+// event loop, which the session cannot wait on
+json load_control_torrent(const std::string &source) {
+  if (!is_magnet_link(source))
+    return load_torrent(source);
+  magnet_link link = parse_magnet_link(source);
+  std::optional<std::string> info = load_cached_metadata(link.info_hash);
+  if (!info)
+    throw rpc_error(rpc_invalid_params, "Metadata for the magnet link is not cached");
+  json torrent = magnet_torrent(link);
+  torrent["info"] = decode_bencoded_value(*info);
+  return torrent;
+}
+
+// the raw info hash in a request's params, given as 40 hex digits
+std::string control_info_hash(const json &params) {
+  std::string hex = params.at("info_hash").get<std::string>();
+  if (hex.size() != 2 * SHA_DIGEST_LENGTH ||
+      hex.find_first_not_of("0123456789abcdefABCDEF") != std::string::npos)
+    throw rpc_error(rpc_invalid_params, "Invalid info hash");
+  return decode_hex(hex);
+}
+
+// caps in bytes per second from a request's params; absent ones keep
+// their current value
+rate_limits control_rate_limits(const json &params, rate_limits limits) {
+  for (auto [key, target] : {std::pair{"download", &limits.download},
+                             std::pair{"upload", &limits.upload}}) {
+    if (!params.contains(key))
+      continue;
+    double rate = params[key].get<double>();
+    if (rate < 0.0)
+      throw rpc_error(rpc_invalid_params, "Rate limits cannot be negative");
+    *target = rate;
+  }
+  return limits;
+}
+
+// a count in a request's params, which must be a whole number no smaller
+// than minimum
+size_t control_count(const json &params, const char *key, int64_t minimum) {
+  const json &value = params.at(key);
+  if (!value.is_number_integer() || value.get<int64_t>() < minimum)
+    throw rpc_error(rpc_invalid_params,
+                    std::string(key) + " must be an integer of at least " +
+                        std::to_string(minimum));
+  return static_cast<size_t>(value.get<int64_t>());
+}
+
+// the control API's methods:
+//   add {torrent}                      -> {info_hash}
+//   remove {info_hash}
+//   set_priority {info_hash, priority}
+//   set_limits {[info_hash], [download], [upload], [max_connections],
+//               [active_downloads], [active_seeds]}
+//   stats {[info_hash]}                -> session or torrent counters
+json handle_control_request(torrent_session &session, const std::string &method,
+                            const json &params) {
+  if (!params.is_object())
+    throw rpc_error(rpc_invalid_params, "Params must be an object");
+  if (method == "add") {
+    std::string info_hash = session.add_torrent(
+        load_control_torrent(params.at("torrent").get<std::string>()));
+    return {{"info_hash",
+             hex_string(reinterpret_cast<const unsigned char *>(info_hash.data()),
+                        SHA_DIGEST_LENGTH)}};
+  }
+  if (method == "remove") {
+    session.remove_torrent(control_info_hash(params));
+    return json::object();
+  }
+  if (method == "set_priority") {
+    session.set_priority(control_info_hash(params),
+                         params.at("priority").get<double>());
+    return json::object();
+  }
+  if (method == "set_limits") {
+    if (params.contains("info_hash")) {
+      std::string info_hash = control_info_hash(params);
+      session.set_torrent_limits(
+          info_hash,
+          control_rate_limits(params, session.torrent_limits(info_hash)));
+      return json::object();
+    }
+    session.set_rate_limits(
+        control_rate_limits(params, session.global_limits()));
+    if (params.contains("max_connections"))
+      session.set_max_connections(control_count(params, "max_connections", 1));
+    if (params.contains("active_downloads") || params.contains("active_seeds")) {
+      auto [downloads, seeds] = session.active_limits();
+      if (params.contains("active_downloads"))
+        downloads = control_count(params, "active_downloads", 1);
+      if (params.contains("active_seeds"))
+        seeds = control_count(params, "active_seeds", 0);
+      session.set_active_limits(downloads, seeds);
+    }
+    return json::object();
+  }
+  if (method == "stats") {
+    if (params.contains("info_hash"))
+      return session.stats(control_info_hash(params));
+    return session.stats();
+  }
+  throw rpc_error(rpc_method_not_found, "Method not found");
+}
+
+// saturate a shared upload bucket and a shared pool of request slots with
+// one flow per weight and print the share each flow achieved; returns the
+// largest deviation from the weights, relative to the expected share
+double run_share_test(const std::vector<double> &weights, double rate,
+                      double seconds, size_t slots) {
+  event_loop loop;
+  double total_weight = 0.0;
+  for (double weight : weights)
+    total_weight += weight;
+  auto warm_up = std::chrono::seconds(1);
+  auto start = std::chrono::steady_clock::now();
+  auto measure_from = start + warm_up;
+  auto measure_until =
+      measure_from + std::chrono::milliseconds(static_cast<int64_t>(seconds * 1000));
+  auto measuring = [&] {
+    auto now = std::chrono::steady_clock::now();
+    return now >= measure_from && now < measure_until;
+  };
+
+  // bandwidth: each flow is a torrent bucket under the shared one with a
+  // few peers, each a socket pair whose writer sends whatever its chain
+  // allows
+  constexpr int peers_per_flow = 3;
+  struct test_peer {
+    token_bucket bucket;
+    int writer = -1;
+    int reader = -1;
+    size_t flow = 0;
+    event_loop::timer_id timer = 0;
+  };
+  token_bucket shared;
+  shared.share_by_weight();
+  shared.set_rate(rate);
+  std::vector<std::unique_ptr<token_bucket>> flows;
+  std::vector<std::unique_ptr<test_peer>> peers;
+  std::vector<int64_t> bytes(weights.size(), 0);
+  std::vector<char> payload(256 * 1024, 'x');
+  for (size_t f = 0; f < weights.size(); ++f) {
+    flows.push_back(std::make_unique<token_bucket>());
+    flows.back()->set_parent(&shared, weights[f]);
+    for (int i = 0; i < peers_per_flow; ++i) {
+      auto peer = std::make_unique<test_peer>();
+      int fds[2];
+      if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                     fds) < 0)
+        throw std::runtime_error("Failed to create socket pair");
+      peer->writer = fds[0];
+      peer->reader = fds[1];
+      peer->flow = f;
+      peer->bucket.set_parent(flows.back().get());
+      peers.push_back(std::move(peer));
+    }
+  }
+  std::function<void(test_peer &)> pump = [&](test_peer &peer) {
+    auto now = std::chrono::steady_clock::now();
+    size_t batch = peer.bucket.batch_size();
+    size_t allowed = peer.bucket.available(now);
+    if (allowed < batch) {
+      // wait for the tokens instead of spinning on a writable socket
+      loop.modify(peer.writer, 0);
+      if (peer.timer == 0) {
+        peer.timer = loop.schedule(
+            std::max(peer.bucket.delay(batch, now), std::chrono::milliseconds(1)),
+            [&loop, &peer] {
+              peer.timer = 0;
+              loop.modify(peer.writer, EPOLLOUT);
+            });
+      }
+      return;
+    }
+    ssize_t sent = send(peer.writer, payload.data(),
+                        std::min(allowed, payload.size()), MSG_NOSIGNAL);
+    if (sent > 0)
+      peer.bucket.consume(sent);
+  };
+  for (auto &peer : peers) {
+    test_peer &p = *peer;
+    loop.add(p.writer, EPOLLOUT, [&pump, &p](uint32_t) { pump(p); });
+    loop.add(p.reader, EPOLLIN, [&, fd = p.reader, flow = p.flow](uint32_t) {
+      char buffer[65536];
+      ssize_t received;
+      while ((received = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+        if (measuring())
+          bytes[flow] += received;
+      }
+    });
+  }
+
+  // request slots: every flow keeps asking, and each slot it gets is held
+  // for one timer tick, like a block request out to a peer
+  request_slots pool(slots);
+  std::vector<size_t> slot_flows;
+  std::vector<int64_t> requests(weights.size(), 0);
+  std::vector<bool> granted(weights.size(), true);
+  for (size_t f = 0; f < weights.size(); ++f)
+    slot_flows.push_back(pool.add_flow(weights[f], [&granted, f] {
+      granted[f] = true;
+    }));
+  std::function<void(size_t)> fill = [&](size_t f) {
+    while (pool.acquire(slot_flows[f])) {
+      loop.schedule(std::chrono::milliseconds(1), [&, f] {
+        if (measuring())
+          requests[f]++;
+        pool.release(slot_flows[f]);
+      });
+    }
+  };
+  // grants arrive while the pool is busy handing slots out, so the flows
+  // ask again before the loop next waits
+  uint64_t flusher = loop.add_flusher([&] {
+    for (size_t f = 0; f < weights.size(); ++f) {
+      if (granted[f]) {
+        granted[f] = false;
+        fill(f);
+      }
+    }
+  });
+
+  while (std::chrono::steady_clock::now() < measure_until)
+    loop.run_once(10);
+  loop.remove_flusher(flusher);
+  for (auto &peer : peers) {
+    loop.cancel(peer->timer);
+    loop.remove(peer->writer);
+    loop.remove(peer->reader);
+    close(peer->writer);
+    close(peer->reader);
+  }
+
+  int64_t total_bytes = 0, total_requests = 0;
+  for (size_t f = 0; f < weights.size(); ++f) {
+    total_bytes += bytes[f];
+    total_requests += requests[f];
+  }
+  double worst = 0.0;
+  std::cout << std::fixed << std::setprecision(1);
+  std::cout << "Upload shared at " << rate / 1024 << " KiB/s:" << std::endl;
+  for (size_t f = 0; f < weights.size(); ++f) {
+    double expected = weights[f] / total_weight;
+    double share = total_bytes > 0 ? static_cast<double>(bytes[f]) / total_bytes : 0.0;
+    worst = std::max(worst, std::abs(share - expected) / expected);
+    std::cout << "  weight " << weights[f] << ": "
+              << bytes[f] / seconds / 1024 << " KiB/s, " << share * 100
+              << "% (expected " << expected * 100 << "%)" << std::endl;
+  }
+  std::cout << slots << " request slots shared:" << std::endl;
+  for (size_t f = 0; f < weights.size(); ++f) {
+    double expected = weights[f] / total_weight;
+    double share = total_requests > 0
+                       ? static_cast<double>(requests[f]) / total_requests
+                       : 0.0;
+    worst = std::max(worst, std::abs(share - expected) / expected);
+    std::cout << "  weight " << weights[f] << ": "
+              << requests[f] / seconds << " requests/s, " << share * 100
+              << "% (expected " << expected * 100 << "%)" << std::endl;
+  }
+  return worst;
+}
+
+// push data through the nested global, torrent and peer buckets in both
+// directions, one socket pair per peer, and print the rate each direction
+// achieved; returns the largest deviation from its cap, relative to the cap
+double run_limit_test(const bandwidth_options &limits, int peer_count,
+                      double seconds) {
+  event_loop loop;
+  auto warm_up = std::chrono::seconds(1);
+  auto start = std::chrono::steady_clock::now();
+  auto measure_from = start + warm_up;
+  auto measure_until =
+      measure_from + std::chrono::milliseconds(static_cast<int64_t>(seconds * 1000));
+  auto measuring = [&] {
+    auto now = std::chrono::steady_clock::now();
+    return now >= measure_from && now < measure_until;
+  };
+
+  // a peer's bucket caps the writer for uploads and the reader for
+  // downloads, as a peer session does; the other end never waits
+  struct test_peer {
+    token_bucket bucket;
+    int writer = -1;
+    int reader = -1;
+    bool upload = false;
+    event_loop::timer_id timer = 0;
+  };
+  token_bucket global[2], torrent[2];
+  std::vector<std::unique_ptr<test_peer>> peers;
+  int64_t bytes[2] = {0, 0};
+  std::vector<char> payload(256 * 1024, 'x');
+  for (int direction = 0; direction < 2; ++direction) {
+    bool upload = direction == 1;
+    global[direction].set_rate(upload ? limits.global.upload
+                                      : limits.global.download);
+    torrent[direction].set_parent(&global[direction]);
+    for (int i = 0; i < peer_count; ++i) {
+      auto peer = std::make_unique<test_peer>();
+      int fds[2];
+      if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0,
+                     fds) < 0)
+        throw std::runtime_error("Failed to create socket pair");
+      peer->writer = fds[0];
+      peer->reader = fds[1];
+      peer->upload = upload;
+      peer->bucket.set_parent(&torrent[direction]);
+      peer->bucket.set_rate(upload ? limits.peer.upload : limits.peer.download);
+      peers.push_back(std::move(peer));
+    }
+  }
+
+  // move what the peer's chain allows, or stop watching its capped end
+  // until a whole batch may pass
+  std::function<void(test_peer &)> pump = [&](test_peer &peer) {
+    int fd = peer.upload ? peer.writer : peer.reader;
+    uint32_t events = peer.upload ? EPOLLOUT : EPOLLIN;
+    auto now = std::chrono::steady_clock::now();
+    size_t batch = peer.bucket.batch_size();
+    size_t allowed = peer.bucket.available(now);
+    if (allowed < batch) {
+      loop.modify(fd, 0);
+      if (peer.timer == 0) {
+        peer.timer = loop.schedule(
+            std::max(peer.bucket.delay(batch, now), std::chrono::milliseconds(1)),
+            [&loop, &peer, fd, events] {
+              peer.timer = 0;
+              loop.modify(fd, events);
+            });
+      }
+      return;
+    }
+    allowed = std::min(allowed, payload.size());
+    ssize_t moved = peer.upload
+                        ? send(fd, payload.data(), allowed, MSG_NOSIGNAL)
+                        : recv(fd, payload.data(), allowed, 0);
+    if (moved <= 0)
+      return;
+    peer.bucket.consume(moved);
+    if (!peer.upload && measuring())
+      bytes[0] += moved;
+  };
+  for (auto &peer : peers) {
+    test_peer &p = *peer;
+    if (p.upload) {
+      loop.add(p.writer, EPOLLOUT, [&pump, &p](uint32_t) { pump(p); });
+      loop.add(p.reader, EPOLLIN, [&, fd = p.reader](uint32_t) {
+        char buffer[65536];
+        ssize_t received;
+        while ((received = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+          if (measuring())
+            bytes[1] += received;
+        }
+      });
+    } else {
+      loop.add(p.writer, EPOLLOUT, [&payload, fd = p.writer](uint32_t) {
+        send(fd, payload.data(), payload.size(), MSG_NOSIGNAL);
+      });
+      loop.add(p.reader, EPOLLIN, [&pump, &p](uint32_t) { pump(p); });
+    }
+  }
+
+  while (std::chrono::steady_clock::now() < measure_until)
+    loop.run_once(10);
+  for (auto &peer : peers) {
+    loop.cancel(peer->timer);
+    loop.remove(peer->writer);
+    loop.remove(peer->reader);
+    close(peer->writer);
+    close(peer->reader);
+  }
+
+  // the tightest cap in the chain is the one that binds
+  double worst = 0.0;
+  std::cout << std::fixed << std::setprecision(1);
+  for (int direction = 0; direction < 2; ++direction) {
+    bool upload = direction == 1;
+    double expected = 0.0;
+    for (double cap :
+         {upload ? limits.global.upload : limits.global.download,
+          (upload ? limits.peer.upload : limits.peer.download) * peer_count}) {
+      if (cap > 0.0 && (expected == 0.0 || cap < expected))
+        expected = cap;
+    }
+    double achieved = bytes[direction] / seconds;
+    std::cout << (upload ? "Upload" : "Download") << " over " << peer_count
+              << " peers: " << achieved / 1024 << " KiB/s";
+    if (expected == 0.0) {
+      std::cout << " (unlimited)" << std::endl;
+      continue;
+    }
+    double deviation = std::abs(achieved - expected) / expected;
+    worst = std::max(worst, deviation);
+    std::cout << " (capped at " << expected / 1024 << " KiB/s, "
+              << deviation * 100 << "% off)" << std::endl;
+  }
+  return worst;
+}
+
+// main function logic
+
+int main(int argc, char *argv[]) {
+  // flush after every cerr and cout
+  std::cout << std::unitbuf;
+  std::cerr << std::unitbuf;
+  // trackers are contacted from several threads at once
+  curl_global_init(CURL_GLOBAL_DEFAULT);
+  // sendfile has no MSG_NOSIGNAL, so a peer hanging up must not kill us
+  signal(SIGPIPE, SIG_IGN);
+
+  // check if there is a command or not and then store it
+  if (argc < 2) {
+    std::cerr << "Usage: " << argv[0] << " <command> [args]" << std::endl;
+    return 1;
+  }
+  std::string command = argv[1];
+
+  // info command function
+  if (command == "info") {
+    if (argc < 3) {
+      std::cerr << "Usage: " << argv[0] << " info <torrent_file|magnet>"
+                << std::endl;
+      return 1;
+    }
+
+    try {
+      json torrent = load_torrent(argv[2]);
+      std::string tracker_url = tracker_urls(torrent).front();
+      if (!torrent.contains("info") || !torrent["info"].is_object()) {
+        throw std::runtime_error("Missing or invalid 'info' field");
+      }
+      json info = torrent["info"];
+      if (!info.contains("length") || !info["length"].is_number()) {
+        throw std::runtime_error("Missing or invalid 'length' field");
+      }
+      if (!info.contains("piece length") || !info["piece length"].is_number()) {
+        throw std::runtime_error("Missing or invalid 'piece length' field");
+      }
+      if (!info.contains("pieces") || !info["pieces"].is_string()) {
+        throw std::runtime_error("Missing or invalid 'pieces' field");
+      }
+
+      int64_t length = info["length"].get<int64_t>();
+      int64_t piece_length = info["piece length"].get<int64_t>();
+      std::string pieces = info["pieces"].get<std::string>();
+      std::string bencoded_info = bencode(info);
+      unsigned char hash[SHA_DIGEST_LENGTH];
+      SHA1(reinterpret_cast<const unsigned char *>(bencoded_info.c_str()),
+           bencoded_info.size(), hash);
+
+      std::stringstream hex_hash;
+      hex_hash << std::hex << std::setfill('0');
+      for (int i = 0; i < SHA_DIGEST_LENGTH; ++i) {
+        hex_hash << std::setw(2) << static_cast<int>(hash[i]);
+      }
+
+      if (pieces.size() % 20 != 0) {
+        throw std::runtime_error("Invalid pieces string length");
+      }
+      std::vector<std::string> piece_hashes;
+      for (size_t i = 0; i < pieces.size(); i += 20) {
+        std::stringstream hex_piece;
+        hex_piece << std::hex << std::setfill('0');
+        for (size_t j = 0; j < 20; ++j) {
+          hex_piece << std::setw(2)
+                    << static_cast<int>(
+                           static_cast<unsigned char>(pieces[i + j]));
+        }
+        piece_hashes.push_back(hex_piece.str());
+      }
+
+      std::cout << "Tracker URL: " << tracker_url << std::endl;
+      std::cout << "Length: " << length << std::endl;
+      std::cout << "Info Hash: " << hex_hash.str() << std::endl;
+      std::cout << "Piece Length: " << piece_length << std::endl;
+      std::cout << "Piece Hashes:" << std::endl;
+      for (const auto &hash : piece_hashes) {
+        std::cout << hash << std::endl;
+      }
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << std::endl;
       return 1;
     }
-    std::string output_file = argv[3];
-    std::string torrent_file = argv[4];
-
-    std::ifstream file(torrent_file, std::ios::binary);
-    if (!file) {
-      std::cerr << "Error: Could not open file " << torrent_file << std::endl;
+  }
+  // peers command handle
+  else if (command == "peers") {
+    if (argc < 3) {
+      std::cerr << "Usage: " << argv[0] << " peers <torrent_file|magnet>"
+                << std::endl;
       return 1;
     }
-    std::string encoded_value((std::istreambuf_iterator<char>(file)), {});
 
     try {
-      json torrent = decode_bencoded_value(encoded_value);
+      json torrent = load_torrent(argv[2]);
       if (!torrent.contains("info") || !torrent["info"].is_object()) {
         throw std::runtime_error("Missing or invalid 'info' field");
       }
@@ -747,121 +9219,253 @@ int main(int argc, char *argv[]) {
       if (!info.contains("length") || !info["length"].is_number()) {
         throw std::runtime_error("Missing or invalid 'length' field");
       }
-      if (!info.contains("piece length") || !info["piece length"].is_number()) {
-        throw std::runtime_error("Missing or invalid 'piece length' field");
-      }
-      if (!info.contains("pieces") || !info["pieces"].is_string()) {
-        throw std::runtime_error("Missing or invalid 'pieces' field");
-      }
-
-      int64_t file_length = info["length"].get<int64_t>();
-      int piece_length = info["piece length"].get<int64_t>();
-      std::string pieces = info["pieces"].get<std::string>();
-      std::string tracker_url = select_tracker_url(torrent);
 
+      int64_t length = info["length"].get<int64_t>();
       std::string bencoded_info = bencode(info);
-      unsigned char info_hash[SHA_DIGEST_LENGTH];
+      unsigned char hash[SHA_DIGEST_LENGTH];
       SHA1(reinterpret_cast<const unsigned char *>(bencoded_info.c_str()),
-           bencoded_info.size(), info_hash);
-
-      std::string encoded_info_hash =
-          url_encode_info_hash(info_hash, SHA_DIGEST_LENGTH);
-      std::string peer_id = "-CC0001-123456789012";
-      std::string query = tracker_url + "?info_hash=" + encoded_info_hash +
-                          "&peer_id=" + peer_id +
-                          "&port=6881&uploaded=0&downloaded=0&left=" +
-                          std::to_string(file_length) + "&compact=1";
-
-      CURL *curl = curl_easy_init();
-      if (!curl)
-        throw std::runtime_error("Failed to initialize CURL");
-      std::string response;
-      curl_easy_setopt(curl, CURLOPT_URL, query.c_str());
-      curl_easy_setopt(curl, CURLOPT_WRITEFUNCTION, write_callback);
-      curl_easy_setopt(curl, CURLOPT_WRITEDATA, &response);
-      CURLcode res = curl_easy_perform(curl);
-      if (res != CURLE_OK) {
-        curl_easy_cleanup(curl);
-        throw std::runtime_error("CURL request failed: " +
-                                 std::string(curl_easy_strerror(res)));
-      }
-      curl_easy_cleanup(curl);
-
-      json tracker_response = decode_bencoded_value(response);
-      if (!tracker_response.contains("peers") ||
-          !tracker_response["peers"].is_string()) {
-        throw std::runtime_error("Invalid 'peers' field: expected string");
-      }
-      std::string peers = tracker_response["peers"].get<std::string>();
-      std::vector<std::pair<std::string, uint16_t>> peers_list;
-      if (peers.size() % 6 == 0) {
-        for (size_t i = 0; i < peers.size(); i += 6) {
-          std::string ip =
-              std::to_string(static_cast<unsigned char>(peers[i])) + "." +
-              std::to_string(static_cast<unsigned char>(peers[i + 1])) + "." +
-              std::to_string(static_cast<unsigned char>(peers[i + 2])) + "." +
-              std::to_string(static_cast<unsigned char>(peers[i + 3]));
-          uint16_t port = (static_cast<unsigned char>(peers[i + 4]) << 8) |
-                          static_cast<unsigned char>(peers[i + 5]);
-          peers_list.emplace_back(ip, port);
-        }
-      }
-
-      if (peers_list.empty())
-        throw std::runtime_error("No peers available");
-
-      std::vector<char> complete_file(file_length);
-      int num_pieces = (file_length + piece_length - 1) / piece_length;
-      for (int piece_index = 0; piece_index < num_pieces; ++piece_index) {
-        int current_piece_length =
-            piece_index == num_pieces - 1 && file_length % piece_length != 0
-                ? file_length % piece_length
-                : piece_length;
-
-        std::cout << "Downloading piece " << piece_index << "/"
-                  << num_pieces - 1 << std::endl;
-
-        bool piece_downloaded = false;
-        std::string temp_file = "/tmp/piece_" + std::to_string(piece_index);
-        for (size_t peer_idx = 0;
-             peer_idx < std::min<size_t>(3, peers_list.size()) &&
-             !piece_downloaded;
-             ++peer_idx) {
-          try {
-            exchange_peer_messages(
-                temp_file,
-                std::string(reinterpret_cast<char *>(info_hash),
-                            SHA_DIGEST_LENGTH),
-                peers_list[peer_idx], piece_index, current_piece_length,
-                pieces);
-
-            std::ifstream piece_file(temp_file, std::ios::binary);
-            if (!piece_file)
-              throw std::runtime_error("Failed to read piece");
-            piece_file.read(complete_file.data() + piece_index * piece_length,
-                            current_piece_length);
-            piece_file.close();
-            std::remove(temp_file.c_str());
-            piece_downloaded = true;
-            std::cout << "Piece " << piece_index << " downloaded" << std::endl;
-          } catch (const std::exception &e) {
-            std::cerr << "Failed with peer " << peers_list[peer_idx].first
-                      << ":" << peers_list[peer_idx].second << " - " << e.what()
-                      << std::endl;
-            std::remove(temp_file.c_str());
+           bencoded_info.size(), hash);
+
+      std::vector<peer_endpoint> peers_list =
+          discover_peers(torrent, hash, length).peers;
+      for (const auto &peer : peers_list) {
+        std::cout << format_endpoint(peer) << std::endl;
+      }
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+  // scrape command handle
+  else if (command == "scrape") {
+    if (argc < 3) {
+      std::cerr << "Usage: " << argv[0] << " scrape <torrent_file|magnet>..."
+                << std::endl;
+      return 1;
+    }
+
+    try {
+      struct scraped_torrent {
+        std::string file_name;
+        peer_discovery discovery;
+      };
+      std::vector<scraped_torrent> scraped;
+      for (int arg = 2; arg < argc; ++arg) {
+        // a magnet link already names the hash, so skip its metadata
+        json torrent;
+        unsigned char hash[SHA_DIGEST_LENGTH];
+        if (is_magnet_link(argv[arg])) {
+          magnet_link link = parse_magnet_link(argv[arg]);
+          torrent = magnet_torrent(link);
+          std::copy_n(link.info_hash.begin(), SHA_DIGEST_LENGTH, hash);
+        } else {
+          torrent = load_torrent(argv[arg]);
+          if (!torrent.contains("info") || !torrent["info"].is_object()) {
+            throw std::runtime_error("Missing or invalid 'info' field");
           }
+          std::string bencoded_info = bencode(torrent["info"]);
+          SHA1(reinterpret_cast<const unsigned char *>(bencoded_info.c_str()),
+               bencoded_info.size(), hash);
         }
-        if (!piece_downloaded) {
-          throw std::runtime_error("Failed to download piece " +
-                                   std::to_string(piece_index));
+
+        scraped_torrent entry;
+        entry.file_name = argv[arg];
+        entry.discovery.trackers = scrape_all_trackers(torrent, hash);
+        rank_trackers(entry.discovery.trackers);
+        entry.discovery.swarm = best_swarm(entry.discovery.trackers);
+        scraped.push_back(entry);
+      }
+
+      // list torrents in the order they would be queued
+      std::stable_sort(scraped.begin(), scraped.end(),
+                       [](const scraped_torrent &a, const scraped_torrent &b) {
+                         return swarm_priority(a.discovery.swarm) >
+                                swarm_priority(b.discovery.swarm);
+                       });
+      for (const auto &entry : scraped) {
+        const swarm_info &swarm = entry.discovery.swarm;
+        std::cout << entry.file_name << ": seeders " << swarm.seeders
+                  << ", leechers " << swarm.leechers << ", completed "
+                  << swarm.completed << ", connection limit "
+                  << connection_limit_for_swarm(swarm) << std::endl;
+        for (const auto &status : entry.discovery.trackers) {
+          std::cout << "  " << status.url << ": ";
+          if (status.error.empty()) {
+            std::cout << status.swarm.seeders << "/" << status.swarm.leechers
+                      << "/" << status.swarm.completed << std::endl;
+          } else {
+            std::cout << status.error << std::endl;
+          }
         }
       }
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+  // download peice handle
+  else if (command == "download_piece") {
+    if (argc < 6 || std::string(argv[2]) != "-o") {
+      std::cerr << "Usage: " << argv[0]
+                << " download_piece -o <save_path> <torrent_file|magnet> "
+                   "<piece_index>"
+                << std::endl;
+      return 1;
+    }
+    std::string saved_path = argv[3];
+    std::string file_name = argv[4];
+    int piece_index = std::atoi(argv[5]);
+
+    try {
+      json torrent = load_torrent(file_name);
+      torrent_meta meta = parse_torrent_meta(torrent);
+      if (piece_index < 0 || piece_index >= meta.num_pieces) {
+        throw std::runtime_error("Invalid piece index");
+      }
+      auto info_hash =
+          reinterpret_cast<const unsigned char *>(meta.info_hash.data());
+
+      event_loop loop;
+      std::unique_ptr<peer_listener> listener = open_listener(loop);
+      uint16_t port = listener ? listener->port() : default_listen_port;
+      std::unique_ptr<udp_socket> udp = open_udp(loop, port);
+      std::unique_ptr<utp_socket_manager> utp =
+          open_utp(loop, udp.get(), listener.get());
+      std::unique_ptr<dht_node> dht = open_dht(loop, udp.get());
+
+      // cached peers are tried while the trackers and the DHT are asked
+      peer_cache cache(info_hash);
+      peer_source source(torrent, info_hash, meta.length, port, cache,
+                         dht.get());
+
+      std::vector<bool> wanted(meta.num_pieces, false);
+      wanted[piece_index] = true;
+      torrent_swarm swarm(
+          loop, meta, wanted,
+          [&saved_path](int index, const std::vector<char> &piece) {
+            std::ofstream outfile(saved_path, std::ios::binary);
+            if (!outfile)
+              throw std::runtime_error("Failed to open output file");
+            outfile.write(piece.data(), piece.size());
+            outfile.close();
+            std::cout << "Piece " << index << " downloaded to " << saved_path
+                      << std::endl;
+          },
+          &cache);
+      connection_manager manager(loop, meta.info_hash, &cache,
+                                 [&swarm](int fd, const peer_handshake &peer,
+                                          const std::string &leftover) {
+                                   swarm.add_peer(fd, peer, leftover);
+                                 });
+      manager.set_utp(utp.get());
+      wire_swarm(swarm, manager);
+      if (listener) {
+        listener->add_torrent(meta.info_hash, manager.handshake(),
+                              [&manager](int fd, const peer_handshake &peer,
+                                         const std::string &leftover) {
+                                return manager.accept_inbound(fd, peer,
+                                                              leftover);
+                              });
+      }
+      run_swarm(loop, swarm, manager, source);
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+  // download handle
+  else if (command == "download") {
+    bandwidth_options bandwidth;
+    queue_depth_options queue_depth;
+    int arg = 2;
+    bool valid = true;
+    try {
+      while (parse_rate_option(argc, argv, arg, bandwidth) ||
+             parse_queue_depth_option(argc, argv, arg, queue_depth)) {
+      }
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+      valid = false;
+    }
+    if (!valid || argc - arg < 3 || std::string(argv[arg]) != "-o") {
+      std::cerr << "Usage: " << argv[0] << " download " << bandwidth_usage
+                << " " << queue_depth_usage
+                << " -o <output_file> <torrent_file|magnet>" << std::endl;
+      return 1;
+    }
+    std::string output_file = argv[arg + 1];
+    std::string torrent_file = argv[arg + 2];
+
+    try {
+      json torrent = load_torrent(torrent_file);
+      torrent_meta meta = parse_torrent_meta(torrent);
+      auto info_hash =
+          reinterpret_cast<const unsigned char *>(meta.info_hash.data());
+
+      event_loop loop;
+      std::unique_ptr<peer_listener> listener = open_listener(loop);
+      uint16_t port = listener ? listener->port() : default_listen_port;
+      std::unique_ptr<udp_socket> udp = open_udp(loop, port);
+      std::unique_ptr<utp_socket_manager> utp =
+          open_utp(loop, udp.get(), listener.get());
+      std::unique_ptr<dht_node> dht = open_dht(loop, udp.get());
 
-      std::ofstream outfile(output_file, std::ios::binary);
-      if (!outfile)
+      // cached peers are tried while the trackers and the DHT are asked
+      peer_cache cache(info_hash);
+      peer_source source(torrent, info_hash, meta.length, port, cache,
+                         dht.get());
+
+      // pieces finish in any order, so write each one at its offset
+      int out_fd = open(output_file.c_str(), O_RDWR | O_CREAT | O_TRUNC, 0644);
+      if (out_fd < 0)
+        throw std::runtime_error("Failed to write output file");
+      if (ftruncate(out_fd, meta.length) < 0) {
+        close(out_fd);
         throw std::runtime_error("Failed to write output file");
-      outfile.write(complete_file.data(), file_length);
-      outfile.close();
+      }
+
+      // caps for the whole process; this command runs a single torrent
+      token_bucket global_download, global_upload;
+      global_download.set_rate(bandwidth.global.download);
+      global_upload.set_rate(bandwidth.global.upload);
+
+      torrent_swarm swarm(
+          loop, meta, std::vector<bool>(meta.num_pieces, true),
+          [out_fd, &meta](int index, const std::vector<char> &piece) {
+            if (pwrite(out_fd, piece.data(), piece.size(),
+                       index * meta.piece_length) !=
+                static_cast<ssize_t>(piece.size()))
+              throw std::runtime_error("Failed to write output file");
+            std::cout << "Piece " << index << " downloaded" << std::endl;
+          },
+          &cache);
+      // finished pieces are uploaded to other peers while we download
+      swarm.set_storage(out_fd);
+      swarm.set_global_limits(&global_download, &global_upload);
+      swarm.set_rate_limits({}, bandwidth.peer);
+      swarm.set_queue_depth_bounds(queue_depth.min, queue_depth.max);
+      connection_manager manager(loop, meta.info_hash, &cache,
+                                 [&swarm](int fd, const peer_handshake &peer,
+                                          const std::string &leftover) {
+                                   swarm.add_peer(fd, peer, leftover);
+                                 });
+      manager.set_utp(utp.get());
+      wire_swarm(swarm, manager);
+      if (listener) {
+        listener->add_torrent(meta.info_hash, manager.handshake(),
+                              [&manager](int fd, const peer_handshake &peer,
+                                         const std::string &leftover) {
+                                return manager.accept_inbound(fd, peer,
+                                                              leftover);
+                              });
+      }
+      try {
+        run_swarm(loop, swarm, manager, source);
+      } catch (...) {
+        close(out_fd);
+        throw;
+      }
+      close(out_fd);
 
       std::cout << "Downloaded " << output_file << std::endl;
     } catch (const std::exception &e) {
@@ -869,6 +9473,610 @@ int main(int argc, char *argv[]) {
       return 1;
     }
   } 
+  // seed handle
+  else if (command == "seed") {
+    size_t upload_slots = 4;
+    bandwidth_options bandwidth;
+    int arg = 2;
+    bool valid = true;
+    try {
+      while (arg + 1 < argc) {
+        if (std::string(argv[arg]) == "--upload-slots") {
+          try {
+            upload_slots = std::stoul(argv[arg + 1]);
+          } catch (const std::exception &) {
+            upload_slots = 0;
+          }
+          arg += 2;
+        } else if (!parse_rate_option(argc, argv, arg, bandwidth)) {
+          break;
+        }
+      }
+    } catch (const std::exception &e) {
+      std::cerr << e.what() << std::endl;
+      valid = false;
+    }
+    if (!valid || argc - arg < 2 || upload_slots == 0) {
+      std::cerr << "Usage: " << argv[0] << " seed [--upload-slots N] "
+                << bandwidth_usage << " <file> <torrent_file|magnet>"
+                << std::endl;
+      return 1;
+    }
+    std::string data_file = argv[arg];
+    std::string torrent_file = argv[arg + 1];
+
+    try {
+      json torrent = load_torrent(torrent_file);
+      torrent_meta meta = parse_torrent_meta(torrent);
+      auto info_hash =
+          reinterpret_cast<const unsigned char *>(meta.info_hash.data());
+
+      int data_fd = open(data_file.c_str(), O_RDONLY);
+      if (data_fd < 0)
+        throw std::runtime_error("Failed to open " + data_file);
+
+      // only pieces that pass the hash check are offered to peers
+      std::vector<bool> verified = verify_pieces(data_fd, meta);
+      int64_t left = 0;
+      int missing = 0;
+      for (int i = 0; i < meta.num_pieces; ++i) {
+        if (!verified[i]) {
+          left += meta.piece_size(i);
+          missing++;
+        }
+      }
+      std::cout << "Verified " << meta.num_pieces - missing << "/"
+                << meta.num_pieces << " pieces" << std::endl;
+
+      event_loop loop;
+      std::unique_ptr<peer_listener> listener = open_listener(loop);
+      uint16_t port = listener ? listener->port() : default_listen_port;
+      std::unique_ptr<udp_socket> udp = open_udp(loop, port);
+      std::unique_ptr<utp_socket_manager> utp =
+          open_utp(loop, udp.get(), listener.get());
+      std::unique_ptr<dht_node> dht = open_dht(loop, udp.get());
+      peer_cache cache(info_hash);
+      peer_source source(torrent, info_hash, left, port, cache, dht.get());
+
+      // caps for the whole process; this command runs a single torrent
+      token_bucket global_download, global_upload;
+      global_download.set_rate(bandwidth.global.download);
+      global_upload.set_rate(bandwidth.global.upload);
+
+      // nothing is wanted, so the swarm only uploads
+      torrent_swarm swarm(
+          loop, meta, std::vector<bool>(meta.num_pieces, false),
+          [](int, const std::vector<char> &) {}, &cache);
+      swarm.add_verified(verified);
+      swarm.set_storage(data_fd);
+      swarm.set_upload_slots(upload_slots);
+      swarm.set_global_limits(&global_download, &global_upload);
+      swarm.set_rate_limits({}, bandwidth.peer);
+      connection_manager manager(loop, meta.info_hash, &cache,
+                                 [&swarm](int fd, const peer_handshake &peer,
+                                          const std::string &leftover) {
+                                   swarm.add_peer(fd, peer, leftover);
+                                 });
+      manager.set_utp(utp.get());
+      wire_swarm(swarm, manager);
+      if (listener) {
+        listener->add_torrent(meta.info_hash, manager.handshake(),
+                              [&manager](int fd, const peer_handshake &peer,
+                                         const std::string &leftover) {
+                                return manager.accept_inbound(fd, peer,
+                                                              leftover);
+                              });
+      }
+      std::cout << "Seeding on port " << port << std::endl;
+
+      signal(SIGINT, request_stop);
+      signal(SIGTERM, request_stop);
+      try {
+        run_seed(loop, swarm, manager, source, left);
+      } catch (...) {
+        close(data_fd);
+        throw;
+      }
+      close(data_fd);
+      std::cout << "Stopped seeding" << std::endl;
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+  // session handle
+  else if (command == "session") {
+    torrent_session::options options;
+    std::string control_path;
+    std::vector<std::string> sources;
+    bool valid = true;
+    int arg = 2;
+    try {
+      while (arg < argc) {
+        std::string option = argv[arg];
+        if (option == "--active-downloads" && arg + 1 < argc) {
+          options.active_downloads = parse_count(argv[arg + 1], 1);
+          arg += 2;
+        } else if (option == "--active-seeds" && arg + 1 < argc) {
+          options.active_seeds = parse_count(argv[arg + 1], 0);
+          arg += 2;
+        } else if (option == "--control" && arg + 1 < argc) {
+          control_path = argv[arg + 1];
+          arg += 2;
+        } else if (!parse_session_option(argc, argv, arg, options)) {
+          sources.push_back(option);
+          arg++;
+        }
+      }
+    } catch (const std::exception &) {
+      valid = false;
+    }
+    if (!valid || !valid_session_options(options) ||
+        (sources.empty() && control_path.empty())) {
+      std::cerr << "Usage: " << argv[0] << " session " << session_usage
+                << " [--active-downloads N] [--active-seeds N] "
+                   "[--control SOCKET] "
+                << bandwidth_usage << " " << queue_depth_usage
+                << " [torrent_file|magnet]..." << std::endl;
+      return 1;
+    }
+
+    try {
+      std::filesystem::create_directories(options.directory);
+      torrent_session session(options);
+      // a torrent that cannot be read is reported and the rest still run
+      for (const auto &source : sources) {
+        try {
+          session.add_torrent(load_torrent(source));
+        } catch (const std::exception &e) {
+          std::cerr << source << ": " << e.what() << std::endl;
+        }
+      }
+      // torrents come and go over the control socket
+      std::unique_ptr<control_server> control;
+      if (!control_path.empty()) {
+        control = std::make_unique<control_server>(
+            session.loop(), control_path,
+            [&session](const std::string &method, const json &params) {
+              return handle_control_request(session, method, params);
+            });
+      } else if (session.torrent_count() == 0) {
+        throw std::runtime_error("No torrents to run");
+      }
+      std::cout << "Session on port " << session.port() << " with "
+                << session.torrent_count() << " torrents" << std::endl;
+      signal(SIGINT, request_stop);
+      signal(SIGTERM, request_stop);
+      while (!stop_requested)
+        session.tick();
+      std::cout << "Stopped session" << std::endl;
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+  // download-batch handle
+  else if (command == "download-batch") {
+    torrent_session::options options;
+    // nothing seeds, and a dead swarm is given up on, so the batch ends
+    // once every download is done or failed
+    options.active_seeds = 0;
+    options.give_up_sec = 600.0;
+    std::vector<std::string> sources;
+    bool valid = true;
+    int arg = 2;
+    try {
+      while (arg < argc) {
+        std::string option = argv[arg];
+        if (option == "--concurrency" && arg + 1 < argc) {
+          options.active_downloads = parse_count(argv[arg + 1], 1);
+          arg += 2;
+        } else if (option == "--give-up" && arg + 1 < argc) {
+          options.give_up_sec = std::stod(argv[arg + 1]) * 60.0;
+          arg += 2;
+        } else if (!parse_session_option(argc, argv, arg, options)) {
+          sources.push_back(option);
+          arg++;
+        }
+      }
+    } catch (const std::exception &) {
+      valid = false;
+    }
+    if (!valid || !valid_session_options(options) || sources.empty() ||
+        !(options.give_up_sec > 0.0)) {
+      std::cerr << "Usage: " << argv[0] << " download-batch " << session_usage
+                << " [--concurrency N] [--give-up MIN] " << bandwidth_usage
+                << " " << queue_depth_usage
+                << " <torrent_file|magnet|directory>..." << std::endl;
+      return 1;
+    }
+
+    try {
+      // a directory stands for the .torrent files in it, in name order
+      std::vector<std::string> torrents;
+      for (const auto &source : sources) {
+        if (!std::filesystem::is_directory(source)) {
+          torrents.push_back(source);
+          continue;
+        }
+        std::vector<std::string> found;
+        for (const auto &file : std::filesystem::directory_iterator(source)) {
+          if (file.is_regular_file() && file.path().extension() == ".torrent")
+            found.push_back(file.path().string());
+        }
+        std::sort(found.begin(), found.end());
+        torrents.insert(torrents.end(), found.begin(), found.end());
+      }
+
+      std::filesystem::create_directories(options.directory);
+      torrent_session session(options);
+      size_t unreadable = 0;
+      for (const auto &torrent : torrents) {
+        try {
+          session.add_torrent(load_torrent(torrent));
+        } catch (const std::exception &e) {
+          std::cerr << torrent << ": " << e.what() << std::endl;
+          unreadable++;
+        }
+      }
+      if (session.torrent_count() == 0)
+        throw std::runtime_error("No torrents to download");
+      std::cout << "Downloading " << session.torrent_count() << " torrents, "
+                << options.active_downloads << " at a time" << std::endl;
+      signal(SIGINT, request_stop);
+      signal(SIGTERM, request_stop);
+      while (!stop_requested && !session.downloads_finished())
+        session.tick();
+
+      size_t complete = 0;
+      json stats = session.stats();
+      for (const auto &torrent : stats["torrents"]) {
+        // a torrent whose check failed never got a count of what is left
+        if (torrent["state"] != "error" &&
+            torrent["left"].get<uint64_t>() == 0)
+          complete++;
+      }
+      size_t total = session.torrent_count() + unreadable;
+      std::cout << "Downloaded " << complete << " of " << total << " torrents"
+                << std::endl;
+      if (complete < total)
+        return 1;
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+  // control handle
+  else if (command == "control") {
+    if (argc < 4 || argc > 5) {
+      std::cerr << "Usage: " << argv[0]
+                << " control <socket> <method> [params_json]" << std::endl;
+      return 1;
+    }
+    try {
+      json request = {{"jsonrpc", "2.0"}, {"id", 1}, {"method", argv[3]}};
+      if (argc == 5)
+        request["params"] = json::parse(argv[4]);
+      std::string path = argv[2];
+      sockaddr_un addr = {};
+      addr.sun_family = AF_UNIX;
+      if (path.size() >= sizeof(addr.sun_path))
+        throw std::runtime_error("Invalid control socket path " + path);
+      std::copy(path.begin(), path.end(), addr.sun_path);
+      int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (fd < 0 ||
+          connect(fd, reinterpret_cast<sockaddr *>(&addr), sizeof(addr)) < 0) {
+        if (fd >= 0)
+          close(fd);
+        throw std::runtime_error("Failed to connect to " + path);
+      }
+      std::string line = request.dump() + "\n";
+      std::string response;
+      bool sent = send(fd, line.data(), line.size(), MSG_NOSIGNAL) ==
+                  static_cast<ssize_t>(line.size());
+      char buffer[65536];
+      ssize_t bytes;
+      while (sent && response.find('\n') == std::string::npos &&
+             (bytes = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+        response.append(buffer, bytes);
+      close(fd);
+      if (response.find('\n') == std::string::npos)
+        throw std::runtime_error("No response from the session");
+      json reply = json::parse(response.substr(0, response.find('\n')));
+      if (reply.contains("error")) {
+        std::cerr << "Error: " << reply["error"].value("message", "")
+                  << std::endl;
+        return 1;
+      }
+      std::cout << reply["result"].dump(2) << std::endl;
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+  // DHT node handle
+  else if (command == "dht_node" || command == "dht_peers") {
+    uint16_t port = default_listen_port;
+    uint16_t announce_port = 0;
+    std::vector<std::string> bootstrap;
+    std::string target;
+    bool valid = true;
+    for (int arg = 2; arg < argc && valid; ++arg) {
+      std::string option = argv[arg];
+      try {
+        if (option == "--port" && arg + 1 < argc)
+          port = static_cast<uint16_t>(std::stoul(argv[++arg]));
+        else if (option == "--bootstrap" && arg + 1 < argc)
+          bootstrap.push_back(argv[++arg]);
+        else if (option == "--announce" && arg + 1 < argc &&
+                 command == "dht_peers")
+          announce_port = static_cast<uint16_t>(std::stoul(argv[++arg]));
+        else if (target.empty() && command == "dht_peers")
+          target = option;
+        else
+          valid = false;
+      } catch (const std::exception &) {
+        valid = false;
+      }
+    }
+    if (!valid || (command == "dht_peers" && target.empty())) {
+      std::cerr << "Usage: " << argv[0]
+                << " dht_node [--port N] [--bootstrap host:port]..."
+                << std::endl
+                << "       " << argv[0]
+                << " dht_peers [--port N] [--bootstrap host:port]... "
+                   "[--announce PORT] <info_hash|torrent_file|magnet>"
+                << std::endl;
+      return 1;
+    }
+
+    try {
+      event_loop loop;
+      udp_socket socket(loop, port);
+      dht_node node(loop, socket);
+      node.bootstrap({}, bootstrap.empty() ? dht_bootstrap_nodes() : bootstrap);
+
+      if (command == "dht_node") {
+        std::cout << "DHT node "
+                  << hex_string(reinterpret_cast<const unsigned char *>(
+                                    node.id().data()),
+                                node.id().size())
+                  << " on port " << node.port() << std::endl;
+        signal(SIGINT, request_stop);
+        signal(SIGTERM, request_stop);
+        size_t reported = 0;
+        while (!stop_requested) {
+          loop.run_once(100);
+          if (node.node_count() != reported) {
+            reported = node.node_count();
+            std::cout << "Routing table: " << reported << " nodes"
+                      << std::endl;
+          }
+        }
+      } else {
+        // a magnet link or a bare hash is enough, no metadata needed
+        std::string info_hash;
+        if (is_magnet_link(target))
+          info_hash = parse_magnet_link(target).info_hash;
+        else if (target.size() == 40 && !std::filesystem::exists(target))
+          info_hash = decode_hex(target);
+        else
+          info_hash = parse_torrent_meta(load_torrent(target)).info_hash;
+
+        bool done = false;
+        node.get_peers(
+            info_hash, announce_port,
+            [](const std::vector<peer_endpoint> &peers) {
+              for (const auto &peer : peers)
+                std::cout << format_endpoint(peer) << std::endl;
+            },
+            [&done] { done = true; });
+        while (!done)
+          loop.run_once(100);
+      }
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+  // fair sharing loopback test handle
+  else if (command == "share_test") {
+    std::vector<double> weights = {1, 2, 4};
+    double rate_kib = 32 * 1024;
+    double seconds = 4;
+    size_t slots = 64;
+    bool valid = true;
+    for (int arg = 2; arg < argc && valid; ++arg) {
+      std::string option = argv[arg];
+      try {
+        if (option == "--weights" && arg + 1 < argc) {
+          weights.clear();
+          std::stringstream list(argv[++arg]);
+          std::string weight;
+          while (std::getline(list, weight, ','))
+            weights.push_back(std::stod(weight));
+        } else if (option == "--rate" && arg + 1 < argc) {
+          rate_kib = std::stod(argv[++arg]);
+        } else if (option == "--seconds" && arg + 1 < argc) {
+          seconds = std::stod(argv[++arg]);
+        } else if (option == "--slots" && arg + 1 < argc) {
+          slots = std::stoul(argv[++arg]);
+        } else {
+          valid = false;
+        }
+      } catch (const std::exception &) {
+        valid = false;
+      }
+    }
+    valid = valid && !weights.empty() && rate_kib > 0 && seconds > 0 &&
+            slots > 0 &&
+            std::all_of(weights.begin(), weights.end(),
+                        [](double weight) { return weight > 0; });
+    if (!valid) {
+      std::cerr << "Usage: " << argv[0]
+                << " share_test [--weights W,W,...] [--rate KiB/s] "
+                   "[--seconds N] [--slots N]"
+                << std::endl;
+      return 1;
+    }
+
+    try {
+      double worst = run_share_test(weights, rate_kib * 1024, seconds, slots);
+      std::cout << "Largest deviation from the weights: " << worst * 100
+                << "%" << std::endl;
+      // a tenth of a flow's share is the most rounding should cost
+      if (worst > 0.1) {
+        std::cerr << "Error: shares do not follow the weights" << std::endl;
+        return 1;
+      }
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+  // rate limit loopback test handle
+  else if (command == "limit_test") {
+    // the peer caps bind uploads and the global cap binds downloads
+    bandwidth_options limits;
+    limits.global.download = 4096 * 1024;
+    limits.peer.upload = 512 * 1024;
+    int peers = 4;
+    double seconds = 4;
+    bool valid = true;
+    int arg = 2;
+    try {
+      while (arg < argc && valid) {
+        std::string option = argv[arg];
+        if (option == "--peers" && arg + 1 < argc) {
+          peers = std::stoi(argv[arg + 1]);
+          arg += 2;
+        } else if (option == "--seconds" && arg + 1 < argc) {
+          seconds = std::stod(argv[arg + 1]);
+          arg += 2;
+        } else if (!parse_rate_option(argc, argv, arg, limits)) {
+          valid = false;
+        }
+      }
+    } catch (const std::exception &) {
+      valid = false;
+    }
+    if (!valid || peers <= 0 || seconds <= 0) {
+      std::cerr << "Usage: " << argv[0] << " limit_test [--peers N] "
+                << "[--seconds N] " << bandwidth_usage << std::endl;
+      return 1;
+    }
+
+    try {
+      double worst = run_limit_test(limits, peers, seconds);
+      std::cout << "Largest deviation from the caps: " << worst * 100 << "%"
+                << std::endl;
+      if (worst > 0.1) {
+        std::cerr << "Error: rates do not follow the caps" << std::endl;
+        return 1;
+      }
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << std::endl;
+      return 1;
+    }
+  }
+  // uTP loopback test handle
+  else if (command == "utp_test") {
+    double loss = 0;
+    int delay_ms = 0;
+    int64_t size = 16 << 20;
+    bool valid = true;
+    for (int arg = 2; arg < argc && valid; ++arg) {
+      std::string option = argv[arg];
+      try {
+        if (option == "--loss" && arg + 1 < argc)
+          loss = std::stod(argv[++arg]);
+        else if (option == "--delay" && arg + 1 < argc)
+          delay_ms = std::stoi(argv[++arg]);
+        else if (option == "--size" && arg + 1 < argc)
+          size = std::stoll(argv[++arg]);
+        else
+          valid = false;
+      } catch (const std::exception &) {
+        valid = false;
+      }
+    }
+    if (!valid || loss < 0 || loss >= 1 || delay_ms < 0 || size <= 0) {
+      std::cerr << "Usage: " << argv[0]
+                << " utp_test [--loss FRACTION] [--delay MS] [--size BYTES]"
+                << std::endl;
+      return 1;
+    }
+
+    try {
+      // two endpoints on loopback whose packets are each dropped with
+      // probability loss and delayed by delay_ms one way
+      event_loop loop;
+      udp_socket receiver_socket(loop, 0), sender_socket(loop, 0);
+      utp_socket_manager receiver(loop, receiver_socket),
+          sender(loop, sender_socket);
+      receiver.set_impairment(loss, std::chrono::milliseconds(delay_ms));
+      sender.set_impairment(loss, std::chrono::milliseconds(delay_ms));
+
+      std::string data(size, '\0');
+      std::mt19937 rng(1);
+      for (auto &byte : data)
+        byte = static_cast<char>(rng());
+      std::string received;
+      bool done = false;
+      receiver.set_accept_handler([&](int fd, const peer_endpoint &) {
+        loop.add(fd, EPOLLIN, [&, fd](uint32_t) {
+          char buffer[65536];
+          ssize_t bytes;
+          while ((bytes = recv(fd, buffer, sizeof(buffer), 0)) > 0)
+            received.append(buffer, bytes);
+          if (bytes == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            loop.remove(fd);
+            close(fd);
+            done = true;
+          }
+        });
+      });
+
+      int out_fd = sender.connect({"127.0.0.1", receiver.port(), AF_INET});
+      size_t sent = 0;
+      loop.add(out_fd, EPOLLOUT, [&](uint32_t) {
+        while (sent < data.size()) {
+          ssize_t bytes = send(out_fd, data.data() + sent, data.size() - sent,
+                               MSG_NOSIGNAL);
+          if (bytes <= 0)
+            return;
+          sent += bytes;
+        }
+        // closing sends FIN once everything is acknowledged
+        loop.remove(out_fd);
+        close(out_fd);
+      });
+
+      auto start = std::chrono::steady_clock::now();
+      while (!done) {
+        if (std::chrono::steady_clock::now() - start > std::chrono::minutes(5))
+          throw std::runtime_error("Transfer timed out");
+        loop.run_once(100);
+      }
+      double seconds = std::chrono::duration<double>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+      if (received != data)
+        throw std::runtime_error("Received data does not match");
+
+      const utp_stats &stats = sender.stats();
+      std::cout << "Transferred " << size << " bytes in " << std::fixed
+                << std::setprecision(2) << seconds << " s ("
+                << size / seconds / (1 << 20) << " MiB/s)" << std::endl;
+      std::cout << "Sender packets: " << stats.packets_sent << " sent, "
+                << stats.packets_resent << " resent, " << stats.timeouts
+                << " timeouts, " << stats.packets_dropped << " dropped"
+                << std::endl;
+    } catch (const std::exception &e) {
+      std::cerr << "Error: " << e.what() << std::endl;
+      return 1;
+    }
+  }
   else {
     std::cerr << "Unknown command: " << command << std::endl;
     return 1;